@@ -0,0 +1,344 @@
+/*
+ * hmatrix.h
+ *
+ * (c)2022 Mark J. Stock <markjstock@gmail.com>
+ *
+ * Hierarchical low-rank (H-matrix) form of a particle interaction matrix, for geometry that
+ *   stays put over many products: a build phase compresses the well-separated blocks with
+ *   adaptive cross approximation (ACA), and every product after that runs from memory in about
+ *   O(N log N). Typical use:
+ *
+ *     std::vector<int32_t> idx(n);   // 0..n-1
+ *     hm_build_tree<3>(pos, idx, h.ttree, 0, n, 64);
+ *     ...put the target and source arrays in idx order...
+ *     h.stree = h.ttree;
+ *     hm_fit_boxes<3>(srcpos, h.stree);   // only if the sources are not the targets
+ *     hm_build(h, kernel, eta, tol);      // kernel(i, j, vals) fills NC values
+ *     hm_matvec(h, str, scratch, vel);    // as often as needed
+ *
+ * The matrix rows are the NC output components of each target (all of component 0, then 1...),
+ *   so one low-rank factor pair serves every component. Entries are stored as float.
+ */
+
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <omp.h>
+
+
+// -------------------------
+// cluster tree: recursive bisection of the longest box side at the median
+
+template <int DIM>
+struct HCluster {
+  int32_t begin, end;
+  float lo[DIM], hi[DIM];
+  int32_t child[2];
+  bool leaf() const { return child[0] < 0; }
+  int32_t size() const { return end - begin; }
+  double diam() const {
+    double d = 0.0;
+    for (int c=0; c<DIM; ++c) d += (hi[c]-lo[c])*(hi[c]-lo[c]);
+    return std::sqrt(d);
+  }
+};
+
+// build the tree over points _x[0.._DIM-1] given by _idx, which it reorders into tree order
+template <int DIM>
+inline int32_t hm_build_tree(const std::vector<float>* _x, std::vector<int32_t>& _idx,
+                             std::vector<HCluster<DIM>>& _tree,
+                             const int32_t _begin, const int32_t _end, const int32_t _leaf) {
+  const int32_t me = _tree.size();
+  _tree.push_back(HCluster<DIM>());
+  HCluster<DIM> c;
+  c.begin = _begin;
+  c.end = _end;
+  c.child[0] = c.child[1] = -1;
+  for (int d=0; d<DIM; ++d) {
+    c.lo[d] = c.hi[d] = _x[d][_idx[_begin]];
+    for (int32_t i=_begin; i<_end; ++i) {
+      c.lo[d] = std::min(c.lo[d], _x[d][_idx[i]]);
+      c.hi[d] = std::max(c.hi[d], _x[d][_idx[i]]);
+    }
+  }
+
+  if (_end - _begin > _leaf) {
+    int axis = 0;
+    for (int d=1; d<DIM; ++d) if (c.hi[d]-c.lo[d] > c.hi[axis]-c.lo[axis]) axis = d;
+    const int32_t mid = _begin + (_end-_begin)/2;
+    const std::vector<float>& coord = _x[axis];
+    std::nth_element(_idx.begin()+_begin, _idx.begin()+mid, _idx.begin()+_end,
+                     [&](int32_t a, int32_t b) { return coord[a] < coord[b]; });
+    c.child[0] = hm_build_tree(_x, _idx, _tree, _begin, mid, _leaf);
+    c.child[1] = hm_build_tree(_x, _idx, _tree, mid, _end, _leaf);
+  }
+  _tree[me] = c;
+  return me;
+}
+
+// refit every box of a tree to other points already in its order, keeping the index ranges
+template <int DIM>
+inline void hm_fit_boxes(const std::vector<float>* _x, std::vector<HCluster<DIM>>& _tree) {
+  for (HCluster<DIM>& c : _tree) {
+    for (int d=0; d<DIM; ++d) {
+      const auto range = std::minmax_element(_x[d].begin()+c.begin, _x[d].begin()+c.end);
+      c.lo[d] = *range.first;
+      c.hi[d] = *range.second;
+    }
+  }
+}
+
+// distance between two boxes, zero if they touch
+template <int DIM>
+inline double hm_box_distance(const HCluster<DIM>& _a, const HCluster<DIM>& _b) {
+  double d = 0.0;
+  for (int c=0; c<DIM; ++c) {
+    const double gap = std::max(0.0, std::max((double)_a.lo[c]-_b.hi[c], (double)_b.lo[c]-_a.hi[c]));
+    d += gap*gap;
+  }
+  return std::sqrt(d);
+}
+
+// -------------------------
+// the H-matrix: a list of blocks that tile the whole matrix
+
+struct HBlock {
+  int32_t t, s;			// target and source clusters
+  int32_t rank;			// -1 for a dense block
+  std::vector<float> u;	// dense: rows x cols, row-major; low-rank: rank columns of length rows
+  std::vector<float> v;	// low-rank: rank rows of length cols
+};
+
+// target and source trees share their index ranges, and differ only in their boxes
+template <int DIM, int NC>
+struct Hmatrix {
+  std::vector<HCluster<DIM>> ttree, stree;
+  std::vector<HBlock> blocks;
+  size_t far_bytes = 0, near_bytes = 0;
+  int32_t nfar = 0, nnear = 0;
+  double ranksum = 0.0;
+};
+
+template <int DIM, int NC>
+inline void hm_partition(Hmatrix<DIM,NC>& _h, const int32_t _t, const int32_t _s, const double _eta) {
+  const HCluster<DIM>& t = _h.ttree[_t];
+  const HCluster<DIM>& s = _h.stree[_s];
+  const double dist = hm_box_distance(t, s);
+  if (dist > 0.0 and std::max(t.diam(), s.diam()) <= _eta*dist) {
+    _h.blocks.push_back(HBlock{_t, _s, 0, {}, {}});
+  } else if (t.leaf() and s.leaf()) {
+    _h.blocks.push_back(HBlock{_t, _s, -1, {}, {}});
+  } else if (t.leaf() or (not s.leaf() and s.size() > t.size())) {
+    hm_partition(_h, _t, s.child[0], _eta);
+    hm_partition(_h, _t, s.child[1], _eta);
+  } else {
+    hm_partition(_h, t.child[0], _s, _eta);
+    hm_partition(_h, t.child[1], _s, _eta);
+  }
+}
+
+// fill a dense block
+template <int DIM, int NC, class K>
+inline void hm_fill_dense(const K& _kernel, const HCluster<DIM>& _t, const HCluster<DIM>& _s, HBlock& _b) {
+  const int32_t m = _t.size(), n = _s.size();
+  _b.rank = -1;
+  _b.u.resize((size_t)NC*m*n);
+  double vals[NC];
+  for (int32_t i=0; i<m; ++i) {
+    for (int32_t j=0; j<n; ++j) {
+      _kernel(_t.begin+i, _s.begin+j, vals);
+      for (int c=0; c<NC; ++c) _b.u[((size_t)c*m+i)*n+j] = vals[c];
+    }
+  }
+}
+
+// ACA with partial pivoting: add one cross (a column times a row of the residual) at a time
+//   until the newest one is small against the running Frobenius norm estimate; falls back to
+//   a dense block when the factors would not save memory
+template <int DIM, int NC, class K>
+inline void hm_fill_aca(const K& _kernel, const HCluster<DIM>& _t, const HCluster<DIM>& _s,
+                        const double _tol, HBlock& _b) {
+  const int32_t m = _t.size(), n = _s.size();
+  const int32_t rows = NC*m;
+  const int32_t kmax = ((size_t)rows*n) / (rows+n);
+  std::vector<std::vector<double>> us, vs;
+  std::vector<char> used(rows, 0);
+  std::vector<double> row(n), col(rows);
+  double vals[NC];
+  double normsq = 0.0;
+  int32_t pivot = 0;
+  bool converged = false;
+
+  for (int32_t tries=0; tries<rows and (int32_t)us.size()<kmax; ++tries) {
+    // residual row at the pivot
+    used[pivot] = 1;
+    const int32_t comp = pivot / m, ti = pivot % m;
+    for (int32_t j=0; j<n; ++j) {
+      _kernel(_t.begin+ti, _s.begin+j, vals);
+      row[j] = vals[comp];
+    }
+    for (size_t k=0; k<us.size(); ++k) {
+      const double f = us[k][pivot];
+      for (int32_t j=0; j<n; ++j) row[j] -= f * vs[k][j];
+    }
+    int32_t jp = 0;
+    for (int32_t j=1; j<n; ++j) if (std::abs(row[j]) > std::abs(row[jp])) jp = j;
+
+    if (std::abs(row[jp]) < 1.e-30) {
+      // this row is already reproduced exactly, try another
+      pivot = std::find(used.begin(), used.end(), 0) - used.begin();
+      if (pivot >= rows) {
+        converged = true;
+        break;
+      }
+      continue;
+    }
+
+    // residual column at the pivot column
+    for (int32_t i=0; i<m; ++i) {
+      _kernel(_t.begin+i, _s.begin+jp, vals);
+      for (int c=0; c<NC; ++c) col[c*m+i] = vals[c];
+    }
+    for (size_t k=0; k<us.size(); ++k) {
+      const double f = vs[k][jp];
+      for (int32_t i=0; i<rows; ++i) col[i] -= f * us[k][i];
+    }
+    const double inv = 1.0 / row[jp];
+    for (int32_t j=0; j<n; ++j) row[j] *= inv;
+
+    // update the norm estimate of the approximation
+    double unew = 0.0, vnew = 0.0;
+    for (int32_t i=0; i<rows; ++i) unew += col[i]*col[i];
+    for (int32_t j=0; j<n; ++j) vnew += row[j]*row[j];
+    for (size_t k=0; k<us.size(); ++k) {
+      double uu = 0.0, vv = 0.0;
+      for (int32_t i=0; i<rows; ++i) uu += us[k][i]*col[i];
+      for (int32_t j=0; j<n; ++j) vv += vs[k][j]*row[j];
+      normsq += 2.0*uu*vv;
+    }
+    normsq += unew*vnew;
+    us.push_back(col);
+    vs.push_back(row);
+
+    if (std::sqrt(unew*vnew) <= _tol*std::sqrt(normsq)) {
+      converged = true;
+      break;
+    }
+
+    // next pivot is the largest unused entry of the new column
+    pivot = -1;
+    for (int32_t i=0; i<rows; ++i) {
+      if (not used[i] and (pivot < 0 or std::abs(col[i]) > std::abs(col[pivot]))) pivot = i;
+    }
+    if (pivot < 0) {
+      converged = true;
+      break;
+    }
+  }
+
+  if (not converged) {
+    hm_fill_dense<DIM,NC>(_kernel, _t, _s, _b);
+    return;
+  }
+
+  const int32_t k = us.size();
+  _b.rank = k;
+  _b.u.resize((size_t)k*rows);
+  _b.v.resize((size_t)k*n);
+  for (int32_t l=0; l<k; ++l) {
+    std::copy(us[l].begin(), us[l].end(), _b.u.begin()+(size_t)l*rows);
+    std::copy(vs[l].begin(), vs[l].end(), _b.v.begin()+(size_t)l*n);
+  }
+}
+
+// partition the matrix and fill every block; _kernel(i, j, vals) gets tree-order indices
+template <int DIM, int NC, class K>
+inline void hm_build(Hmatrix<DIM,NC>& _h, const K& _kernel, const double _eta, const double _tol) {
+  hm_partition(_h, 0, 0, _eta);
+
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t b=0; b<_h.blocks.size(); ++b) {
+    HBlock& blk = _h.blocks[b];
+    if (blk.rank < 0) hm_fill_dense<DIM,NC>(_kernel, _h.ttree[blk.t], _h.stree[blk.s], blk);
+    else hm_fill_aca<DIM,NC>(_kernel, _h.ttree[blk.t], _h.stree[blk.s], _tol, blk);
+  }
+
+  for (const HBlock& blk : _h.blocks) {
+    const size_t bytes = (blk.u.size() + blk.v.size()) * sizeof(float);
+    if (blk.rank < 0) {
+      _h.near_bytes += bytes;
+      _h.nnear++;
+    } else {
+      _h.far_bytes += bytes;
+      _h.nfar++;
+      _h.ranksum += blk.rank;
+    }
+  }
+}
+
+// the product with source strengths _str (in tree order) into _out[0..NC-1]; each thread adds
+//   into its own copy of the output, then those are summed, so blocks that share targets never
+//   collide
+template <int DIM, int NC>
+inline void hm_matvec(const Hmatrix<DIM,NC>& _h, const float* _str, std::vector<float>& _scratch,
+                      float* const _out[NC]) {
+  const int32_t n = _h.ttree[0].size();
+  const int32_t nthreads = omp_get_max_threads();
+  _scratch.assign((size_t)nthreads*NC*n, 0.0f);
+
+  #pragma omp parallel
+  {
+    float* const out = &_scratch[(size_t)omp_get_thread_num()*NC*n];
+    std::vector<float> tmp;
+
+    #pragma omp for schedule(dynamic, 16)
+    for (size_t b=0; b<_h.blocks.size(); ++b) {
+      const HBlock& blk = _h.blocks[b];
+      const HCluster<DIM>& t = _h.ttree[blk.t];
+      const HCluster<DIM>& s = _h.stree[blk.s];
+      const int32_t m = t.size(), ns = s.size(), rows = NC*m;
+      const float* const str = &_str[s.begin];
+
+      if (blk.rank < 0) {
+        for (int32_t r=0; r<rows; ++r) {
+          const float* const a = &blk.u[(size_t)r*ns];
+          float sum = 0.0f;
+          #pragma omp simd reduction(+:sum)
+          for (int32_t j=0; j<ns; ++j) sum += a[j]*str[j];
+          out[(size_t)(r/m)*n + t.begin + r%m] += sum;
+        }
+      } else {
+        tmp.assign(blk.rank, 0.0f);
+        for (int32_t l=0; l<blk.rank; ++l) {
+          const float* const v = &blk.v[(size_t)l*ns];
+          float sum = 0.0f;
+          #pragma omp simd reduction(+:sum)
+          for (int32_t j=0; j<ns; ++j) sum += v[j]*str[j];
+          tmp[l] = sum;
+        }
+        for (int c=0; c<NC; ++c) {
+          float* const o = &out[(size_t)c*n + t.begin];
+          for (int32_t l=0; l<blk.rank; ++l) {
+            const float* const u = &blk.u[(size_t)l*rows + c*m];
+            const float f = tmp[l];
+            #pragma omp simd
+            for (int32_t i=0; i<m; ++i) o[i] += f*u[i];
+          }
+        }
+      }
+    }
+
+    // sum the per-thread copies
+    #pragma omp for
+    for (int32_t i=0; i<n; ++i) {
+      for (int c=0; c<NC; ++c) {
+        float sum = 0.0f;
+        for (int32_t th=0; th<nthreads; ++th) sum += _scratch[((size_t)th*NC+c)*n+i];
+        _out[c][i] = sum;
+      }
+    }
+  }
+}
@@ -0,0 +1,186 @@
+/*
+ * ngAuto.cpp
+ *
+ * (c)2022 Mark J. Stock <markjstock@gmail.com>
+ *
+ * how well an NGRAV_AUTO solver picks its method: over a range of sizes, on a uniform cube and
+ *   on a centrally condensed (Plummer) cluster, each with positive strengths and with strengths of
+ *   both signs, time the automatic choice against every method forced in turn, and report the
+ *   cost model's prediction and the error against the direct sum
+ */
+
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <omp.h>
+
+#include "ngrav.h"
+
+
+static void usage() {
+  fprintf(stderr, "Usage: ngAuto.bin [-c] [-e=<tolerance>] [-n=<smallest>] [-m=<largest>]\n");
+  fprintf(stderr, "  -c  recalibrate this host first\n");
+  fprintf(stderr, "  -e  relative rms error allowed, 0 for direct sums only\n");
+  fprintf(stderr, "  sizes go up by factors of 4 from the smallest to the largest\n");
+  exit(1);
+}
+
+static void check(const int32_t _err, const char* _what) {
+  if (_err != NGRAV_OK) {
+    fprintf(stderr, "%s failed: %s\n", _what, ngrav_error_string(_err));
+    exit(EXIT_FAILURE);
+  }
+}
+
+static const char* method_name(const int32_t _m) {
+  switch (_m) {
+    case NGRAV_METHOD_SERIAL:  return "serial";
+    case NGRAV_METHOD_THREADS: return "threads";
+    case NGRAV_METHOD_GPU:     return "gpu";
+    case NGRAV_METHOD_TREE:    return "tree";
+    default:                   return "auto";
+  }
+}
+
+// the mean of enough evaluations to take at least a tenth of a second, and the method of the last
+static double time_evaluate(ngrav_solver* _s, std::vector<float>& _u, std::vector<float>& _v,
+                            std::vector<float>& _w, int32_t& _method, double& _predicted) {
+  int32_t reps = 0;
+  double total = 0.0;
+  while (total < 0.1) {
+    const auto start = std::chrono::system_clock::now();
+    check(ngrav_evaluate(_s, _u.data(), _v.data(), _w.data()), "evaluate");
+    const std::chrono::duration<double> elapsed = std::chrono::system_clock::now() - start;
+    total += elapsed.count();
+    reps++;
+  }
+  check(ngrav_last_method(_s, &_method, &_predicted), "last_method");
+  return total / reps;
+}
+
+// the relative rms error of one set of velocities against the reference
+static double rms_error(const std::vector<float>& _u, const std::vector<float>& _v, const std::vector<float>& _w,
+                        const std::vector<float>& _du, const std::vector<float>& _dv, const std::vector<float>& _dw) {
+  double esum = 0.0, vsum = 0.0;
+  for (size_t i=0; i<_u.size(); ++i) {
+    esum += std::pow(_u[i]-_du[i],2) + std::pow(_v[i]-_dv[i],2) + std::pow(_w[i]-_dw[i],2);
+    vsum += (double)_du[i]*_du[i] + (double)_dv[i]*_dv[i] + (double)_dw[i]*_dw[i];
+  }
+  return std::sqrt(esum/vsum);
+}
+
+int main(int argc, char **argv) {
+
+  bool recalibrate = false;
+  float tol = 1.e-3;
+  int32_t nmin = 256;
+  int32_t nmax = 65536;
+
+  for (int i=1; i<argc; i++) {
+    if (strncmp(argv[i], "-c", 2) == 0) {
+      recalibrate = true;
+    } else if (strncmp(argv[i], "-e=", 3) == 0) {
+      tol = atof(argv[i]+3);
+      if (tol < 0.0) usage();
+    } else if (strncmp(argv[i], "-n=", 3) == 0) {
+      int32_t num = atoi(argv[i]+3);
+      if (num < 1) usage();
+      nmin = num;
+    } else if (strncmp(argv[i], "-m=", 3) == 0) {
+      int32_t num = atoi(argv[i]+3);
+      if (num < 1) usage();
+      nmax = num;
+    } else {
+      usage();
+    }
+  }
+  if (nmax < nmin) usage();
+
+  if (recalibrate) {
+    const auto start = std::chrono::system_clock::now();
+    check(ngrav_calibrate(nullptr), "calibrate");
+    const std::chrono::duration<double> elapsed = std::chrono::system_clock::now() - start;
+    printf( "calibrated this host in %g s\n", elapsed.count());
+  }
+
+  printf( "automatic method choice with tolerance %g on %d threads\n", tol, omp_get_max_threads());
+  printf( "  distribution           n   choice  predicted   measured     best    time  slowdown    error\n");
+
+  std::mt19937 rng(1234);
+  std::uniform_real_distribution<float> xrand(0.0,1.0);
+
+  for (const int32_t dist : {0, 1, 2, 3}) {
+    const bool cluster = (dist > 1);
+    const bool sign = (dist % 2 == 1);
+    for (int32_t n=nmin; n<=nmax; n*=4) {
+
+      // a unit cube, or a Plummer sphere of scale 0.1 cut off at 10 scale lengths, with positive
+      //   strengths or strengths of both signs
+      std::vector<float> x(n), y(n), z(n), s(n), r(n);
+      for (int32_t i=0; i<n; ++i) {
+        if (cluster) {
+          float rad = 1.e30;
+          while (rad > 1.0) rad = 0.1 / std::sqrt(std::pow(xrand(rng), -2.0/3.0) - 1.0);
+          const float ct = 2.0*xrand(rng) - 1.0;
+          const float st = std::sqrt(1.0 - ct*ct);
+          const float phi = 2.0*3.1415926536*xrand(rng);
+          x[i] = rad*st*std::cos(phi);
+          y[i] = rad*st*std::sin(phi);
+          z[i] = rad*ct;
+        } else {
+          x[i] = xrand(rng);
+          y[i] = xrand(rng);
+          z[i] = xrand(rng);
+        }
+        s[i] = (sign ? 2.0*xrand(rng)-1.0 : xrand(rng)) / std::sqrt(n);
+        r[i] = (2./3.) / std::sqrt(n);
+      }
+
+      ngrav_solver* solver = ngrav_create(n, NGRAV_AUTO);
+      if (not solver) {
+        fprintf(stderr, "Could not create solver!\n");
+        exit(EXIT_FAILURE);
+      }
+      check(ngrav_set_tolerance(solver, tol), "set_tolerance");
+      check(ngrav_set_sources(solver, n, x.data(), y.data(), z.data(), s.data(), r.data()), "set_sources");
+      std::vector<float> u(n), v(n), w(n), du(n), dv(n), dw(n);
+
+      // the direct sum on the team is the reference
+      int32_t method;
+      double predicted;
+      check(ngrav_set_method(solver, NGRAV_METHOD_THREADS), "set_method");
+      check(ngrav_evaluate(solver, du.data(), dv.data(), dw.data()), "evaluate");
+
+      // every method forced in turn, and the automatic choice last
+      double best = 1.e30;
+      int32_t bestm = NGRAV_METHOD_SERIAL;
+      for (const int32_t m : {NGRAV_METHOD_SERIAL, NGRAV_METHOD_THREADS, NGRAV_METHOD_GPU, NGRAV_METHOD_TREE}) {
+        if (ngrav_set_method(solver, m) != NGRAV_OK) continue;
+        // a forced treecode only counts if the tolerance allows one at all
+        if (m == NGRAV_METHOD_TREE and tol <= 0.0) continue;
+        const double t = time_evaluate(solver, u, v, w, method, predicted);
+        // nor does one that misses the tolerance, since the automatic choice may not take it
+        if (m == NGRAV_METHOD_TREE and rms_error(u, v, w, du, dv, dw) > tol) continue;
+        if (t < best) {
+          best = t;
+          bestm = m;
+        }
+      }
+      check(ngrav_set_method(solver, NGRAV_METHOD_AUTO), "set_method");
+      const double t = time_evaluate(solver, u, v, w, method, predicted);
+
+      printf( "  %-15s %8d  %7s  %9.3e  %9.3e  %7s  %9.3e  %6.2f  %9.3e\n", (std::string(cluster ? "plummer" : "uniform") + (sign ? " signed" : "")).c_str(), n,
+              method_name(method), predicted, t, method_name(bestm), best, t/best, rms_error(u, v, w, du, dv, dw));
+      fflush(stdout);
+      ngrav_destroy(solver);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,375 @@
+/*
+ * ngDaemon.cpp
+ *
+ * (c)2022 Mark J. Stock <markjstock@gmail.com>
+ *
+ * a resident evaluation server: one warm ngrav solver behind a Unix domain socket, taking
+ *   batches of problems in shared memory (see ngdaemon.h); the same program is also a client
+ *   that measures request latency and throughput against a cold start
+ */
+
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+
+#include <poll.h>
+#include <spawn.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "ngrav.h"
+#include "ngdaemon.h"
+
+extern char **environ;
+
+
+// fill a problem's sources with the same distribution as the other programs
+static void make_sources(const int32_t _n, const uint32_t _seed, float* _p) {
+  std::mt19937 rng(_seed);
+  std::uniform_real_distribution<float> xrand(0.0,1.0);
+  const float thisstrmag = 1.0 / std::sqrt(_n);
+  const float thisrad    = (2./3.) / std::sqrt(_n);
+  for (int32_t i = 0; i < 3*_n; ++i) _p[i] = xrand(rng);
+  for (int32_t i = 0; i < _n; ++i)   _p[3*_n+i] = thisstrmag * xrand(rng);
+  for (int32_t i = 0; i < _n; ++i)   _p[4*_n+i] = thisrad;
+}
+
+// -------------------------
+// the server
+
+// one connected client and the buffer it shared with us
+struct Client {
+  int sock = -1;
+  char* base = nullptr;
+  size_t len = 0;
+};
+
+static void drop_client(Client& _c) {
+  if (_c.base) munmap(_c.base, _c.len);
+  close(_c.sock);
+  _c = Client();
+}
+
+static int serve(const char* _path, const int32_t _where) {
+
+  const int lsock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, _path, sizeof(addr.sun_path)-1);
+  unlink(_path);
+  if (lsock < 0 or bind(lsock, (struct sockaddr*)&addr, sizeof(addr)) != 0 or listen(lsock, 16) != 0) {
+    fprintf(stderr, "Could not listen on %s!\n", _path);
+    exit(EXIT_FAILURE);
+  }
+
+  // the solver grows when a bigger problem arrives, and otherwise lives as long as we do
+  int32_t capacity = 1024;
+  ngrav_solver* solver = ngrav_create(capacity, _where);
+  if (not solver) {
+    fprintf(stderr, "Could not create solver!\n");
+    exit(EXIT_FAILURE);
+  }
+  printf( "serving on %s with a warm %s solver\n", _path, _where == NGRAV_GPU ? "GPU" : "CPU");
+  fflush(stdout);
+
+  std::vector<Client> clients;
+  uint64_t nrequests = 0, nproblems = 0;
+  double busy = 0.0;
+  bool running = true;
+
+  while (running) {
+    std::vector<struct pollfd> pfds(1 + clients.size());
+    pfds[0] = {lsock, POLLIN, 0};
+    for (size_t c=0; c<clients.size(); ++c) pfds[1+c] = {clients[c].sock, POLLIN, 0};
+    if (poll(pfds.data(), pfds.size(), -1) < 0) continue;
+
+    if (pfds[0].revents & POLLIN) {
+      Client c;
+      c.sock = accept4(lsock, nullptr, nullptr, SOCK_CLOEXEC);
+      if (c.sock >= 0) clients.push_back(c);
+    }
+
+    for (size_t ic=0; ic<pfds.size()-1 and running; ++ic) {
+      if (not pfds[1+ic].revents) continue;
+      Client& c = clients[ic];
+      NgdRequest req;
+      int fd;
+      if (not ngd_recv(c.sock, req, fd)) {
+        drop_client(c);
+        continue;
+      }
+      ++nrequests;
+      NgdReply rep = {-1, 0, 0.0};
+
+      if (req.op == NGD_ATTACH and fd >= 0) {
+        if (c.base) munmap(c.base, c.len);
+        c.base = nullptr;
+        c.len = 0;
+        // a file smaller than claimed, or one that could shrink later, would fault us mid-request
+        struct stat st;
+        const int seals = fcntl(fd, F_GET_SEALS);
+        if (req.bytes > 0 and fstat(fd, &st) == 0 and (uint64_t)st.st_size >= req.bytes
+            and seals >= 0 and (seals & F_SEAL_SHRINK)) {
+          void* p = mmap(nullptr, req.bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+          if (p != MAP_FAILED) {
+            c.base = static_cast<char*>(p);
+            c.len = req.bytes;
+            rep.status = NGRAV_OK;
+          }
+        }
+
+      } else if (req.op == NGD_EVAL and c.base and ngd_table_bytes(req.nitems) <= c.len) {
+        const auto start = std::chrono::steady_clock::now();
+        const NgdItem* items = reinterpret_cast<const NgdItem*>(c.base);
+        rep.status = NGRAV_OK;
+        for (uint32_t k=0; k<req.nitems and rep.status == NGRAV_OK; ++k) {
+          const NgdItem it = items[k];
+          if (it.nsrc < 1 or it.ntarg < 0 or it.offset % sizeof(float) != 0 or it.offset > c.len
+              or ngd_item_floats(it.nsrc, it.ntarg) > (c.len - it.offset)/sizeof(float)) {
+            rep.status = -1;
+            break;
+          }
+          if (std::max(it.nsrc, it.ntarg) > capacity) {
+            ngrav_destroy(solver);
+            capacity = std::max(2*capacity, std::max(it.nsrc, it.ntarg));
+            solver = ngrav_create(capacity, _where);
+            if (not solver) {
+              fprintf(stderr, "Could not grow solver to %d!\n", capacity);
+              exit(EXIT_FAILURE);
+            }
+          }
+          float* p = reinterpret_cast<float*>(c.base + it.offset);
+          const int32_t ns = it.nsrc, nt = it.ntarg;
+          const int32_t nout = nt > 0 ? nt : ns;
+          float* out = p + 5*ns + 4*nt;
+          rep.status = ngrav_set_sources(solver, ns, p, p+ns, p+2*ns, p+3*ns, p+4*ns);
+          if (rep.status == NGRAV_OK) {
+            float* t = p + 5*ns;
+            rep.status = (nt > 0) ? ngrav_set_targets(solver, nt, t, t+nt, t+2*nt, t+3*nt)
+                                  : ngrav_set_targets(solver, 0, nullptr, nullptr, nullptr, nullptr);
+          }
+          if (rep.status == NGRAV_OK) rep.status = ngrav_evaluate(solver, out, out+nout, out+2*nout);
+          if (rep.status == NGRAV_OK) ++rep.ndone;
+        }
+        rep.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        busy += rep.seconds;
+        nproblems += rep.ndone;
+
+      } else if (req.op == NGD_QUIT) {
+        rep.status = NGRAV_OK;
+        running = false;
+      }
+
+      if (fd >= 0) close(fd);
+      if (send(c.sock, &rep, sizeof(rep), MSG_NOSIGNAL) != (ssize_t)sizeof(rep)) drop_client(c);
+    }
+
+    // forget the clients that went away
+    clients.erase(std::remove_if(clients.begin(), clients.end(), [](const Client& _c) { return _c.sock < 0; }), clients.end());
+  }
+
+  for (Client& c : clients) drop_client(c);
+  ngrav_destroy(solver);
+  close(lsock);
+  unlink(_path);
+  printf( "served %lu requests and %lu problems, computing for ( %g s )\n",
+          (unsigned long)nrequests, (unsigned long)nproblems, busy);
+  return 0;
+}
+
+// -------------------------
+// one cold evaluation, as a standalone post-processing tool would do it
+
+static int oneshot(const int32_t _n, const int32_t _where) {
+  std::vector<float> p(5*_n), u(_n), v(_n), w(_n);
+  make_sources(_n, 1234, p.data());
+  ngrav_solver* s = ngrav_create(_n, _where);
+  if (not s) return EXIT_FAILURE;
+  int32_t err = ngrav_set_sources(s, _n, &p[0], &p[_n], &p[2*_n], &p[3*_n], &p[4*_n]);
+  if (err == NGRAV_OK) err = ngrav_evaluate(s, u.data(), v.data(), w.data());
+  ngrav_destroy(s);
+  return (err == NGRAV_OK) ? 0 : EXIT_FAILURE;
+}
+
+// -------------------------
+// the benchmarking client
+
+static double seconds_since(const std::chrono::steady_clock::time_point& _t) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - _t).count();
+}
+
+static int bench(const char* _path, const int32_t _nbatch, const std::vector<int32_t>& _sizes,
+                 const int32_t _where, const bool _quit) {
+
+  const int sock = ngd_connect(_path);
+  if (sock < 0) {
+    fprintf(stderr, "Could not connect to %s!\n", _path);
+    exit(EXIT_FAILURE);
+  }
+
+  // one shared buffer, big enough for a batch of the largest size
+  const int32_t nmax = *std::max_element(_sizes.begin(), _sizes.end());
+  const size_t bytes = ngd_table_bytes(_nbatch) + _nbatch*ngd_item_bytes(nmax, 0);
+  const int mfd = memfd_create("ngrav", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (mfd < 0 or ftruncate(mfd, bytes) != 0 or fcntl(mfd, F_ADD_SEALS, F_SEAL_SHRINK) != 0) {
+    fprintf(stderr, "Could not create shared memory!\n");
+    exit(EXIT_FAILURE);
+  }
+  char* base = static_cast<char*>(mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0));
+  NgdReply rep;
+  if (base == MAP_FAILED or not ngd_call(sock, NgdRequest{NGD_ATTACH, 0, bytes}, mfd, rep) or rep.status != NGRAV_OK) {
+    fprintf(stderr, "Could not share memory with the server!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  printf( "client of %s, %d problems per request, %s solver\n", _path, _nbatch, _where == NGRAV_GPU ? "GPU" : "CPU");
+
+  // the round trip alone
+  const int32_t nping = 1000;
+  auto start = std::chrono::steady_clock::now();
+  for (int32_t r=0; r<nping; ++r) ngd_call(sock, NgdRequest{NGD_EVAL, 0, 0}, -1, rep);
+  printf( "  empty request latency( %g us )\n", 1.e+6*seconds_since(start)/nping);
+
+  char self[4096];
+  const ssize_t sl = readlink("/proc/self/exe", self, sizeof(self)-1);
+  self[std::max((ssize_t)0, sl)] = '\0';
+
+  printf( "  %8s %8s %14s %14s %14s %14s %14s\n", "n", "requests", "latency (us)", "server (us)",
+          "Ginteract/s", "cold lib (us)", "cold proc (us)");
+  double maxdiff = 0.0;
+  for (const int32_t n : _sizes) {
+
+    // lay out the batch
+    NgdItem* items = reinterpret_cast<NgdItem*>(base);
+    size_t off = ngd_table_bytes(_nbatch);
+    for (int32_t k=0; k<_nbatch; ++k) {
+      items[k] = NgdItem{off, n, 0};
+      make_sources(n, 1234+k, reinterpret_cast<float*>(base + off));
+      off += ngd_item_bytes(n, 0);
+    }
+
+    // warm up, then time
+    const int32_t nreq = std::max(3, (int32_t)(2.e+7 / ((double)n*n*_nbatch)));
+    ngd_call(sock, NgdRequest{NGD_EVAL, (uint32_t)_nbatch, 0}, -1, rep);
+
+    // the server's answer for the first problem should match an evaluation in this process
+    {
+      const float* p = reinterpret_cast<const float*>(base + items[0].offset);
+      const float* out = p + 5*n;
+      std::vector<float> u(n), v(n), w(n);
+      ngrav_solver* s = ngrav_create(n, _where);
+      ngrav_set_sources(s, n, p, p+n, p+2*n, p+3*n, p+4*n);
+      ngrav_evaluate(s, u.data(), v.data(), w.data());
+      ngrav_destroy(s);
+      for (int32_t i=0; i<n; ++i) {
+        maxdiff = std::max(maxdiff, (double)std::abs(u[i]-out[i]) + std::abs(v[i]-out[n+i]) + std::abs(w[i]-out[2*n+i]));
+      }
+    }
+
+    double servertime = 0.0;
+    start = std::chrono::steady_clock::now();
+    for (int32_t r=0; r<nreq; ++r) {
+      if (not ngd_call(sock, NgdRequest{NGD_EVAL, (uint32_t)_nbatch, 0}, -1, rep) or rep.status != NGRAV_OK) {
+        fprintf(stderr, "Request failed!\n");
+        exit(EXIT_FAILURE);
+      }
+      servertime += rep.seconds;
+    }
+    const double latency = seconds_since(start) / nreq;
+
+    // the same work started cold, in this process and as a new process
+    const int32_t ncold = std::max(3, nreq/4);
+    start = std::chrono::steady_clock::now();
+    for (int32_t r=0; r<ncold; ++r) {
+      for (int32_t k=0; k<_nbatch; ++k) oneshot(n, _where);
+    }
+    const double coldlib = seconds_since(start) / ncold;
+
+    char narg[32];
+    snprintf(narg, sizeof(narg), "-n=%d", n);
+    std::vector<char*> args = {self, const_cast<char*>("-1"), narg};
+    if (_where == NGRAV_GPU) args.push_back(const_cast<char*>("-g"));
+    args.push_back(nullptr);
+    start = std::chrono::steady_clock::now();
+    for (int32_t r=0; r<ncold; ++r) {
+      for (int32_t k=0; k<_nbatch; ++k) {
+        pid_t pid;
+        if (posix_spawn(&pid, self, nullptr, nullptr, args.data(), environ) == 0) waitpid(pid, nullptr, 0);
+      }
+    }
+    const double coldproc = seconds_since(start) / ncold;
+
+    printf( "  %8d %8d %14.2f %14.2f %14.4f %14.2f %14.2f\n", n, nreq, 1.e+6*latency, 1.e+6*servertime/nreq,
+            1.e-9*(double)n*n*_nbatch/latency, 1.e+6*coldlib, 1.e+6*coldproc);
+  }
+
+  printf( "  max difference from evaluating in this process ( %g )\n", maxdiff);
+
+  if (_quit) ngd_call(sock, NgdRequest{NGD_QUIT, 0, 0}, -1, rep);
+  munmap(base, bytes);
+  close(mfd);
+  close(sock);
+  return 0;
+}
+
+// main program
+
+static void usage() {
+  fprintf(stderr, "Usage: ngDaemon.bin -s=<socket> [-g]                        run the server\n");
+  fprintf(stderr, "       ngDaemon.bin -c=<socket> [-n=<num parts>] [-b=<batch>] [-q]  benchmark against it\n");
+  fprintf(stderr, "  -g  the server (or one-shot runs) use the GPU\n");
+  fprintf(stderr, "  -b  problems per request\n");
+  fprintf(stderr, "  -q  stop the server when done\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+
+  const char* serverpath = nullptr;
+  const char* clientpath = nullptr;
+  std::vector<int32_t> sizes;
+  int32_t nbatch = 1;
+  int32_t where = NGRAV_CPU;
+  bool once = false;
+  bool quit = false;
+
+  for (int i=1; i<argc; i++) {
+    if (strncmp(argv[i], "-s=", 3) == 0) {
+      serverpath = argv[i]+3;
+    } else if (strncmp(argv[i], "-c=", 3) == 0) {
+      clientpath = argv[i]+3;
+    } else if (strncmp(argv[i], "-n=", 3) == 0) {
+      int32_t num = atoi(argv[i]+3);
+      if (num < 1) usage();
+      sizes.push_back(num);
+    } else if (strncmp(argv[i], "-b=", 3) == 0) {
+      int32_t num = atoi(argv[i]+3);
+      if (num < 1) usage();
+      nbatch = num;
+    } else if (strncmp(argv[i], "-g", 2) == 0) {
+      where = NGRAV_GPU;
+    } else if (strncmp(argv[i], "-q", 2) == 0) {
+      quit = true;
+    } else if (strncmp(argv[i], "-1", 2) == 0) {
+      once = true;
+    } else {
+      usage();
+    }
+  }
+
+  if (once) return oneshot(sizes.empty() ? 1000 : sizes[0], where);
+  if (serverpath) return serve(serverpath, where);
+  if (not clientpath) usage();
+  if (sizes.empty()) sizes = {100, 300, 1000, 3000};
+  return bench(clientpath, nbatch, sizes, where, quit);
+}
@@ -0,0 +1,130 @@
+/*
+ * ngEnsemble.cpp
+ *
+ * (c)2022 Mark J. Stock <markjstock@gmail.com>
+ *
+ * many small independent problems, as in an uncertainty quantification ensemble: compare
+ *   running them one after another, each spread over every thread, with handing the whole
+ *   set to ngrav_evaluate_batch
+ */
+
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <omp.h>
+
+#include "ngrav.h"
+
+
+static void usage() {
+  fprintf(stderr, "Usage: ngEnsemble.bin [-p=<problems>] [-n=<smallest>] [-m=<largest>] [-g]\n");
+  fprintf(stderr, "  problem sizes are spread evenly in log between the smallest and the largest\n");
+  fprintf(stderr, "  -g  run the one-at-a-time comparison on the GPU\n");
+  exit(1);
+}
+
+static void check(const int32_t _err, const char* _what) {
+  if (_err != NGRAV_OK) {
+    fprintf(stderr, "%s failed: %s\n", _what, ngrav_error_string(_err));
+    exit(EXIT_FAILURE);
+  }
+}
+
+int main(int argc, char **argv) {
+
+  int32_t nprob = 32;
+  int32_t nmin = 2000;
+  int32_t nmax = 20000;
+  int32_t where = NGRAV_CPU;
+
+  for (int i=1; i<argc; i++) {
+    if (strncmp(argv[i], "-p=", 3) == 0) {
+      int32_t num = atoi(argv[i]+3);
+      if (num < 1) usage();
+      nprob = num;
+    } else if (strncmp(argv[i], "-n=", 3) == 0) {
+      int32_t num = atoi(argv[i]+3);
+      if (num < 1) usage();
+      nmin = num;
+    } else if (strncmp(argv[i], "-m=", 3) == 0) {
+      int32_t num = atoi(argv[i]+3);
+      if (num < 1) usage();
+      nmax = num;
+    } else if (strncmp(argv[i], "-g", 2) == 0) {
+      where = NGRAV_GPU;
+    } else {
+      usage();
+    }
+  }
+  if (nmax < nmin) usage();
+
+  printf( "running an ensemble of %d problems of %d to %d particles on %d threads\n", nprob, nmin, nmax, omp_get_max_threads());
+
+  // each problem gets its own particles, all in one pool
+  std::mt19937 rng(1234);
+  std::uniform_real_distribution<float> xrand(0.0,1.0);
+  std::vector<int32_t> sizes(nprob);
+  size_t ntotal = 0;
+  double work = 0.0;
+  for (int32_t p=0; p<nprob; ++p) {
+    sizes[p] = std::round(nmin * std::pow((double)nmax/nmin, xrand(rng)));
+    ntotal += sizes[p];
+    work += (double)sizes[p]*sizes[p];
+  }
+  std::vector<float> x(ntotal), y(ntotal), z(ntotal), s(ntotal), r(ntotal);
+  std::vector<float> u(ntotal), v(ntotal), w(ntotal), bu(ntotal), bv(ntotal), bw(ntotal);
+  std::vector<ngrav_problem> probs(nprob);
+  size_t off = 0;
+  for (int32_t p=0; p<nprob; ++p) {
+    const int32_t n = sizes[p];
+    for (int32_t i=0; i<n; ++i) {
+      x[off+i] = xrand(rng);
+      y[off+i] = xrand(rng);
+      z[off+i] = xrand(rng);
+      s[off+i] = (2.0*xrand(rng)-1.0) / std::sqrt(n);
+      r[off+i] = (2./3.) / std::sqrt(n);
+    }
+    probs[p] = ngrav_problem{n, &x[off], &y[off], &z[off], &s[off], &r[off], &bu[off], &bv[off], &bw[off]};
+    off += n;
+  }
+  printf( "  %zu particles and %g interactions in all\n", ntotal, work);
+
+  // one problem after another on a reused solver
+  ngrav_solver* solver = ngrav_create(nmax, where);
+  if (not solver) {
+    fprintf(stderr, "Could not create solver!\n");
+    exit(EXIT_FAILURE);
+  }
+  auto start = std::chrono::system_clock::now();
+  off = 0;
+  for (int32_t p=0; p<nprob; ++p) {
+    check(ngrav_set_sources(solver, sizes[p], &x[off], &y[off], &z[off], &s[off], &r[off]), "set_sources");
+    check(ngrav_evaluate(solver, &u[off], &v[off], &w[off]), "evaluate");
+    off += sizes[p];
+  }
+  std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - start;
+  const double serial = elapsed_seconds.count();
+  ngrav_destroy(solver);
+  printf( "  one at a time:  time( %g s ) and ( %g GInteract/s )\n", serial, 1.e-9*work/serial);
+
+  // the whole batch at once
+  start = std::chrono::system_clock::now();
+  check(ngrav_evaluate_batch(nprob, probs.data()), "evaluate_batch");
+  elapsed_seconds = std::chrono::system_clock::now() - start;
+  const double batch = elapsed_seconds.count();
+  printf( "  batched:        time( %g s ) and ( %g GInteract/s ), speedup( %g )\n", batch, 1.e-9*work/batch, serial/batch);
+
+  double errmax = 0.0, velmax = 0.0;
+  for (size_t i=0; i<ntotal; ++i) {
+    errmax = std::max(errmax, (double)std::sqrt(std::pow(u[i]-bu[i],2) + std::pow(v[i]-bv[i],2) + std::pow(w[i]-bw[i],2)));
+    velmax = std::max(velmax, (double)std::sqrt(u[i]*u[i] + v[i]*v[i] + w[i]*w[i]));
+  }
+  printf( "  max difference between them ( %g ) relative to max velocity ( %g )\n", errmax, velmax);
+
+  return 0;
+}
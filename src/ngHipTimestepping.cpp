@@ -1,17 +1,29 @@
 /*
- * ngHip05.hip
+ * ngHipTimestepping.cpp
  *
  * (c)2022 Mark J. Stock <markjstock@gmail.com>
  *
  * v0.5  blocking the cpu calculation for data locality and improved summation accuracy, reordering gpu calls
+ *       time stepping, with asynchronous checkpoints and restart, optionally compressed
+ *       multiple time stepping of the far field on the host
+ *       power-of-two block time steps for gravity on a Plummer sphere
+ *       higher-order and adaptive integrators on the host, and velocity Verlet for gravity
+ *       parareal in time on the host, with fine propagators on thread subsets
+ *       treecode on the host, refitting the tree and reusing interaction lists between rebuilds
  */
 
 #include <vector>
 #include <random>
 #include <chrono>
+#include <string>
+#include <numeric>
+#include <omp.h>
 
 #include <hip/hip_runtime.h>
 
+#include "particleio.h"
+#include "snapshot.h"
+
 
 // compute using float or double
 #define FLOAT float
@@ -26,6 +38,24 @@
 // GPU count limit
 #define MAX_GPUS 8
 
+// multiple time stepping: smaller source blocks so that the near set is tight, and a source
+//   block is near a target block if the gap between their boxes is under this many source
+//   block diameters
+#define MTS_SRC_BLK 64
+#define MTS_NEAR 1.0
+
+// block time steps: a particle's step is under this times sqrt(smoothing radius/acceleration),
+//   and the Plummer test sphere has this scale radius
+#define BLOCK_ETA 0.2
+#define PLUMMER_SCALE 0.1
+
+// parareal stops once the slice ends move less than this (rms) between iterations
+#define PARAREAL_TOL 1.e-5
+
+// the treecode rebuilds once any cached far interaction, refit to the moved particles, has an
+//   opening angle this many times the one it was accepted with
+#define TREE_SLACK 1.25
+
 // -------------------------
 // compute kernel - GPU
 __global__ void ngrav_3d_nograds_gpu(
@@ -199,19 +229,363 @@ __host__ int32_t buffer(const int32_t _n, const int32_t _align) {
   return _align*(1+(_n-1)/_align);
 }
 
+// box of a contiguous range of particles, as lo[3] then hi[3]
+static void block_box(const int32_t _n, const FLOAT* _x, const FLOAT* _y, const FLOAT* _z, FLOAT _box[6]) {
+  _box[0] = _box[3] = _x[0];
+  _box[1] = _box[4] = _y[0];
+  _box[2] = _box[5] = _z[0];
+  for (int32_t i=1; i<_n; ++i) {
+    _box[0] = std::min(_box[0], _x[i]);  _box[3] = std::max(_box[3], _x[i]);
+    _box[1] = std::min(_box[1], _y[i]);  _box[4] = std::max(_box[4], _y[i]);
+    _box[2] = std::min(_box[2], _z[i]);  _box[5] = std::max(_box[5], _z[i]);
+  }
+}
+
+static FLOAT box_gap(const FLOAT _a[6], const FLOAT _b[6]) {
+  FLOAT dsq = 0.0;
+  for (int32_t d=0; d<3; ++d) {
+    const FLOAT gap = std::max((FLOAT)0.0, std::max(_a[d]-_b[d+3], _b[d]-_a[d+3]));
+    dsq += gap*gap;
+  }
+  return std::sqrt(dsq);
+}
+
+static FLOAT box_diam(const FLOAT _a[6]) {
+  return std::sqrt(std::pow(_a[3]-_a[0],2) + std::pow(_a[4]-_a[1],2) + std::pow(_a[5]-_a[2],2));
+}
+
+// rms and max distance between two sets of positions
+static void position_error(const int32_t _n, const FLOAT* _x, const FLOAT* _y, const FLOAT* _z,
+                           const FLOAT* _rx, const FLOAT* _ry, const FLOAT* _rz, double& _rms, double& _max) {
+  double sum = 0.0;
+  _max = 0.0;
+  for (int32_t i=0; i<_n; ++i) {
+    const double dsq = std::pow(_x[i]-_rx[i],2) + std::pow(_y[i]-_ry[i],2) + std::pow(_z[i]-_rz[i],2);
+    sum += dsq;
+    _max = std::max(_max, std::sqrt(dsq));
+  }
+  _rms = std::sqrt(sum/_n);
+}
+
+// host velocities (or accelerations) on the _nt targets listed in _idx, or on the first _nt
+//   particles if there is no list, from all _n particles; targets are gathered by block
+static void host_velocity(const int32_t _n, const FLOAT* _x, const FLOAT* _y, const FLOAT* _z,
+                          const FLOAT* _s, const FLOAT* _r, const int32_t _nt, const int32_t* _idx,
+                          FLOAT* _u, FLOAT* _v, FLOAT* _w) {
+  #pragma omp parallel for schedule(guided)
+  for (int32_t ibk=0; ibk<((_nt+CPU_TRG_BLK-1)/CPU_TRG_BLK); ++ibk) {
+    const int32_t istart = CPU_TRG_BLK*ibk;
+    const int32_t nt = std::min(_nt, CPU_TRG_BLK*(ibk+1)) - istart;
+    FLOAT tx[CPU_TRG_BLK], ty[CPU_TRG_BLK], tz[CPU_TRG_BLK], tr[CPU_TRG_BLK];
+    FLOAT tu[CPU_TRG_BLK], tv[CPU_TRG_BLK], tw[CPU_TRG_BLK];
+    for (int32_t i=0; i<nt; ++i) {
+      const int32_t it = _idx ? _idx[istart+i] : istart+i;
+      tx[i] = _x[it];  ty[i] = _y[it];  tz[i] = _z[it];  tr[i] = _r[it];
+    }
+    ngrav_3d_nograds_cpu(_n, _x,_y,_z,_s,_r, nt, tx,ty,tz,tr, tu,tv,tw);
+    for (int32_t i=0; i<nt; ++i) {
+      const int32_t it = _idx ? _idx[istart+i] : istart+i;
+      _u[it] = tu[i];  _v[it] = tv[i];  _w[it] = tw[i];
+    }
+  }
+}
+
+// a Plummer sphere of unit mass and scale _a centered in the unit cube, with velocities drawn
+//   from its isotropic equilibrium for the kernel's G of 1/(4 pi) (Aarseth, Henon, Wielen 1974)
+static void plummer_sphere(const int32_t _n, const double _a, std::mt19937& _rng,
+                           FLOAT* _x, FLOAT* _y, FLOAT* _z, FLOAT* _vx, FLOAT* _vy, FLOAT* _vz, FLOAT* _s) {
+  std::uniform_real_distribution<double> urand(0.0,1.0);
+  const double gm = 1.0 / (4.0*3.1415926536);
+  auto direction = [&](double& _dx, double& _dy, double& _dz) {
+    _dz = 2.0*urand(_rng) - 1.0;
+    const double phi = 2.0*3.1415926536*urand(_rng);
+    const double rxy = std::sqrt(1.0 - _dz*_dz);
+    _dx = rxy*std::cos(phi);
+    _dy = rxy*std::sin(phi);
+  };
+  for (int32_t i=0; i<_n; ++i) {
+    // radius from the cumulative mass, cut off at 99.9% of it
+    const double r = _a / std::sqrt(std::pow(0.999*urand(_rng) + 1.e-10, -2.0/3.0) - 1.0);
+    double dx, dy, dz;
+    direction(dx, dy, dz);
+    _x[i] = 0.5 + r*dx;
+    _y[i] = 0.5 + r*dy;
+    _z[i] = 0.5 + r*dz;
+    // speed as a fraction of the escape speed, by rejection from q^2 (1-q^2)^3.5
+    double q = 0.0;
+    do {
+      q = urand(_rng);
+    } while (0.1*urand(_rng) > q*q*std::pow(1.0-q*q, 3.5));
+    const double vel = q * std::sqrt(2.0*gm) * std::pow(r*r + _a*_a, -0.25);
+    direction(dx, dy, dz);
+    _vx[i] = vel*dx;
+    _vy[i] = vel*dy;
+    _vz[i] = vel*dz;
+    _s[i] = 1.0 / _n;
+  }
+}
+
+// kinetic plus potential energy of a self-gravitating set, with the kernel's smoothing
+static double total_energy(const int32_t _n, const FLOAT* _x, const FLOAT* _y, const FLOAT* _z,
+                           const FLOAT* _vx, const FLOAT* _vy, const FLOAT* _vz,
+                           const FLOAT* _s, const FLOAT* _r) {
+  double kinetic = 0.0, potential = 0.0;
+  #pragma omp parallel for schedule(guided) reduction(+:kinetic,potential)
+  for (int32_t i=0; i<_n; ++i) {
+    kinetic += 0.5 * _s[i] * ((double)_vx[i]*_vx[i] + (double)_vy[i]*_vy[i] + (double)_vz[i]*_vz[i]);
+    double pot = 0.0;
+    for (int32_t j=i+1; j<_n; ++j) {
+      const double distsq = std::pow((double)_x[j]-_x[i],2) + std::pow((double)_y[j]-_y[i],2)
+                          + std::pow((double)_z[j]-_z[i],2) + (double)_r[i]*_r[i] + (double)_r[j]*_r[j];
+      pot += _s[j] / std::sqrt(distsq);
+    }
+    potential -= _s[i] * pot / (4.0*3.1415926536);
+  }
+  return kinetic + potential;
+}
+
+// the rung whose step dt/2^rung is the first under BLOCK_ETA*sqrt(smoothing/acceleration)
+static int32_t block_rung(const FLOAT _dt, const FLOAT _ax, const FLOAT _ay, const FLOAT _az,
+                          const FLOAT _r, const int32_t _maxrung) {
+  const double amag = std::sqrt((double)_ax*_ax + (double)_ay*_ay + (double)_az*_az);
+  const double want = BLOCK_ETA * std::sqrt(_r / std::max(amag, 1.e-30));
+  const int32_t rung = (int32_t)std::ceil(std::log2(_dt / want));
+  return std::max(0, std::min(_maxrung, rung));
+}
+
+// explicit Runge-Kutta tableaux for x' = u(x); err holds the weights minus those of an embedded
+//   lower-order pair, and if the last stage is evaluated at the new state it serves as the first
+//   stage of the next step
+struct RKTableau {
+  const char* name;
+  int32_t nstages;
+  double a[4][4];
+  double b[4];
+  double err[4];
+  int32_t lower;
+};
+static const RKTableau rk_euler = {"euler", 1, {{0.0}}, {1.0}, {0.0}, 0};
+static const RKTableau rk_midpoint = {"rk2", 2, {{0.0}, {0.5}}, {0.0, 1.0}, {0.0}, 0};
+static const RKTableau rk_classic = {"rk4", 4, {{0.0}, {0.5}, {0.0, 0.5}, {0.0, 0.0, 1.0}},
+                                     {1./6., 1./3., 1./3., 1./6.}, {0.0}, 0};
+// Bogacki and Shampine (1989), third order with a second-order estimate
+static const RKTableau rk_bs23 = {"rk23", 4, {{0.0}, {0.5}, {0.0, 0.75}, {2./9., 1./3., 4./9.}},
+                                  {2./9., 1./3., 4./9., 0.0}, {-5./72., 1./12., 1./9., -1./8.}, 2};
+
+// stage velocities and the stage state, allocated once for all steps
+struct RKStages {
+  std::vector<FLOAT> ku[4], kv[4], kw[4];
+  std::vector<FLOAT> x, y, z;
+  explicit RKStages(const int32_t _n) : x(_n), y(_n), z(_n) {
+    for (int32_t k=0; k<4; ++k) {
+      ku[k].resize(_n);
+      kv[k].resize(_n);
+      kw[k].resize(_n);
+    }
+  }
+};
+
+// one step of _dt from (_x,_y,_z) into (_nx,_ny,_nz); if _have_first, stage 0 already holds the
+//   velocity at the start; returns the largest estimated position error, if the tableau has a pair
+static double rk_step(const RKTableau& _t, const FLOAT _dt, const int32_t _n,
+                      const FLOAT* _x, const FLOAT* _y, const FLOAT* _z, const FLOAT* _s, const FLOAT* _r,
+                      FLOAT* _nx, FLOAT* _ny, FLOAT* _nz, RKStages& _k, const bool _have_first, int32_t& _nevals) {
+  for (int32_t is=0; is<_t.nstages; ++is) {
+    if (is == 0 and _have_first) continue;
+    const FLOAT* sx = _x;
+    const FLOAT* sy = _y;
+    const FLOAT* sz = _z;
+    if (is > 0) {
+      #pragma omp parallel for
+      for (int32_t i=0; i<_n; ++i) {
+        FLOAT du = 0.0, dv = 0.0, dw = 0.0;
+        for (int32_t js=0; js<is; ++js) {
+          du += _t.a[is][js] * _k.ku[js][i];
+          dv += _t.a[is][js] * _k.kv[js][i];
+          dw += _t.a[is][js] * _k.kw[js][i];
+        }
+        _k.x[i] = _x[i] + _dt*du;
+        _k.y[i] = _y[i] + _dt*dv;
+        _k.z[i] = _z[i] + _dt*dw;
+      }
+      sx = _k.x.data();
+      sy = _k.y.data();
+      sz = _k.z.data();
+    }
+    host_velocity(_n, sx, sy, sz, _s, _r, _n, nullptr, _k.ku[is].data(), _k.kv[is].data(), _k.kw[is].data());
+    _nevals++;
+  }
+
+  double errmax = 0.0;
+  #pragma omp parallel for reduction(max:errmax)
+  for (int32_t i=0; i<_n; ++i) {
+    FLOAT du = 0.0, dv = 0.0, dw = 0.0, eu = 0.0, ev = 0.0, ew = 0.0;
+    for (int32_t is=0; is<_t.nstages; ++is) {
+      du += _t.b[is] * _k.ku[is][i];
+      dv += _t.b[is] * _k.kv[is][i];
+      dw += _t.b[is] * _k.kw[is][i];
+      eu += _t.err[is] * _k.ku[is][i];
+      ev += _t.err[is] * _k.kv[is][i];
+      ew += _t.err[is] * _k.kw[is][i];
+    }
+    _nx[i] = _x[i] + _dt*du;
+    _ny[i] = _y[i] + _dt*dv;
+    _nz[i] = _z[i] + _dt*dw;
+    errmax = std::max(errmax, _dt*std::sqrt((double)eu*eu + (double)ev*ev + (double)ew*ew));
+  }
+  return errmax;
+}
+
+// a binary tree over particles in Morton order: each node is a contiguous range, halved until it
+//   holds at most CPU_TRG_BLK; the box and monopole (strength-weighted center, total strength and
+//   mean radius) are refit from the particles without changing the topology
+struct TreeNode {
+  int32_t start, end, child;
+  FLOAT box[6];
+  FLOAT mx, my, mz, ms, mr;
+};
+
+static void tree_split(std::vector<TreeNode>& _nodes, std::vector<std::vector<int32_t>>& _levels,
+                       const int32_t _inode, const int32_t _depth) {
+  if ((int32_t)_levels.size() <= _depth) _levels.resize(_depth+1);
+  _levels[_depth].push_back(_inode);
+  const int32_t start = _nodes[_inode].start;
+  const int32_t end = _nodes[_inode].end;
+  if (end-start <= CPU_TRG_BLK) return;
+  const int32_t child = _nodes.size();
+  const int32_t mid = start + (end-start)/2;
+  _nodes[_inode].child = child;
+  _nodes.push_back(TreeNode{start, mid, -1});
+  _nodes.push_back(TreeNode{mid, end, -1});
+  tree_split(_nodes, _levels, child, _depth+1);
+  tree_split(_nodes, _levels, child+1, _depth+1);
+}
+
+// bottom up, one level at a time
+static void tree_refit(std::vector<TreeNode>& _nodes, const std::vector<std::vector<int32_t>>& _levels,
+                       const FLOAT* _x, const FLOAT* _y, const FLOAT* _z, const FLOAT* _s, const FLOAT* _r) {
+  for (int32_t l=_levels.size()-1; l>=0; --l) {
+    #pragma omp parallel for schedule(guided)
+    for (size_t k=0; k<_levels[l].size(); ++k) {
+      TreeNode& nd = _nodes[_levels[l][k]];
+      double sx = 0.0, sy = 0.0, sz = 0.0, sw = 0.0, ss = 0.0, sr = 0.0;
+      if (nd.child < 0) {
+        block_box(nd.end-nd.start, &_x[nd.start], &_y[nd.start], &_z[nd.start], nd.box);
+        for (int32_t i=nd.start; i<nd.end; ++i) {
+          const double w = std::abs(_s[i]);
+          sx += w*_x[i];  sy += w*_y[i];  sz += w*_z[i];
+          sw += w;  ss += _s[i];  sr += _r[i];
+        }
+      } else {
+        const TreeNode& a = _nodes[nd.child];
+        const TreeNode& b = _nodes[nd.child+1];
+        for (int32_t d=0; d<3; ++d) {
+          nd.box[d] = std::min(a.box[d], b.box[d]);
+          nd.box[d+3] = std::max(a.box[d+3], b.box[d+3]);
+        }
+        for (const TreeNode* c : {&a, &b}) {
+          // the children's weights are their absolute strengths, up to cancellation
+          const double w = std::abs(c->ms);
+          sx += w*c->mx;  sy += w*c->my;  sz += w*c->mz;
+          sw += w;  ss += c->ms;  sr += c->mr*(c->end-c->start);
+        }
+      }
+      const double inv = sw > 0.0 ? 1.0/sw : 0.0;
+      nd.mx = sw > 0.0 ? sx*inv : 0.5*(nd.box[0]+nd.box[3]);
+      nd.my = sw > 0.0 ? sy*inv : 0.5*(nd.box[1]+nd.box[4]);
+      nd.mz = sw > 0.0 ? sz*inv : 0.5*(nd.box[2]+nd.box[5]);
+      nd.ms = ss;
+      nd.mr = sr / (nd.end-nd.start);
+    }
+  }
+}
+
+// for each leaf, the nodes far enough to use their monopoles and the ranges of near particles,
+//   with adjacent near ranges merged
+static void tree_lists(const std::vector<TreeNode>& _nodes, const std::vector<int32_t>& _leaves, const FLOAT _theta,
+                       std::vector<std::vector<int32_t>>& _far, std::vector<std::vector<int32_t>>& _near) {
+  #pragma omp parallel for schedule(guided)
+  for (size_t il=0; il<_leaves.size(); ++il) {
+    const TreeNode& leaf = _nodes[_leaves[il]];
+    _far[il].clear();
+    _near[il].clear();
+    std::vector<int32_t> stack(1, 0);
+    while (not stack.empty()) {
+      const int32_t j = stack.back();
+      stack.pop_back();
+      const TreeNode& nd = _nodes[j];
+      if (box_diam(nd.box) < _theta*box_gap(leaf.box, nd.box)) {
+        _far[il].push_back(j);
+      } else if (nd.child < 0) {
+        if (not _near[il].empty() and _near[il].back() == nd.start) _near[il].back() = nd.end;
+        else { _near[il].push_back(nd.start); _near[il].push_back(nd.end); }
+      } else {
+        // right child first, so that the left one is taken next and ranges come out in order
+        stack.push_back(nd.child+1);
+        stack.push_back(nd.child);
+      }
+    }
+  }
+}
+
+// the largest ratio of a cached far interaction's opening angle, after a refit, to the limit
+static double tree_worst_angle(const std::vector<TreeNode>& _nodes, const std::vector<int32_t>& _leaves,
+                               const FLOAT _theta, const std::vector<std::vector<int32_t>>& _far) {
+  double worst = 0.0;
+  #pragma omp parallel for schedule(guided) reduction(max:worst)
+  for (size_t il=0; il<_leaves.size(); ++il) {
+    const TreeNode& leaf = _nodes[_leaves[il]];
+    for (const int32_t j : _far[il]) {
+      const double gap = box_gap(leaf.box, _nodes[j].box);
+      worst = std::max(worst, gap > 0.0 ? box_diam(_nodes[j].box) / (_theta*gap) : 1.e30);
+    }
+  }
+  return worst;
+}
+
 // main program
 
 static void usage() {
-  fprintf(stderr, "Usage: ngHip05.bin [-n=<num parts>] [-g=<num gpus>] [-s=<num steps>]\n");
+  fprintf(stderr, "Usage: ngHipTimestepping.bin [-n=<num parts>] [-g=<num gpus>] [-s=<num steps>] [-t=<time step>]\n");
+  fprintf(stderr, "                             [-k=<steps per checkpoint>] [-f=<checkpoint prefix>] [-r=<restart.npy>]\n");
+  fprintf(stderr, "                             [-z=<max position error, compresses checkpoints to .nvz>]\n");
+  fprintf(stderr, "                             [-m=<steps per far-field update, runs multiple time stepping on the host>]\n");
+  fprintf(stderr, "                             [-b=<max rung, runs block time steps on a Plummer sphere on the host>]\n");
+  fprintf(stderr, "                             [-i=<adaptive step error tolerance, compares integrators on the host>]\n");
+  fprintf(stderr, "                             [-p=<time slices, runs parareal on the host; must divide the steps>]\n");
+  fprintf(stderr, "                             [-a=<opening angle, runs a treecode on the host>]\n");
   exit(1);
 }
 
+// the step number is the last underscore-separated part of a checkpoint name
+static int32_t checkpoint_step(const char* _fname) {
+  const char* us = strrchr(_fname, '_');
+  return us ? atoi(us+1) : 0;
+}
+
 int main(int argc, char **argv) {
 
   // number of particles/points, gpus, time steps
   int32_t npart = 400000;
   int32_t force_ngpus = -1;
   int32_t nsteps = 1;
+  // checkpoint every this many steps (0 is never), file name prefix, restart file
+  int32_t ckevery = 0;
+  std::string ckprefix = "checkpoint";
+  const char* restartfile = nullptr;
+  // nonzero writes lossy compressed checkpoints with this position error bound
+  double ckerror = 0.0;
+  FLOAT dt = 0.01;
+  // nonzero also runs the host loop with the far field updated only this often
+  int32_t farevery = 0;
+  // nonzero also runs block time steps with up to this many halvings of dt
+  int32_t maxrung = 0;
+  // nonzero also compares integrators on the host, the adaptive one with this tolerance
+  double inttol = 0.0;
+  // nonzero also runs the host loop as parareal over this many time slices
+  int32_t nslices = 0;
+  // nonzero also runs the host loop with a treecode of this opening angle
+  double theta = 0.0;
 
   for (int i=1; i<argc; i++) {
     if (strncmp(argv[i], "-n=", 3) == 0) {
@@ -226,11 +600,76 @@ int main(int argc, char **argv) {
       int32_t num = atoi(argv[i]+3);
       if (num < 1) usage();
       nsteps = num;
+    } else if (strncmp(argv[i], "-k=", 3) == 0) {
+      int32_t num = atoi(argv[i]+3);
+      if (num < 0) usage();
+      ckevery = num;
+    } else if (strncmp(argv[i], "-f=", 3) == 0) {
+      ckprefix = argv[i]+3;
+    } else if (strncmp(argv[i], "-r=", 3) == 0) {
+      restartfile = argv[i]+3;
+    } else if (strncmp(argv[i], "-z=", 3) == 0) {
+      double num = atof(argv[i]+3);
+      if (num <= 0.0) usage();
+#ifndef HAVE_ZLIB
+      fprintf(stderr, "Compressed checkpoints need zlib, which this build does not have!\n");
+      exit(EXIT_FAILURE);
+#endif
+      ckerror = num;
+    } else if (strncmp(argv[i], "-t=", 3) == 0) {
+      double num = atof(argv[i]+3);
+      if (num <= 0.0) usage();
+      dt = num;
+    } else if (strncmp(argv[i], "-m=", 3) == 0) {
+      int32_t num = atoi(argv[i]+3);
+      if (num < 1) usage();
+      farevery = num;
+    } else if (strncmp(argv[i], "-b=", 3) == 0) {
+      int32_t num = atoi(argv[i]+3);
+      if (num < 1 or num > 20) usage();
+      maxrung = num;
+    } else if (strncmp(argv[i], "-i=", 3) == 0) {
+      double num = atof(argv[i]+3);
+      if (num <= 0.0) usage();
+      inttol = num;
+    } else if (strncmp(argv[i], "-p=", 3) == 0) {
+      int32_t num = atoi(argv[i]+3);
+      if (num < 1) usage();
+      nslices = num;
+    } else if (strncmp(argv[i], "-a=", 3) == 0) {
+      double num = atof(argv[i]+3);
+      if (num <= 0.0 or num >= 1.0) usage();
+      theta = num;
+    }
+  }
+  if (nslices > 0 and nsteps % nslices != 0) usage();
+
+  // a restart file sets the particle count and the starting step
+  NpyMap restartmap;
+  std::vector<FLOAT> rsx, rsy, rsz, rss, rsr;
+  int32_t firststep = 0;
+  const bool restartnvz = restartfile and strlen(restartfile) > 4 and strcmp(restartfile+strlen(restartfile)-4, ".nvz") == 0;
+  if (restartfile and restartnvz) {
+    snapshot_read<FLOAT>(restartfile, rsx, rsy, rsz, rss, rsr);
+    if (rsx.size() < 1 or rsx.size() > INT32_MAX) {
+      fprintf(stderr, "Restart snapshot must have 1 to 2^31 particles!\n");
+      exit(EXIT_FAILURE);
+    }
+    npart = rsx.size();
+  } else if (restartfile) {
+    npy_map_read<FLOAT>(restartfile, restartmap);
+    if (restartmap.rows != 5 or restartmap.cols < 1 or restartmap.cols > INT32_MAX) {
+      fprintf(stderr, "Restart array must have shape (5, n)!\n");
+      exit(EXIT_FAILURE);
     }
+    npart = restartmap.cols;
+  }
+  if (restartfile) {
+    firststep = checkpoint_step(restartfile);
+    printf( "restarting from %s at step %d\n", restartfile, firststep);
   }
 
-  printf( "performing 3D gravitational summation on %d points for %d steps\n", npart, nsteps);
-  const FLOAT dt = 0.01;
+  printf( "performing 3D gravitational summation on %d points for %d steps of %g\n", npart, nsteps, dt);
 
   // number of GPUs present
   int32_t ngpus = 1;
@@ -274,9 +713,43 @@ int main(int argc, char **argv) {
   for (int32_t i = 0; i < npart; ++i)    hsr[i] = thisrad;
   for (int32_t i = npart; i < npad; ++i) hsr[i] = thisrad;
 
+  // overwrite with the saved state, bit for bit (compressed positions are within the error bound)
+  if (restartnvz) {
+    std::copy(rsx.begin(), rsx.end(), hsx.begin());
+    std::copy(rsy.begin(), rsy.end(), hsy.begin());
+    std::copy(rsz.begin(), rsz.end(), hsz.begin());
+    std::copy(rss.begin(), rss.end(), hss.begin());
+    std::copy(rsr.begin(), rsr.end(), hsr.begin());
+  } else if (restartfile) {
+    memcpy(hsx.data(), npy_row<FLOAT>(restartmap, 0), npart*sizeof(FLOAT));
+    memcpy(hsy.data(), npy_row<FLOAT>(restartmap, 1), npart*sizeof(FLOAT));
+    memcpy(hsz.data(), npy_row<FLOAT>(restartmap, 2), npart*sizeof(FLOAT));
+    memcpy(hss.data(), npy_row<FLOAT>(restartmap, 3), npart*sizeof(FLOAT));
+    memcpy(hsr.data(), npy_row<FLOAT>(restartmap, 4), npart*sizeof(FLOAT));
+    npy_unmap(restartmap);
+  }
+
+  // checkpoints are (5, npart) arrays of x,y,z,s,r, written in the background; compression
+  //   uses only a couple of threads, so that it does not compete with the steps it overlaps
+  SnapshotWriter<FLOAT>::WriteFn ckwrite = npy_write<FLOAT>;
+  if (ckerror > 0.0) {
+    ckwrite = [ckerror](const char* _fname, const int64_t _nf, const int64_t _n, const FLOAT* _d) {
+      return snapshot_write<FLOAT>(_fname, _n, _d, _d+_n, _d+2*_n, _d+3*_n, _d+4*_n, ckerror, 2);
+    };
+  }
+  SnapshotWriter<FLOAT> checkpointer(5, ckevery > 0 ? npart : 0, ckwrite);
+  auto is_ckstep = [&](const int32_t _istep) { return ckevery > 0 and (_istep+1)%ckevery == 0; };
+  auto ckname = [&](const char* _where, const int32_t _step) {
+    return ckprefix + "_" + _where + "_" + std::to_string(_step) + (ckerror > 0.0 ? ".nvz" : ".npy");
+  };
+
+  // the GPU run starts from the same state as the CPU run
+  const std::vector<FLOAT> hsx0(hsx), hsy0(hsy), hsz0(hsz);
+
   // -------------------------
   // do a CPU version
 
+  double cktime = 0.0;
   auto start = std::chrono::system_clock::now();
 
   for (int32_t istep=0; istep<nsteps; ++istep) {
@@ -304,6 +777,23 @@ int main(int argc, char **argv) {
       hsz[i] += dt * htw[i];
     }
 
+    // stage a checkpoint and let the writer thread save it
+    if (is_ckstep(istep)) {
+      auto ckstart = std::chrono::system_clock::now();
+      FLOAT* buf = checkpointer.acquire();
+      #pragma omp parallel for
+      for (int32_t i=0; i<npart; ++i) {
+        buf[i]         = hsx[i];
+        buf[npart+i]   = hsy[i];
+        buf[2*npart+i] = hsz[i];
+        buf[3*npart+i] = hss[i];
+        buf[4*npart+i] = hsr[i];
+      }
+      checkpointer.submit(ckname("host", firststep+istep+1));
+      std::chrono::duration<double> ckelapsed = std::chrono::system_clock::now() - ckstart;
+      cktime += ckelapsed.count();
+    }
+
   }
 
   auto end = std::chrono::system_clock::now();
@@ -312,11 +802,567 @@ int main(int argc, char **argv) {
 
   printf( "  host total time( %g s ) and flops( %g GFlop/s )\n", time, nsteps*1.e-9 * (double)npart*(7+20*(double)npart)/time);
   printf( "    results ( %g %g %g %g %g %g)\n", htu[0], htv[0], htw[0], htu[npart-1], htv[npart-1], htw[npart-1]);
+  if (ckevery > 0) {
+    printf( "  host checkpoint overhead( %g s ) or ( %g %% )\n", cktime, 100.0*cktime/time);
+  }
 
   // copy the results into temp vectors
   std::vector<FLOAT> htu_cpu(htu);
   std::vector<FLOAT> htv_cpu(htv);
   std::vector<FLOAT> htw_cpu(htw);
+  const double hosttime = time;
+
+  // -------------------------
+  // the same steps with multiple time stepping: block pairs split into near and far by box
+  //   distance, and the far part recomputed only every farevery steps, reusing its velocity
+  //   in between; particles are put in Morton order at each far update so that blocks are compact
+
+  if (farevery > 0) {
+    std::vector<FLOAT> px(hsx0.begin(), hsx0.begin()+npart), py(hsy0.begin(), hsy0.begin()+npart), pz(hsz0.begin(), hsz0.begin()+npart);
+    std::vector<FLOAT> ps(hss.begin(), hss.begin()+npart), pr(hsr.begin(), hsr.begin()+npart);
+    std::vector<int32_t> id(npart);
+    std::iota(id.begin(), id.end(), 0);
+    std::vector<FLOAT> pu(npart), pv(npart), pw(npart), fu(npart), fv(npart), fw(npart);
+
+    const int32_t ntblocks = (npart+CPU_TRG_BLK-1)/CPU_TRG_BLK;
+    const int32_t nsblocks = (npart+MTS_SRC_BLK-1)/MTS_SRC_BLK;
+    std::vector<std::vector<int32_t>> near(ntblocks);
+    double nearpairs = 0.0;
+
+    start = std::chrono::system_clock::now();
+
+    for (int32_t istep=0; istep<nsteps; ++istep) {
+      const bool farstep = (istep % farevery == 0);
+
+      if (farstep) {
+        // reorder everything that moves with the particles
+        const std::vector<uint32_t> order = snap_morton_order<FLOAT>(npart, px.data(), py.data(), pz.data());
+        std::vector<FLOAT> tmp(npart);
+        for (std::vector<FLOAT>* a : {&px, &py, &pz, &ps, &pr}) {
+          for (int32_t i=0; i<npart; ++i) tmp[i] = (*a)[order[i]];
+          a->swap(tmp);
+        }
+        std::vector<int32_t> itmp(npart);
+        for (int32_t i=0; i<npart; ++i) itmp[i] = id[order[i]];
+        id.swap(itmp);
+
+        // classify block pairs
+        std::vector<FLOAT> tbox(6*ntblocks), sbox(6*nsblocks);
+        for (int32_t ibk=0; ibk<ntblocks; ++ibk) {
+          const int32_t istart = CPU_TRG_BLK*ibk;
+          block_box(std::min(npart, istart+CPU_TRG_BLK)-istart, &px[istart], &py[istart], &pz[istart], &tbox[6*ibk]);
+        }
+        for (int32_t jbk=0; jbk<nsblocks; ++jbk) {
+          const int32_t jstart = MTS_SRC_BLK*jbk;
+          block_box(std::min(npart, jstart+MTS_SRC_BLK)-jstart, &px[jstart], &py[jstart], &pz[jstart], &sbox[6*jbk]);
+        }
+        #pragma omp parallel for schedule(guided)
+        for (int32_t ibk=0; ibk<ntblocks; ++ibk) {
+          near[ibk].clear();
+          for (int32_t jbk=0; jbk<nsblocks; ++jbk) {
+            if (box_gap(&tbox[6*ibk], &sbox[6*jbk]) < MTS_NEAR*box_diam(&sbox[6*jbk])) near[ibk].push_back(jbk);
+          }
+        }
+        for (int32_t ibk=0; ibk<ntblocks; ++ibk) nearpairs += near[ibk].size();
+      }
+
+      // near sources every step, far ones only on far steps
+      #pragma omp parallel for schedule(guided)
+      for (int32_t ibk=0; ibk<ntblocks; ++ibk) {
+        const int32_t istart = CPU_TRG_BLK*ibk;
+        const int32_t iend = std::min(npart, CPU_TRG_BLK*(ibk+1));
+        const int32_t nt = iend-istart;
+        FLOAT nu[CPU_TRG_BLK] = {0.0}, nv[CPU_TRG_BLK] = {0.0}, nw[CPU_TRG_BLK] = {0.0};
+        FLOAT bu[CPU_TRG_BLK], bv[CPU_TRG_BLK], bw[CPU_TRG_BLK];
+        if (farstep) {
+          for (int32_t i=0; i<nt; ++i) fu[istart+i] = fv[istart+i] = fw[istart+i] = 0.0;
+        }
+        size_t nextnear = 0;
+        for (int32_t jbk=0; jbk<nsblocks; ++jbk) {
+          const bool isnear = (nextnear < near[ibk].size() and near[ibk][nextnear] == jbk);
+          if (isnear) nextnear++;
+          if (not isnear and not farstep) continue;
+          const int32_t jstart = MTS_SRC_BLK*jbk;
+          const int32_t jend = std::min(npart, MTS_SRC_BLK*(jbk+1));
+          ngrav_3d_nograds_cpu(jend-jstart, &px[jstart],&py[jstart],&pz[jstart],&ps[jstart],&pr[jstart],
+                               nt, &px[istart],&py[istart],&pz[istart],&pr[istart], bu,bv,bw);
+          FLOAT* const au = isnear ? nu : &fu[istart];
+          FLOAT* const av = isnear ? nv : &fv[istart];
+          FLOAT* const aw = isnear ? nw : &fw[istart];
+          for (int32_t i=0; i<nt; ++i) {
+            au[i] += bu[i];
+            av[i] += bv[i];
+            aw[i] += bw[i];
+          }
+        }
+        for (int32_t i=0; i<nt; ++i) {
+          pu[istart+i] = nu[i] + fu[istart+i];
+          pv[istart+i] = nv[i] + fv[istart+i];
+          pw[istart+i] = nw[i] + fw[istart+i];
+        }
+      }
+
+      // position update (simple euler step)
+      #pragma omp parallel for schedule(guided)
+      for (int32_t i=0; i<npart; ++i) {
+        px[i] += dt * pu[i];
+        py[i] += dt * pv[i];
+        pz[i] += dt * pw[i];
+      }
+    }
+
+    end = std::chrono::system_clock::now();
+    elapsed_seconds = end-start;
+    const double mtstime = elapsed_seconds.count();
+
+    // back in the original order, to compare with the plain loop
+    std::vector<FLOAT> mx(npart), my(npart), mz(npart);
+    for (int32_t i=0; i<npart; ++i) {
+      mx[id[i]] = px[i];
+      my[id[i]] = py[i];
+      mz[id[i]] = pz[i];
+    }
+    double rms, emax, mrms, mmax;
+    position_error(npart, mx.data(), my.data(), mz.data(), hsx.data(), hsy.data(), hsz.data(), rms, emax);
+    position_error(npart, hsx0.data(), hsy0.data(), hsz0.data(), hsx.data(), hsy.data(), hsz.data(), mrms, mmax);
+    const double nupdates = (nsteps+farevery-1)/farevery;
+    printf( "  host multiple time stepping, far field every %d steps, %.1f%% of block pairs near\n",
+            farevery, 100.0*nearpairs/(nupdates*ntblocks*nsblocks));
+    printf( "    total time( %g s ) speedup( %g ) over the plain loop\n", mtstime, hosttime/mtstime);
+    printf( "    position difference rms( %g ) max( %g ) after moving rms( %g )\n", rms, emax, mrms);
+  }
+
+  // -------------------------
+  // power-of-two block time steps, for gravity with velocities on a clustered Plummer sphere:
+  //   each particle takes kick-drift-kick steps of dt/2^rung, with its rung set from its
+  //   acceleration, and at each of the 2^maxrung substeps only the particles finishing a step are
+  //   evaluated as targets; compared with every particle on the finest rung, and on the coarsest
+
+  if (maxrung > 0) {
+    std::vector<FLOAT> bx0(npart), by0(npart), bz0(npart), bvx0(npart), bvy0(npart), bvz0(npart);
+    std::vector<FLOAT> bs(npart), br(npart, thisrad);
+    std::mt19937 prng(4321);
+    plummer_sphere(npart, PLUMMER_SCALE, prng, bx0.data(), by0.data(), bz0.data(), bvx0.data(), bvy0.data(), bvz0.data(), bs.data());
+    const double energy0 = total_energy(npart, bx0.data(), by0.data(), bz0.data(), bvx0.data(), bvy0.data(), bvz0.data(), bs.data(), br.data());
+
+    std::vector<FLOAT> bx, by, bz, bvx, bvy, bvz, ax(npart), ay(npart), az(npart);
+    std::vector<int32_t> rung(npart), active;
+    active.reserve(npart);
+    const int32_t nsub = 1 << maxrung;
+    printf( "  host block time steps on a Plummer sphere, dt( %g ) down to ( %g ), initial energy( %g )\n", dt, dt/nsub, energy0);
+
+    // a negative fixed rung lets each particle choose its own
+    auto block_run = [&](const int32_t _fixed, const char* _label) {
+      bx = bx0;  by = by0;  bz = bz0;
+      bvx = bvx0;  bvy = bvy0;  bvz = bvz0;
+      start = std::chrono::system_clock::now();
+
+      host_velocity(npart, bx.data(), by.data(), bz.data(), bs.data(), br.data(), npart, nullptr, ax.data(), ay.data(), az.data());
+      double nevals = npart;
+      for (int32_t i=0; i<npart; ++i) {
+        rung[i] = _fixed < 0 ? block_rung(dt, ax[i], ay[i], az[i], br[i], maxrung) : _fixed;
+      }
+      std::vector<int32_t> count(maxrung+1, 0);
+      for (int32_t i=0; i<npart; ++i) count[rung[i]]++;
+
+      // the coarsest rung only needs one substep per step
+      const int32_t nstride = _fixed < 0 ? 1 : (nsub >> _fixed);
+      for (int32_t istep=0; istep<nsteps; ++istep) {
+        for (int32_t isub=0; isub<nsub; isub+=nstride) {
+
+          // opening half kicks for the rungs starting a step
+          #pragma omp parallel for
+          for (int32_t i=0; i<npart; ++i) {
+            if (isub % (nsub >> rung[i]) == 0) {
+              const FLOAT hdt = 0.5 * dt / (1 << rung[i]);
+              bvx[i] += hdt * ax[i];
+              bvy[i] += hdt * ay[i];
+              bvz[i] += hdt * az[i];
+            }
+          }
+
+          // everyone drifts
+          const FLOAT ddt = dt * nstride / nsub;
+          #pragma omp parallel for
+          for (int32_t i=0; i<npart; ++i) {
+            bx[i] += ddt * bvx[i];
+            by[i] += ddt * bvy[i];
+            bz[i] += ddt * bvz[i];
+          }
+
+          // new accelerations and closing half kicks for the rungs finishing a step
+          active.clear();
+          for (int32_t i=0; i<npart; ++i) {
+            if ((isub+nstride) % (nsub >> rung[i]) == 0) active.push_back(i);
+          }
+          host_velocity(npart, bx.data(), by.data(), bz.data(), bs.data(), br.data(), active.size(), active.data(), ax.data(), ay.data(), az.data());
+          nevals += active.size();
+          #pragma omp parallel for
+          for (size_t k=0; k<active.size(); ++k) {
+            const int32_t i = active[k];
+            const FLOAT hdt = 0.5 * dt / (1 << rung[i]);
+            bvx[i] += hdt * ax[i];
+            bvy[i] += hdt * ay[i];
+            bvz[i] += hdt * az[i];
+            if (_fixed >= 0) continue;
+            // a particle may always move to a finer rung, but to a coarser one only where its
+            //   steps line up with the substeps
+            const int32_t want = block_rung(dt, ax[i], ay[i], az[i], br[i], maxrung);
+            if (want > rung[i]) rung[i] = want;
+            while (want < rung[i] and (isub+nstride) % (nsub >> (rung[i]-1)) == 0) rung[i]--;
+          }
+        }
+      }
+
+      std::chrono::duration<double> elapsed = std::chrono::system_clock::now() - start;
+      const double energy = total_energy(npart, bx.data(), by.data(), bz.data(), bvx.data(), bvy.data(), bvz.data(), bs.data(), br.data());
+      printf( "    %s: target evaluations( %g ) or ( %.1f%% of the finest ) time( %g s ) energy error( %g )\n",
+              _label, nevals, 100.0*nevals/((double)npart*(1.0+(double)nsteps*nsub)), elapsed.count(), std::abs(energy-energy0)/std::abs(energy0));
+      if (_fixed < 0) {
+        printf( "      initial particles per rung (");
+        for (int32_t r=0; r<=maxrung; ++r) printf( " %d", count[r]);
+        printf( " )\n");
+      }
+    };
+
+    block_run(-1, "block steps   ");
+    block_run(maxrung, "finest global ");
+    block_run(0, "coarse global ");
+  }
+
+  // -------------------------
+  // the same span of time with other integrators, against classic RK4 at an eighth of the step:
+  //   Euler, midpoint RK2 and RK4 at dt, and Bogacki-Shampine 3(2) with its own step sizes; then
+  //   forward Euler against velocity Verlet for gravity with velocities on the Plummer sphere
+
+  if (inttol > 0.0) {
+    const int32_t refsub = 8;
+    const double tend = nsteps * dt;
+    printf( "  host integrators to time %g, against rk4 with steps of %g\n", tend, dt/refsub);
+    RKStages stages(npart);
+    std::vector<FLOAT> ix(npart), iy(npart), iz(npart), nx(npart), ny(npart), nz(npart);
+    std::vector<FLOAT> refx(npart), refy(npart), refz(npart);
+
+    // every fixed-step run reuses the same buffers
+    auto fixed_run = [&](const RKTableau& _t, const FLOAT _dt, const int32_t _nsteps, double& _time) {
+      std::copy(hsx0.begin(), hsx0.begin()+npart, ix.begin());
+      std::copy(hsy0.begin(), hsy0.begin()+npart, iy.begin());
+      std::copy(hsz0.begin(), hsz0.begin()+npart, iz.begin());
+      int32_t nevals = 0;
+      start = std::chrono::system_clock::now();
+      for (int32_t istep=0; istep<_nsteps; ++istep) {
+        rk_step(_t, _dt, npart, ix.data(), iy.data(), iz.data(), hss.data(), hsr.data(),
+                nx.data(), ny.data(), nz.data(), stages, false, nevals);
+        ix.swap(nx);  iy.swap(ny);  iz.swap(nz);
+      }
+      std::chrono::duration<double> elapsed = std::chrono::system_clock::now() - start;
+      _time = elapsed.count();
+      return nevals;
+    };
+    auto report = [&](const char* _name, const int32_t _nsteps, const int32_t _nevals, const double _time) {
+      double rms, emax;
+      position_error(npart, ix.data(), iy.data(), iz.data(), refx.data(), refy.data(), refz.data(), rms, emax);
+      printf( "    %-6s  steps( %d ) evaluations( %d ) time( %g s ) position error rms( %g ) max( %g )\n",
+              _name, _nsteps, _nevals, _time, rms, emax);
+    };
+
+    double itime;
+    fixed_run(rk_classic, dt/refsub, nsteps*refsub, itime);
+    refx = ix;  refy = iy;  refz = iz;
+    for (const RKTableau* t : {&rk_euler, &rk_midpoint, &rk_classic}) {
+      const int32_t nevals = fixed_run(*t, dt, nsteps, itime);
+      report(t->name, nsteps, nevals, itime);
+    }
+
+    // adaptive steps, starting from dt, with the last stage reused as the next first stage
+    {
+      std::copy(hsx0.begin(), hsx0.begin()+npart, ix.begin());
+      std::copy(hsy0.begin(), hsy0.begin()+npart, iy.begin());
+      std::copy(hsz0.begin(), hsz0.begin()+npart, iz.begin());
+      int32_t nevals = 0, naccept = 0, nreject = 0;
+      bool have_first = false;
+      double t = 0.0;
+      double h = dt;
+      start = std::chrono::system_clock::now();
+      while (t < tend*(1.0-1.e-6)) {
+        h = std::min(h, tend-t);
+        const double err = rk_step(rk_bs23, h, npart, ix.data(), iy.data(), iz.data(), hss.data(), hsr.data(),
+                                   nx.data(), ny.data(), nz.data(), stages, have_first, nevals) / inttol;
+        if (err <= 1.0) {
+          t += h;
+          ix.swap(nx);  iy.swap(ny);  iz.swap(nz);
+          stages.ku[0].swap(stages.ku[3]);
+          stages.kv[0].swap(stages.kv[3]);
+          stages.kw[0].swap(stages.kw[3]);
+          naccept++;
+        } else {
+          nreject++;
+        }
+        have_first = true;
+        h *= std::min(4.0, std::max(0.2, 0.9*std::pow(std::max(err, 1.e-10), -1.0/(rk_bs23.lower+1))));
+      }
+      std::chrono::duration<double> elapsed = std::chrono::system_clock::now() - start;
+      char name[64];
+      snprintf(name, sizeof(name), "%s, tolerance %g, %d rejected", rk_bs23.name, inttol, nreject);
+      report(name, naccept, nevals, elapsed.count());
+    }
+
+    // gravity on the Plummer sphere, one evaluation per step either way
+    std::vector<FLOAT> gvx(npart), gvy(npart), gvz(npart), gs(npart), gr(npart, thisrad), gu(npart), gv(npart), gw(npart);
+    std::mt19937 prng(4321);
+    auto gravity_run = [&](const bool _verlet, const FLOAT _dt, const int32_t _nsteps) {
+      plummer_sphere(npart, PLUMMER_SCALE, prng, ix.data(), iy.data(), iz.data(), gvx.data(), gvy.data(), gvz.data(), gs.data());
+      prng.seed(4321);
+      const double energy0 = total_energy(npart, ix.data(), iy.data(), iz.data(), gvx.data(), gvy.data(), gvz.data(), gs.data(), gr.data());
+      start = std::chrono::system_clock::now();
+      host_velocity(npart, ix.data(), iy.data(), iz.data(), gs.data(), gr.data(), npart, nullptr, gu.data(), gv.data(), gw.data());
+      for (int32_t istep=0; istep<_nsteps; ++istep) {
+        #pragma omp parallel for
+        for (int32_t i=0; i<npart; ++i) {
+          if (_verlet) {
+            // half kick and drift; the other half kick follows the new accelerations
+            gvx[i] += 0.5*_dt*gu[i];  gvy[i] += 0.5*_dt*gv[i];  gvz[i] += 0.5*_dt*gw[i];
+            ix[i] += _dt*gvx[i];  iy[i] += _dt*gvy[i];  iz[i] += _dt*gvz[i];
+          } else {
+            ix[i] += _dt*gvx[i];  iy[i] += _dt*gvy[i];  iz[i] += _dt*gvz[i];
+            gvx[i] += _dt*gu[i];  gvy[i] += _dt*gv[i];  gvz[i] += _dt*gw[i];
+          }
+        }
+        host_velocity(npart, ix.data(), iy.data(), iz.data(), gs.data(), gr.data(), npart, nullptr, gu.data(), gv.data(), gw.data());
+        if (_verlet) {
+          #pragma omp parallel for
+          for (int32_t i=0; i<npart; ++i) {
+            gvx[i] += 0.5*_dt*gu[i];  gvy[i] += 0.5*_dt*gv[i];  gvz[i] += 0.5*_dt*gw[i];
+          }
+        }
+      }
+      std::chrono::duration<double> elapsed = std::chrono::system_clock::now() - start;
+      const double energy = total_energy(npart, ix.data(), iy.data(), iz.data(), gvx.data(), gvy.data(), gvz.data(), gs.data(), gr.data());
+      printf( "    %-6s  steps( %d ) evaluations( %d ) time( %g s ) energy error( %g )\n", _verlet ? "verlet" : "euler",
+              _nsteps, _nsteps+1, elapsed.count(), std::abs(energy-energy0)/std::abs(energy0));
+    };
+    printf( "  host gravity integrators on a Plummer sphere to time %g\n", tend);
+    gravity_run(false, dt, nsteps);
+    gravity_run(false, dt/refsub, nsteps*refsub);
+    gravity_run(true, dt, nsteps);
+  }
+
+  // -------------------------
+  // parareal: the span is cut into nslices slices; one Euler step across each slice is the
+  //   coarse propagator, run serially, and the same Euler steps as the plain loop are the fine
+  //   propagator, run on all unconverged slices at once, each slice on its share of the threads
+
+  if (nslices > 0) {
+    const int32_t nfine = nsteps / nslices;
+    const int32_t n3 = 3*npart;
+    const int32_t nthreads = omp_get_max_threads();
+    // slice starts, coarse results from the last iteration, and fine results
+    std::vector<std::vector<FLOAT>> ustart(nslices+1, std::vector<FLOAT>(n3));
+    std::vector<std::vector<FLOAT>> gprev(nslices, std::vector<FLOAT>(n3));
+    std::vector<std::vector<FLOAT>> fine(nslices, std::vector<FLOAT>(n3));
+    std::vector<std::vector<FLOAT>> fvel(nslices, std::vector<FLOAT>(n3));
+    std::vector<FLOAT> coarse(n3), cvel(n3);
+
+    // Euler steps on a state stored as x, then y, then z
+    auto euler = [&](FLOAT* _x, FLOAT* _u, const FLOAT _dt, const int32_t _nsteps) {
+      for (int32_t istep=0; istep<_nsteps; ++istep) {
+        host_velocity(npart, _x, _x+npart, _x+2*npart, hss.data(), hsr.data(), npart, nullptr, _u, _u+npart, _u+2*npart);
+        #pragma omp parallel for
+        for (int32_t i=0; i<n3; ++i) _x[i] += _dt * _u[i];
+      }
+    };
+
+    start = std::chrono::system_clock::now();
+    std::copy(hsx0.begin(), hsx0.begin()+npart, ustart[0].begin());
+    std::copy(hsy0.begin(), hsy0.begin()+npart, ustart[0].begin()+npart);
+    std::copy(hsz0.begin(), hsz0.begin()+npart, ustart[0].begin()+2*npart);
+    for (int32_t n=0; n<nslices; ++n) {
+      gprev[n] = ustart[n];
+      euler(gprev[n].data(), cvel.data(), dt*nfine, 1);
+      ustart[n+1] = gprev[n];
+    }
+    // evaluations along the critical path, if every active slice had its own threads
+    double critical = nslices;
+
+    int32_t iter = 0;
+    double change = 0.0;
+    // nested teams only for this block, then back to the settings the rest of the program uses
+    const int prevlevels = omp_get_max_active_levels();
+    const int prevthreads = omp_get_max_threads();
+    omp_set_max_active_levels(2);
+    printf( "  host parareal over %d slices of %d steps, on %d threads\n", nslices, nfine, nthreads);
+    for (iter=1; iter<=nslices; ++iter) {
+      // slices before iter-1 start from converged states and have converged fine results
+      const int32_t first = iter-1;
+      const int32_t nactive = nslices - first;
+      const int32_t nouter = std::min(nactive, nthreads);
+      #pragma omp parallel for num_threads(nouter) schedule(static,1)
+      for (int32_t n=first; n<nslices; ++n) {
+        omp_set_num_threads(std::max(1, nthreads/nouter));
+        fine[n] = ustart[n];
+        euler(fine[n].data(), fvel[n].data(), dt, nfine);
+      }
+      critical += nfine;
+
+      // serial correction sweep
+      double sumsq = 0.0;
+      for (int32_t n=first; n<nslices; ++n) {
+        coarse = ustart[n];
+        euler(coarse.data(), cvel.data(), dt*nfine, 1);
+        critical += 1;
+        #pragma omp parallel for reduction(+:sumsq)
+        for (int32_t i=0; i<n3; ++i) {
+          // the coarse difference is exactly zero once a slice's start has converged
+          const FLOAT next = fine[n][i] + (coarse[i] - gprev[n][i]);
+          sumsq += std::pow(next - ustart[n+1][i], 2);
+          ustart[n+1][i] = next;
+        }
+        gprev[n].swap(coarse);
+      }
+      change = std::sqrt(sumsq / ((double)npart*nslices));
+      printf( "    iteration %d: rms change at the slice ends( %g )\n", iter, change);
+      if (change < PARAREAL_TOL) break;
+    }
+    iter = std::min(iter, nslices);
+    omp_set_max_active_levels(prevlevels);
+    omp_set_num_threads(prevthreads);
+
+    end = std::chrono::system_clock::now();
+    elapsed_seconds = end-start;
+    const double ptime = elapsed_seconds.count();
+
+    double rms, emax;
+    const FLOAT* pend = ustart[nslices].data();
+    position_error(npart, pend, pend+npart, pend+2*npart, hsx.data(), hsy.data(), hsz.data(), rms, emax);
+    printf( "    %d iterations, total time( %g s ) speedup( %g ) over the plain loop\n", iter, ptime, hosttime/ptime);
+    printf( "    critical path( %g ) evaluations against ( %d ) serial, for a speedup of up to( %g )\n",
+            critical, nsteps, nsteps/critical);
+    printf( "    position difference rms( %g ) max( %g ) from the plain loop\n", rms, emax);
+  }
+
+  // -------------------------
+  // the same steps with a monopole treecode, once rebuilding the tree and interaction lists every
+  //   step, and once keeping the topology and lists and only refitting boxes and moments, until a
+  //   cached far interaction opens past TREE_SLACK times the limit
+
+  if (theta > 0.0) {
+    std::vector<TreeNode> nodes(1, TreeNode{0, npart, -1});
+    std::vector<std::vector<int32_t>> levels;
+    tree_split(nodes, levels, 0, 0);
+    std::vector<int32_t> leaves;
+    for (int32_t j=0; j<(int32_t)nodes.size(); ++j) if (nodes[j].child < 0) leaves.push_back(j);
+    std::vector<std::vector<int32_t>> far(leaves.size()), near(leaves.size());
+    printf( "  host treecode with opening angle %g, %zu nodes and %zu leaves\n", theta, nodes.size(), leaves.size());
+
+    std::vector<FLOAT> px, py, pz, ps, pr, pu(npart), pv(npart), pw(npart), tmp(npart);
+    std::vector<int32_t> id(npart), itmp(npart);
+
+    auto tree_run = [&](const bool _reuse) {
+      px.assign(hsx0.begin(), hsx0.begin()+npart);
+      py.assign(hsy0.begin(), hsy0.begin()+npart);
+      pz.assign(hsz0.begin(), hsz0.begin()+npart);
+      ps.assign(hss.begin(), hss.begin()+npart);
+      pr.assign(hsr.begin(), hsr.begin()+npart);
+      std::iota(id.begin(), id.end(), 0);
+      int32_t nrebuild = 0;
+      double tbuild = 0.0, trefit = 0.0, teval = 0.0, interact = 0.0;
+      start = std::chrono::system_clock::now();
+
+      for (int32_t istep=0; istep<nsteps; ++istep) {
+        auto tstart = std::chrono::system_clock::now();
+        bool rebuild = (istep == 0 or not _reuse);
+        if (not rebuild) {
+          tree_refit(nodes, levels, px.data(), py.data(), pz.data(), ps.data(), pr.data());
+          rebuild = (tree_worst_angle(nodes, leaves, theta, far) > TREE_SLACK);
+          std::chrono::duration<double> elapsed = std::chrono::system_clock::now() - tstart;
+          trefit += elapsed.count();
+          tstart = std::chrono::system_clock::now();
+        }
+        if (rebuild) {
+          // Morton order, then fit and find the lists
+          const std::vector<uint32_t> order = snap_morton_order<FLOAT>(npart, px.data(), py.data(), pz.data());
+          for (std::vector<FLOAT>* a : {&px, &py, &pz, &ps, &pr}) {
+            for (int32_t i=0; i<npart; ++i) tmp[i] = (*a)[order[i]];
+            a->swap(tmp);
+          }
+          for (int32_t i=0; i<npart; ++i) itmp[i] = id[order[i]];
+          id.swap(itmp);
+          tree_refit(nodes, levels, px.data(), py.data(), pz.data(), ps.data(), pr.data());
+          tree_lists(nodes, leaves, theta, far, near);
+          nrebuild++;
+          std::chrono::duration<double> elapsed = std::chrono::system_clock::now() - tstart;
+          tbuild += elapsed.count();
+          tstart = std::chrono::system_clock::now();
+        }
+
+        // near ranges directly, far nodes through their monopoles gathered into a source list
+        double stepinteract = 0.0;
+        #pragma omp parallel for schedule(guided) reduction(+:stepinteract)
+        for (size_t il=0; il<leaves.size(); ++il) {
+          const TreeNode& leaf = nodes[leaves[il]];
+          const int32_t nt = leaf.end - leaf.start;
+          const int32_t nf = far[il].size();
+          std::vector<FLOAT> fx(nf), fy(nf), fz(nf), fs(nf), fr(nf);
+          for (int32_t k=0; k<nf; ++k) {
+            const TreeNode& nd = nodes[far[il][k]];
+            fx[k] = nd.mx;  fy[k] = nd.my;  fz[k] = nd.mz;  fs[k] = nd.ms;  fr[k] = nd.mr;
+          }
+          FLOAT bu[CPU_TRG_BLK], bv[CPU_TRG_BLK], bw[CPU_TRG_BLK];
+          ngrav_3d_nograds_cpu(nf, fx.data(), fy.data(), fz.data(), fs.data(), fr.data(),
+                               nt, &px[leaf.start], &py[leaf.start], &pz[leaf.start], &pr[leaf.start], bu, bv, bw);
+          for (int32_t i=0; i<nt; ++i) {
+            pu[leaf.start+i] = bu[i];
+            pv[leaf.start+i] = bv[i];
+            pw[leaf.start+i] = bw[i];
+          }
+          stepinteract += (double)nt*nf;
+          for (size_t k=0; k<near[il].size(); k+=2) {
+            const int32_t jstart = near[il][k];
+            const int32_t jend = near[il][k+1];
+            ngrav_3d_nograds_cpu(jend-jstart, &px[jstart], &py[jstart], &pz[jstart], &ps[jstart], &pr[jstart],
+                                 nt, &px[leaf.start], &py[leaf.start], &pz[leaf.start], &pr[leaf.start], bu, bv, bw);
+            for (int32_t i=0; i<nt; ++i) {
+              pu[leaf.start+i] += bu[i];
+              pv[leaf.start+i] += bv[i];
+              pw[leaf.start+i] += bw[i];
+            }
+            stepinteract += (double)nt*(jend-jstart);
+          }
+        }
+        interact += stepinteract;
+
+        // position update (simple euler step)
+        #pragma omp parallel for schedule(guided)
+        for (int32_t i=0; i<npart; ++i) {
+          px[i] += dt * pu[i];
+          py[i] += dt * pv[i];
+          pz[i] += dt * pw[i];
+        }
+        std::chrono::duration<double> elapsed = std::chrono::system_clock::now() - tstart;
+        teval += elapsed.count();
+      }
+
+      end = std::chrono::system_clock::now();
+      elapsed_seconds = end-start;
+      const double ttime = elapsed_seconds.count();
+      std::vector<FLOAT> mx(npart), my(npart), mz(npart);
+      for (int32_t i=0; i<npart; ++i) {
+        mx[id[i]] = px[i];
+        my[id[i]] = py[i];
+        mz[id[i]] = pz[i];
+      }
+      double rms, emax;
+      position_error(npart, mx.data(), my.data(), mz.data(), hsx.data(), hsy.data(), hsz.data(), rms, emax);
+      printf( "    %s: %d rebuilds in %d steps, per step: build( %g s ) refit( %g s ) evaluate( %g s )\n",
+              _reuse ? "refit " : "always", nrebuild, nsteps, tbuild/nsteps, trefit/nsteps, teval/nsteps);
+      printf( "      total time( %g s ) speedup( %g ) over the plain loop, %.2f%% of the direct interactions\n",
+              ttime, hosttime/ttime, 100.0*interact/((double)nsteps*npart*npart));
+      printf( "      position difference rms( %g ) max( %g ) from the plain loop\n", rms, emax);
+    };
+
+    tree_run(false);
+    tree_run(true);
+  }
 
   // -------------------------
   // do the GPU version
@@ -349,6 +1395,7 @@ int main(int argc, char **argv) {
   const dim3 gridupdate(ntargperstrm/THREADS_PER_BLOCK, 1, 1);
 
   // to be fair, we start timer after allocation but before transfer
+  cktime = 0.0;
   start = std::chrono::system_clock::now();
 
   // now perform the data movement and setting
@@ -357,9 +1404,9 @@ int main(int argc, char **argv) {
     hipSetDevice(i);
 
     // set some and move other data
-    hipMemcpyAsync (dsx[i], hsx.data(), srcsize, hipMemcpyHostToDevice, stream[i]);
-    hipMemcpyAsync (dsy[i], hsy.data(), srcsize, hipMemcpyHostToDevice, stream[i]);
-    hipMemcpyAsync (dsz[i], hsz.data(), srcsize, hipMemcpyHostToDevice, stream[i]);
+    hipMemcpyAsync (dsx[i], hsx0.data(), srcsize, hipMemcpyHostToDevice, stream[i]);
+    hipMemcpyAsync (dsy[i], hsy0.data(), srcsize, hipMemcpyHostToDevice, stream[i]);
+    hipMemcpyAsync (dsz[i], hsz0.data(), srcsize, hipMemcpyHostToDevice, stream[i]);
     hipMemcpyAsync (dss[i], hss.data(), srcsize, hipMemcpyHostToDevice, stream[i]);
     hipMemcpyAsync (dsr[i], hsr.data(), srcsize, hipMemcpyHostToDevice, stream[i]);
     // now we need to be careful to point to the part of the source arrays that hold
@@ -404,9 +1451,11 @@ int main(int argc, char **argv) {
     //}
 
     // copy what was changed to all other GPUs
-    for (int32_t dstDev=0; dstDev<ngpus; ++dstDev) {
+    for (int32_t dstDev=0; dstDev<nstreams; ++dstDev) {
       if (dstDev != i) {
-        hipMemcpyPeerAsync (dsx[dstDev], dstDev, dtx.data(), i, trgsize, stream[i]);
+        hipMemcpyPeerAsync (dsx[dstDev] + i*ntargperstrm, dstDev, dtx[i], i, trgsize, stream[i]);
+        hipMemcpyPeerAsync (dsy[dstDev] + i*ntargperstrm, dstDev, dty[i], i, trgsize, stream[i]);
+        hipMemcpyPeerAsync (dsz[dstDev] + i*ntargperstrm, dstDev, dtz[i], i, trgsize, stream[i]);
       }
     }
 
@@ -414,6 +1463,21 @@ int main(int argc, char **argv) {
     hipDeviceSynchronize();
   }
 
+  // GPU 0 now holds all positions; pull them into a staging buffer for the writer
+  if (is_ckstep(istep)) {
+    auto ckstart = std::chrono::system_clock::now();
+    FLOAT* buf = checkpointer.acquire();
+    hipSetDevice(0);
+    hipMemcpy (buf,         dsx[0], npart*sizeof(FLOAT), hipMemcpyDeviceToHost);
+    hipMemcpy (buf+npart,   dsy[0], npart*sizeof(FLOAT), hipMemcpyDeviceToHost);
+    hipMemcpy (buf+2*npart, dsz[0], npart*sizeof(FLOAT), hipMemcpyDeviceToHost);
+    memcpy (buf+3*npart, hss.data(), npart*sizeof(FLOAT));
+    memcpy (buf+4*npart, hsr.data(), npart*sizeof(FLOAT));
+    checkpointer.submit(ckname("device", firststep+istep+1));
+    std::chrono::duration<double> ckelapsed = std::chrono::system_clock::now() - ckstart;
+    cktime += ckelapsed.count();
+  }
+
   }
 
   // moving these calls inside of the kernel loop slows things down a lot
@@ -435,6 +1499,9 @@ int main(int argc, char **argv) {
   time = elapsed_seconds.count();
   printf( "  device total time( %g s ) and flops( %g GFlop/s )\n", time, 1.e-9 * (double)npart*(7+20*(double)npart)/time);
   printf( "    results ( %g %g %g %g %g %g)\n", htu[0], htv[0], htw[0], htu[npart-1], htv[npart-1], htw[npart-1]);
+  if (ckevery > 0) {
+    printf( "  device checkpoint overhead( %g s ) or ( %g %% )\n", cktime, 100.0*cktime/time);
+  }
 
   // free resources, after timer
   for (int32_t i=0; i<nstreams; ++i) {
@@ -463,5 +1530,12 @@ int main(int argc, char **argv) {
     }
   }
   printf( "  total host-device error ( %g ) max error ( %g )\n", std::sqrt(errsum/npart), errmax);
+
+  // wait for the last checkpoints to land
+  if (ckevery > 0) {
+    checkpointer.flush();
+    printf( "  checkpoint writer busy for ( %g s ) in the background, compute waited ( %g s ) for a free buffer\n",
+            checkpointer.write_time(), checkpointer.stall_time());
+  }
 }
 
@@ -0,0 +1,255 @@
+/*
+ * ngHmatrix.cpp
+ *
+ * (c)2022 Mark J. Stock <markjstock@gmail.com>
+ *
+ * hierarchical low-rank (H-matrix) form of the 2D vortex and 3D gravitation interaction
+ *   matrices, for geometry that stays put over many evaluations: a build phase compresses the
+ *   well-separated blocks with adaptive cross approximation (ACA), and every product after
+ *   that runs from memory in about O(N log N); the H-matrix itself is in hmatrix.h
+ */
+
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <algorithm>
+#include <omp.h>
+
+#include "hmatrix.h"
+
+// compute using float
+#define FLOAT float
+
+#define CPU_SRC_BLK 256
+#define CPU_TRG_BLK 32
+
+
+// -------------------------
+// the particles, in cluster tree order once the tree is built
+
+template <int DIM>
+struct Particles {
+  int32_t n = 0;
+  std::vector<FLOAT> x[DIM];
+  std::vector<FLOAT> s, r;
+};
+
+// the velocity at target i induced by a unit-strength source j, one value per component
+static inline void kernel(const Particles<2>& _p, const int32_t i, const int32_t j, double _vel[2]) {
+  const double dx = _p.x[0][j] - _p.x[0][i];
+  const double dy = _p.x[1][j] - _p.x[1][i];
+  const double distsq = dx*dx + dy*dy + _p.r[j]*_p.r[j] + _p.r[i]*_p.r[i];
+  const double factor = 1.0 / (2.0*M_PI * distsq);
+  _vel[0] = dy * factor;
+  _vel[1] = -dx * factor;
+}
+
+static inline void kernel(const Particles<3>& _p, const int32_t i, const int32_t j, double _vel[3]) {
+  const double dx = _p.x[0][j] - _p.x[0][i];
+  const double dy = _p.x[1][j] - _p.x[1][i];
+  const double dz = _p.x[2][j] - _p.x[2][i];
+  const double distsq = dx*dx + dy*dy + dz*dz + _p.r[j]*_p.r[j] + _p.r[i]*_p.r[i];
+  const double factor = 1.0 / (4.0*M_PI * distsq*std::sqrt(distsq));
+  _vel[0] = dx * factor;
+  _vel[1] = dy * factor;
+  _vel[2] = dz * factor;
+}
+
+// -------------------------
+// direct summation with the blocked kernels, for reference
+
+static void direct_cpu(const Particles<2>& _p, const int32_t i0, const int32_t i1, FLOAT* const _vel[2]) {
+  for (int32_t i=i0; i<i1; ++i) _vel[0][i] = _vel[1][i] = 0.0f;
+  for (int32_t jbk=0; jbk<(_p.n+CPU_SRC_BLK-1)/CPU_SRC_BLK; ++jbk) {
+    const int32_t jstart = CPU_SRC_BLK*jbk;
+    const int32_t jend = std::min(_p.n, CPU_SRC_BLK*(jbk+1));
+    for (int32_t i=i0; i<i1; ++i) {
+      FLOAT locu = 0.0f;
+      FLOAT locv = 0.0f;
+      const FLOAT tr2 = _p.r[i]*_p.r[i];
+      #pragma omp simd reduction(+:locu,locv)
+      for (int32_t j=jstart; j<jend; ++j) {
+        const FLOAT dx = _p.x[0][j] - _p.x[0][i];
+        const FLOAT dy = _p.x[1][j] - _p.x[1][i];
+        const FLOAT distsq = dx*dx + dy*dy + _p.r[j]*_p.r[j] + tr2;
+        const FLOAT factor = _p.s[j] / distsq;
+        locu += dy * factor;
+        locv -= dx * factor;
+      }
+      _vel[0][i] += locu / (2.0f*3.1415926536f);
+      _vel[1][i] += locv / (2.0f*3.1415926536f);
+    }
+  }
+}
+
+static void direct_cpu(const Particles<3>& _p, const int32_t i0, const int32_t i1, FLOAT* const _vel[3]) {
+  for (int32_t i=i0; i<i1; ++i) _vel[0][i] = _vel[1][i] = _vel[2][i] = 0.0f;
+  for (int32_t jbk=0; jbk<(_p.n+CPU_SRC_BLK-1)/CPU_SRC_BLK; ++jbk) {
+    const int32_t jstart = CPU_SRC_BLK*jbk;
+    const int32_t jend = std::min(_p.n, CPU_SRC_BLK*(jbk+1));
+    for (int32_t i=i0; i<i1; ++i) {
+      FLOAT locu = 0.0f;
+      FLOAT locv = 0.0f;
+      FLOAT locw = 0.0f;
+      const FLOAT tr2 = _p.r[i]*_p.r[i];
+      #pragma omp simd reduction(+:locu,locv,locw)
+      for (int32_t j=jstart; j<jend; ++j) {
+        const FLOAT dx = _p.x[0][j] - _p.x[0][i];
+        const FLOAT dy = _p.x[1][j] - _p.x[1][i];
+        const FLOAT dz = _p.x[2][j] - _p.x[2][i];
+        const FLOAT distsq = dx*dx + dy*dy + dz*dz + _p.r[j]*_p.r[j] + tr2;
+        const FLOAT factor = _p.s[j] / (distsq * std::sqrt(distsq));
+        locu += dx * factor;
+        locv += dy * factor;
+        locw += dz * factor;
+      }
+      _vel[0][i] += locu / (4.0f*3.1415926536f);
+      _vel[1][i] += locv / (4.0f*3.1415926536f);
+      _vel[2][i] += locw / (4.0f*3.1415926536f);
+    }
+  }
+}
+
+// -------------------------
+
+template <int DIM>
+static void run(const int32_t _n, const int32_t _leaf, const double _eta, const double _tol) {
+
+  printf( "%dD %s, n=%d, leaf %d, eta %g, ACA tolerance %g\n", DIM, DIM==2 ? "vortex" : "gravitation",
+          _n, _leaf, _eta, _tol);
+
+  // random particles in the unit square or cube, as in the other benchmarks
+  Particles<DIM> p;
+  p.n = _n;
+  std::mt19937 rng(1234);
+  std::uniform_real_distribution<FLOAT> xrand(0.0,1.0);
+  for (int d=0; d<DIM; ++d) {
+    p.x[d].resize(_n);
+    for (int32_t i=0; i<_n; ++i) p.x[d][i] = xrand(rng);
+  }
+  p.s.resize(_n);
+  p.r.resize(_n);
+  for (int32_t i=0; i<_n; ++i) p.s[i] = (2.0*xrand(rng)-1.0) / std::sqrt(_n);
+  for (int32_t i=0; i<_n; ++i) p.r[i] = (2./3.) / std::pow(_n, 1.0/DIM);
+
+  // build the tree and put the particles in its order
+  auto start = std::chrono::system_clock::now();
+  Hmatrix<DIM,DIM> h;
+  std::vector<int32_t> idx(_n);
+  std::iota(idx.begin(), idx.end(), 0);
+  hm_build_tree<DIM>(p.x, idx, h.ttree, 0, _n, _leaf);
+  h.stree = h.ttree;
+  {
+    std::vector<FLOAT> tmp(_n);
+    for (int d=0; d<DIM; ++d) {
+      for (int32_t i=0; i<_n; ++i) tmp[i] = p.x[d][idx[i]];
+      p.x[d].swap(tmp);
+    }
+    for (int32_t i=0; i<_n; ++i) tmp[i] = p.s[idx[i]];
+    p.s.swap(tmp);
+    for (int32_t i=0; i<_n; ++i) tmp[i] = p.r[idx[i]];
+    p.r.swap(tmp);
+  }
+  hm_build(h, [&p](const int32_t i, const int32_t j, double* vel) { kernel(p, i, j, vel); }, _eta, _tol);
+  std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - start;
+  const double buildtime = elapsed_seconds.count();
+
+  const double densebytes = (double)DIM*_n*_n*sizeof(FLOAT);
+  printf( "  build time( %g s ) for %d low-rank blocks (mean rank %.1f) and %d dense blocks\n",
+          buildtime, h.nfar, h.nfar ? h.ranksum/h.nfar : 0.0, h.nnear);
+  printf( "  memory( %g MB ): far( %g MB ) near( %g MB ), %.1f%% of the dense matrix\n",
+          1.e-6*(h.far_bytes+h.near_bytes), 1.e-6*h.far_bytes, 1.e-6*h.near_bytes,
+          100.0*(h.far_bytes+h.near_bytes)/densebytes);
+
+  // direct summation
+  std::vector<FLOAT> dvel[DIM], hvel[DIM];
+  FLOAT* dptr[DIM];
+  FLOAT* hptr[DIM];
+  for (int d=0; d<DIM; ++d) {
+    dvel[d].resize(_n);
+    hvel[d].resize(_n);
+    dptr[d] = dvel[d].data();
+    hptr[d] = hvel[d].data();
+  }
+  start = std::chrono::system_clock::now();
+  #pragma omp parallel for schedule(dynamic)
+  for (int32_t i0=0; i0<_n; i0+=CPU_TRG_BLK) {
+    direct_cpu(p, i0, std::min(_n, i0+CPU_TRG_BLK), dptr);
+  }
+  elapsed_seconds = std::chrono::system_clock::now() - start;
+  const double directtime = elapsed_seconds.count();
+
+  // H-matrix products, best of a few
+  std::vector<FLOAT> scratch;
+  double htime = 1.e+30;
+  for (int32_t rep=0; rep<3; ++rep) {
+    start = std::chrono::system_clock::now();
+    hm_matvec(h, p.s.data(), scratch, hptr);
+    elapsed_seconds = std::chrono::system_clock::now() - start;
+    htime = std::min(htime, elapsed_seconds.count());
+  }
+
+  double errsq = 0.0, refsq = 0.0;
+  for (int d=0; d<DIM; ++d) {
+    for (int32_t i=0; i<_n; ++i) {
+      errsq += std::pow((double)hvel[d][i]-dvel[d][i], 2);
+      refsq += std::pow((double)dvel[d][i], 2);
+    }
+  }
+
+  printf( "  direct time( %g s ) H-matrix product time( %g s ) speedup( %g )\n", directtime, htime, directtime/htime);
+  printf( "  relative rms error ( %g )\n", std::sqrt(errsq/refsq));
+}
+
+static void usage() {
+  fprintf(stderr, "Usage: ngHmatrix.bin [-n=<num particles>] [-d=2|3] [-t=<ACA tolerance>] [-e=<eta>] [-l=<leaf size>]\n");
+  fprintf(stderr, "  -d  dimension, default both\n");
+  fprintf(stderr, "  -e  a block is compressed if its larger cluster diameter is under eta times their distance, default 2\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+
+  int32_t n = 20000;
+  int32_t dim = 0;
+  double tol = 1.e-4;
+  double eta = 2.0;
+  int32_t leaf = 64;
+
+  for (int i=1; i<argc; i++) {
+    if (strncmp(argv[i], "-n=", 3) == 0) {
+      int32_t num = atoi(argv[i]+3);
+      if (num < 1) usage();
+      n = num;
+    } else if (strncmp(argv[i], "-d=", 3) == 0) {
+      int32_t num = atoi(argv[i]+3);
+      if (num != 2 and num != 3) usage();
+      dim = num;
+    } else if (strncmp(argv[i], "-t=", 3) == 0) {
+      double num = atof(argv[i]+3);
+      if (num <= 0.0) usage();
+      tol = num;
+    } else if (strncmp(argv[i], "-e=", 3) == 0) {
+      double num = atof(argv[i]+3);
+      if (num <= 0.0) usage();
+      eta = num;
+    } else if (strncmp(argv[i], "-l=", 3) == 0) {
+      int32_t num = atoi(argv[i]+3);
+      if (num < 1) usage();
+      leaf = num;
+    } else {
+      usage();
+    }
+  }
+
+  if (dim != 3) run<2>(n, leaf, eta, tol);
+  if (dim != 2) run<3>(n, leaf, eta, tol);
+
+  return 0;
+}
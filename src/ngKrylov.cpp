@@ -0,0 +1,512 @@
+/*
+ * ngKrylov.cpp
+ *
+ * (c)2022 Mark J. Stock <markjstock@gmail.com>
+ *
+ * solve for the source strengths that produce a prescribed normal velocity at collocation
+ *   points, with GMRES or BiCGStab: the ngrav library's blocked kernel is the matrix-free
+ *   operator (or, optionally, an H-matrix built once from it), and dense near-field blocks
+ *   (consecutive points in Morton order) are inverted once for a block-Jacobi preconditioner
+ */
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <algorithm>
+
+#include "ngrav.h"
+#include "hmatrix.h"
+
+// compute using float
+#define FLOAT float
+
+// the boundary problem: collocation points on the unit sphere with outward normals, each
+//   with a source moved inward by a multiple of the local point spacing
+struct Problem {
+  int32_t n = 0;
+  std::vector<FLOAT> tx, ty, tz, tr;
+  std::vector<FLOAT> sx, sy, sz, sr;
+  std::vector<FLOAT> nx, ny, nz;
+
+  // the operator and its scratch space
+  ngrav_solver* solver = nullptr;
+  std::vector<FLOAT> str, u, v, w;
+  int32_t nmatvec = 0;
+  double tmatvec = 0.0;
+
+  // or an H-matrix of it, whose rows and columns are in the cluster tree's order, perm
+  bool use_hmatrix = false;
+  Hmatrix<3,1> hm;
+  std::vector<int32_t> perm;
+  std::vector<float> hstr, hout, scratch;
+};
+
+// spread the low 10 bits of a number out to every third bit
+static uint32_t spread3(uint32_t _v) {
+  _v &= 0x3ff;
+  _v = (_v | (_v << 16)) & 0x030000ff;
+  _v = (_v | (_v << 8))  & 0x0300f00f;
+  _v = (_v | (_v << 4))  & 0x030c30c3;
+  _v = (_v | (_v << 2))  & 0x09249249;
+  return _v;
+}
+
+// points on the sphere along a Fibonacci spiral, refined toward the +z pole when _cluster > 1
+//   the way a body is refined near an edge, and stored in Morton order so that consecutive
+//   points are near each other
+static void make_problem(Problem& _p, const int32_t _n, const double _offset, const double _cluster) {
+  _p.n = _n;
+  std::vector<double> px(_n), py(_n), pz(_n), depth(_n);
+  const double golden = M_PI * (3.0 - std::sqrt(5.0));
+  for (int32_t i=0; i<_n; ++i) {
+    const double t = (i + 0.5) / _n;
+    pz[i] = 1.0 - 2.0*std::pow(t, _cluster);
+    const double rad = std::sqrt(std::max(0.0, 1.0 - pz[i]*pz[i]));
+    px[i] = rad * std::cos(golden*i);
+    py[i] = rad * std::sin(golden*i);
+    // the area around this point is 2 pi dz/di, so the spacing is its square root
+    depth[i] = _offset * std::sqrt(4.0*M_PI*_cluster*std::pow(t, _cluster-1.0) / _n);
+  }
+
+  std::vector<uint32_t> key(_n);
+  for (int32_t i=0; i<_n; ++i) {
+    key[i] = (spread3(std::min(1023.0, 512.0*(px[i]+1.0))) << 2)
+           | (spread3(std::min(1023.0, 512.0*(py[i]+1.0))) << 1)
+           |  spread3(std::min(1023.0, 512.0*(pz[i]+1.0)));
+  }
+  std::vector<int32_t> order(_n);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](int32_t a, int32_t b) { return key[a] < key[b]; });
+
+  for (auto* vec : {&_p.tx, &_p.ty, &_p.tz, &_p.tr, &_p.sx, &_p.sy, &_p.sz, &_p.sr, &_p.nx, &_p.ny, &_p.nz}) {
+    vec->resize(_n);
+  }
+  for (int32_t i=0; i<_n; ++i) {
+    const int32_t o = order[i];
+    _p.nx[i] = px[o]; _p.ny[i] = py[o]; _p.nz[i] = pz[o];
+    _p.tx[i] = px[o]; _p.ty[i] = py[o]; _p.tz[i] = pz[o];
+    _p.sx[i] = (1.0-depth[o])*px[o]; _p.sy[i] = (1.0-depth[o])*py[o]; _p.sz[i] = (1.0-depth[o])*pz[o];
+    _p.tr[i] = 0.0;
+    _p.sr[i] = 0.0;
+  }
+}
+
+// one entry of the operator: normal velocity at target i from a unit source j
+static inline double entry(const Problem& _p, const int32_t i, const int32_t j) {
+  const double dx = _p.sx[j] - _p.tx[i];
+  const double dy = _p.sy[j] - _p.ty[i];
+  const double dz = _p.sz[j] - _p.tz[i];
+  const double distsq = dx*dx + dy*dy + dz*dz + _p.sr[j]*_p.sr[j] + _p.tr[i]*_p.tr[i];
+  return (_p.nx[i]*dx + _p.ny[i]*dy + _p.nz[i]*dz) / (4.0*M_PI * distsq*std::sqrt(distsq));
+}
+
+// compress the operator: one cluster tree over the targets, whose boxes are refit to the sources
+//   (each source sits just under its target, so the two share the order)
+static void build_hmatrix(Problem& _p, const int32_t _leaf, const double _eta, const double _tol) {
+  const int32_t n = _p.n;
+  _p.perm.resize(n);
+  std::iota(_p.perm.begin(), _p.perm.end(), 0);
+  const std::vector<float> tpos[3] = {_p.tx, _p.ty, _p.tz};
+  hm_build_tree<3>(tpos, _p.perm, _p.hm.ttree, 0, n, _leaf);
+  std::vector<float> spos[3];
+  for (int d=0; d<3; ++d) spos[d].resize(n);
+  for (int32_t k=0; k<n; ++k) {
+    spos[0][k] = _p.sx[_p.perm[k]];
+    spos[1][k] = _p.sy[_p.perm[k]];
+    spos[2][k] = _p.sz[_p.perm[k]];
+  }
+  _p.hm.stree = _p.hm.ttree;
+  hm_fit_boxes<3>(spos, _p.hm.stree);
+  hm_build(_p.hm, [&_p](const int32_t i, const int32_t j, double* val) {
+    val[0] = entry(_p, _p.perm[i], _p.perm[j]);
+  }, _eta, _tol);
+  _p.hstr.resize(n);
+  _p.hout.resize(n);
+  _p.use_hmatrix = true;
+}
+
+// y = A x, through the library's kernel or the H-matrix
+static void matvec(Problem& _p, const std::vector<double>& _x, std::vector<double>& _y) {
+  auto start = std::chrono::system_clock::now();
+  if (_p.use_hmatrix) {
+    for (int32_t k=0; k<_p.n; ++k) _p.hstr[k] = _x[_p.perm[k]];
+    float* out[1] = {_p.hout.data()};
+    hm_matvec(_p.hm, _p.hstr.data(), _p.scratch, out);
+    for (int32_t k=0; k<_p.n; ++k) _y[_p.perm[k]] = _p.hout[k];
+    std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - start;
+    _p.tmatvec += elapsed_seconds.count();
+    _p.nmatvec++;
+    return;
+  }
+  for (int32_t i=0; i<_p.n; ++i) _p.str[i] = _x[i];
+  ngrav_set_strengths(_p.solver, _p.str.data());
+  const int32_t err = ngrav_evaluate(_p.solver, _p.u.data(), _p.v.data(), _p.w.data());
+  if (err != NGRAV_OK) {
+    fprintf(stderr, "evaluate failed: %s\n", ngrav_error_string(err));
+    exit(EXIT_FAILURE);
+  }
+  for (int32_t i=0; i<_p.n; ++i) _y[i] = _p.nx[i]*_p.u[i] + _p.ny[i]*_p.v[i] + _p.nz[i]*_p.w[i];
+  std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - start;
+  _p.tmatvec += elapsed_seconds.count();
+  _p.nmatvec++;
+}
+
+// -------------------------
+// block-Jacobi preconditioner: LU factors of each diagonal block, stored in float
+
+struct BlockJacobi {
+  int32_t n = 0;
+  int32_t bsize = 0;
+  std::vector<FLOAT> lu;
+  std::vector<int32_t> piv;
+
+  int32_t nblocks() const { return bsize > 0 ? (n+bsize-1)/bsize : 0; }
+
+  void build(const Problem& _p, const int32_t _bsize) {
+    n = _p.n;
+    bsize = _bsize;
+    if (bsize < 1) return;
+    lu.resize((size_t)nblocks()*bsize*bsize);
+    piv.resize((size_t)nblocks()*bsize);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int32_t b=0; b<nblocks(); ++b) {
+      const int32_t i0 = b*bsize;
+      const int32_t m = std::min(n, i0+bsize) - i0;
+      std::vector<double> a((size_t)m*m);
+      for (int32_t i=0; i<m; ++i) {
+        for (int32_t j=0; j<m; ++j) a[i*m+j] = entry(_p, i0+i, i0+j);
+      }
+
+      // factor with partial pivoting
+      int32_t* const p = &piv[(size_t)b*bsize];
+      for (int32_t k=0; k<m; ++k) {
+        int32_t big = k;
+        for (int32_t i=k+1; i<m; ++i) if (std::abs(a[i*m+k]) > std::abs(a[big*m+k])) big = i;
+        p[k] = big;
+        if (big != k) for (int32_t j=0; j<m; ++j) std::swap(a[k*m+j], a[big*m+j]);
+        const double inv = 1.0 / a[k*m+k];
+        for (int32_t i=k+1; i<m; ++i) {
+          const double f = (a[i*m+k] *= inv);
+          for (int32_t j=k+1; j<m; ++j) a[i*m+j] -= f * a[k*m+j];
+        }
+      }
+      std::copy(a.begin(), a.end(), lu.begin() + (size_t)b*bsize*bsize);
+    }
+  }
+
+  // z = M^-1 r, or a copy when there are no blocks
+  void apply(const std::vector<double>& _r, std::vector<double>& _z) const {
+    if (bsize < 1) {
+      _z = _r;
+      return;
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (int32_t b=0; b<nblocks(); ++b) {
+      const int32_t i0 = b*bsize;
+      const int32_t m = std::min(n, i0+bsize) - i0;
+      const FLOAT* const a = &lu[(size_t)b*bsize*bsize];
+      const int32_t* const p = &piv[(size_t)b*bsize];
+      double* const z = &_z[i0];
+      for (int32_t i=0; i<m; ++i) z[i] = _r[i0+i];
+      for (int32_t k=0; k<m; ++k) std::swap(z[k], z[p[k]]);
+      for (int32_t i=1; i<m; ++i) {
+        double sum = z[i];
+        for (int32_t j=0; j<i; ++j) sum -= a[i*m+j] * z[j];
+        z[i] = sum;
+      }
+      for (int32_t i=m-1; i>=0; --i) {
+        double sum = z[i];
+        for (int32_t j=i+1; j<m; ++j) sum -= a[i*m+j] * z[j];
+        z[i] = sum / a[i*m+i];
+      }
+    }
+  }
+};
+
+// -------------------------
+// vector helpers
+
+static double dot(const std::vector<double>& _a, const std::vector<double>& _b) {
+  double sum = 0.0;
+  #pragma omp parallel for reduction(+:sum)
+  for (size_t i=0; i<_a.size(); ++i) sum += _a[i]*_b[i];
+  return sum;
+}
+
+static double norm(const std::vector<double>& _a) {
+  return std::sqrt(dot(_a, _a));
+}
+
+// -------------------------
+// restarted GMRES with right preconditioning, so the residual it tracks is the true one;
+//   returns the iteration count
+
+static int32_t gmres(Problem& _p, const BlockJacobi& _pc, const std::vector<double>& _b, std::vector<double>& _x,
+                     const int32_t _restart, const int32_t _maxit, const double _tol) {
+  const int32_t n = _p.n;
+  const double bnorm = norm(_b);
+  std::vector<std::vector<double>> V(_restart+1, std::vector<double>(n));
+  std::vector<double> H((size_t)(_restart+1)*_restart), cs(_restart), sn(_restart), g(_restart+1);
+  std::vector<double> r(n), z(n), w(n);
+
+  int32_t it = 0;
+  matvec(_p, _x, w);
+  for (int32_t i=0; i<n; ++i) r[i] = _b[i] - w[i];
+  double beta = norm(r);
+
+  while (it < _maxit and beta > _tol*bnorm) {
+    for (int32_t i=0; i<n; ++i) V[0][i] = r[i] / beta;
+    std::fill(g.begin(), g.end(), 0.0);
+    g[0] = beta;
+
+    int32_t k = 0;
+    for (; k<_restart and it<_maxit; ++k) {
+      _pc.apply(V[k], z);
+      matvec(_p, z, w);
+      const double wnorm = norm(w);
+
+      // modified Gram-Schmidt
+      for (int32_t j=0; j<=k; ++j) {
+        const double h = dot(w, V[j]);
+        H[j*_restart+k] = h;
+        for (int32_t i=0; i<n; ++i) w[i] -= h*V[j][i];
+      }
+      // a new direction that vanishes against the one it came from is a happy breakdown: the
+      //   subspace holds the solution, so stop here and solve over it rather than normalize zero
+      double hnext = norm(w);
+      const bool breakdown = (hnext <= 1.e-12*wnorm);
+      if (breakdown) hnext = 0.0;
+      else for (int32_t i=0; i<n; ++i) V[k+1][i] = w[i] / hnext;
+
+      // rotate the new column into triangular form
+      for (int32_t j=0; j<k; ++j) {
+        const double t = cs[j]*H[j*_restart+k] + sn[j]*H[(j+1)*_restart+k];
+        H[(j+1)*_restart+k] = -sn[j]*H[j*_restart+k] + cs[j]*H[(j+1)*_restart+k];
+        H[j*_restart+k] = t;
+      }
+      const double den = std::sqrt(H[k*_restart+k]*H[k*_restart+k] + hnext*hnext);
+      cs[k] = H[k*_restart+k] / den;
+      sn[k] = hnext / den;
+      H[k*_restart+k] = den;
+      g[k+1] = -sn[k]*g[k];
+      g[k] = cs[k]*g[k];
+
+      ++it;
+      printf( "    iteration %4d  residual %g\n", it, std::abs(g[k+1])/bnorm);
+      if (breakdown or std::abs(g[k+1]) <= _tol*bnorm) {
+        ++k;
+        break;
+      }
+    }
+
+    // solve the triangular system and update x = x + M^-1 V y
+    std::vector<double> y(k);
+    for (int32_t j=k-1; j>=0; --j) {
+      double sum = g[j];
+      for (int32_t l=j+1; l<k; ++l) sum -= H[j*_restart+l]*y[l];
+      y[j] = sum / H[j*_restart+j];
+    }
+    std::fill(w.begin(), w.end(), 0.0);
+    for (int32_t j=0; j<k; ++j) {
+      for (int32_t i=0; i<n; ++i) w[i] += y[j]*V[j][i];
+    }
+    _pc.apply(w, z);
+    for (int32_t i=0; i<n; ++i) _x[i] += z[i];
+
+    // restart from the true residual
+    matvec(_p, _x, w);
+    for (int32_t i=0; i<n; ++i) r[i] = _b[i] - w[i];
+    beta = norm(r);
+  }
+  return it;
+}
+
+// -------------------------
+// BiCGStab with right preconditioning, two operator calls per iteration
+
+static int32_t bicgstab(Problem& _p, const BlockJacobi& _pc, const std::vector<double>& _b, std::vector<double>& _x,
+                        const int32_t _maxit, const double _tol) {
+  const int32_t n = _p.n;
+  const double bnorm = norm(_b);
+  std::vector<double> r(n), rhat(n), p(n, 0.0), v(n, 0.0), phat(n), s(n), shat(n), t(n);
+
+  matvec(_p, _x, t);
+  for (int32_t i=0; i<n; ++i) r[i] = _b[i] - t[i];
+  rhat = r;
+  double rho = 1.0, alpha = 1.0, omega = 1.0;
+
+  int32_t it = 0;
+  while (it < _maxit and norm(r) > _tol*bnorm) {
+    const double rhonew = dot(rhat, r);
+    const double beta = (rhonew/rho) * (alpha/omega);
+    for (int32_t i=0; i<n; ++i) p[i] = r[i] + beta*(p[i] - omega*v[i]);
+    _pc.apply(p, phat);
+    matvec(_p, phat, v);
+    alpha = rhonew / dot(rhat, v);
+    for (int32_t i=0; i<n; ++i) s[i] = r[i] - alpha*v[i];
+
+    ++it;
+    if (norm(s) <= _tol*bnorm) {
+      for (int32_t i=0; i<n; ++i) _x[i] += alpha*phat[i];
+      printf( "    iteration %4d  residual %g\n", it, norm(s)/bnorm);
+      break;
+    }
+
+    _pc.apply(s, shat);
+    matvec(_p, shat, t);
+    omega = dot(t, s) / dot(t, t);
+    for (int32_t i=0; i<n; ++i) {
+      _x[i] += alpha*phat[i] + omega*shat[i];
+      r[i] = s[i] - omega*t[i];
+    }
+    rho = rhonew;
+    printf( "    iteration %4d  residual %g\n", it, norm(r)/bnorm);
+  }
+  return it;
+}
+
+// -------------------------
+
+static void usage() {
+  fprintf(stderr, "Usage: ngKrylov.bin [-n=<unknowns>] [-s=gmres|bicgstab] [-r=<restart>] [-b=<block size>]\n");
+  fprintf(stderr, "                    [-t=<tolerance>] [-i=<max iterations>] [-o=<source offset>] [-c=<clustering>] [-g]\n");
+  fprintf(stderr, "                    [-a=<ACA tolerance>]\n");
+  fprintf(stderr, "  -b  preconditioner block size, 0 for none, default 64\n");
+  fprintf(stderr, "  -o  source depth inside the surface in local point spacings, default 1\n");
+  fprintf(stderr, "  -c  refinement toward one pole, 1 is uniform, default 3\n");
+  fprintf(stderr, "  -g  run the operator on the GPU\n");
+  fprintf(stderr, "  -a  build an H-matrix of the operator once, compressed to this tolerance, and use it instead\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+
+  int32_t n = 10000;
+  std::string method = "gmres";
+  int32_t restart = 30;
+  int32_t bsize = 64;
+  double tol = 1.e-5;
+  int32_t maxit = 300;
+  double offset = 1.0;
+  double cluster = 3.0;
+  int32_t where = NGRAV_CPU;
+  double acatol = 0.0;
+
+  for (int i=1; i<argc; i++) {
+    if (strncmp(argv[i], "-n=", 3) == 0) {
+      int32_t num = atoi(argv[i]+3);
+      if (num < 1) usage();
+      n = num;
+    } else if (strncmp(argv[i], "-s=", 3) == 0) {
+      method = argv[i]+3;
+      if (method != "gmres" and method != "bicgstab") usage();
+    } else if (strncmp(argv[i], "-r=", 3) == 0) {
+      int32_t num = atoi(argv[i]+3);
+      if (num < 1) usage();
+      restart = num;
+    } else if (strncmp(argv[i], "-b=", 3) == 0) {
+      int32_t num = atoi(argv[i]+3);
+      if (num < 0) usage();
+      bsize = num;
+    } else if (strncmp(argv[i], "-t=", 3) == 0) {
+      double num = atof(argv[i]+3);
+      if (num <= 0.0) usage();
+      tol = num;
+    } else if (strncmp(argv[i], "-i=", 3) == 0) {
+      int32_t num = atoi(argv[i]+3);
+      if (num < 1) usage();
+      maxit = num;
+    } else if (strncmp(argv[i], "-o=", 3) == 0) {
+      double num = atof(argv[i]+3);
+      if (num <= 0.0) usage();
+      offset = num;
+    } else if (strncmp(argv[i], "-c=", 3) == 0) {
+      double num = atof(argv[i]+3);
+      if (num < 1.0) usage();
+      cluster = num;
+    } else if (strncmp(argv[i], "-a=", 3) == 0) {
+      double num = atof(argv[i]+3);
+      if (num <= 0.0) usage();
+      acatol = num;
+    } else if (strncmp(argv[i], "-g", 2) == 0) {
+      where = NGRAV_GPU;
+    } else {
+      usage();
+    }
+  }
+
+  printf( "performing a %d-unknown %s solve on the %s\n", n, method.c_str(),
+          acatol > 0.0 ? "CPU with an H-matrix operator" : (where == NGRAV_GPU ? "GPU" : "CPU"));
+
+  Problem p;
+  make_problem(p, n, offset, cluster);
+  p.str.resize(n);
+  p.u.resize(n);
+  p.v.resize(n);
+  p.w.resize(n);
+  p.solver = ngrav_create(n, where);
+  if (not p.solver) {
+    fprintf(stderr, "Could not create solver!\n");
+    exit(EXIT_FAILURE);
+  }
+  ngrav_set_sources(p.solver, n, p.sx.data(), p.sy.data(), p.sz.data(), p.str.data(), p.sr.data());
+  ngrav_set_targets(p.solver, n, p.tx.data(), p.ty.data(), p.tz.data(), p.tr.data());
+
+  // cancel a unit freestream through the surface
+  std::vector<double> b(n), x(n, 0.0);
+  for (int32_t i=0; i<n; ++i) b[i] = -p.nx[i];
+
+  // the library still checks the answer, with the exact operator
+  auto start = std::chrono::system_clock::now();
+  if (acatol > 0.0) {
+    build_hmatrix(p, 64, 2.0, acatol);
+    std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - start;
+    printf( "  H-matrix: %d low-rank blocks (mean rank %.1f) and %d dense blocks, build time( %g s ) memory( %g MB )\n",
+            p.hm.nfar, p.hm.nfar ? p.hm.ranksum/p.hm.nfar : 0.0, p.hm.nnear, elapsed_seconds.count(),
+            1.e-6*(p.hm.far_bytes+p.hm.near_bytes));
+  }
+
+  start = std::chrono::system_clock::now();
+  BlockJacobi pc;
+  pc.build(p, bsize);
+  std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - start;
+  if (bsize > 0) {
+    printf( "  preconditioner: %d blocks of %d, build time( %g s ) memory( %g MB )\n",
+            pc.nblocks(), bsize, elapsed_seconds.count(), 1.e-6*pc.lu.size()*sizeof(FLOAT));
+  } else {
+    printf( "  no preconditioner\n");
+  }
+
+  start = std::chrono::system_clock::now();
+  const int32_t iters = (method == "gmres") ? gmres(p, pc, b, x, restart, maxit, tol)
+                                            : bicgstab(p, pc, b, x, maxit, tol);
+  elapsed_seconds = std::chrono::system_clock::now() - start;
+  const double solvetime = elapsed_seconds.count();
+  const int32_t nmv = p.nmatvec;
+  const double tmv = p.tmatvec;
+
+  // check the answer with one more product, through the library
+  p.use_hmatrix = false;
+  std::vector<double> ax(n);
+  matvec(p, x, ax);
+  double rsq = 0.0, bsq = 0.0;
+  for (int32_t i=0; i<n; ++i) {
+    rsq += (b[i]-ax[i])*(b[i]-ax[i]);
+    bsq += b[i]*b[i];
+  }
+
+  printf( "  %d iterations, %d operator calls, true relative residual( %g )\n", iters, nmv, std::sqrt(rsq/bsq));
+  printf( "  solve time( %g s ), of which operator( %g s ) at ( %g ms ) and ( %g GInteract/s ) each\n",
+          solvetime, tmv, 1.e+3*tmv/nmv, 1.e-9*(double)n*n*nmv/tmv);
+
+  ngrav_destroy(p.solver);
+  return 0;
+}
@@ -0,0 +1,236 @@
+/*
+ * ngLibrary.cpp
+ *
+ * (c)2022 Mark J. Stock <markjstock@gmail.com>
+ *
+ * exercise the ngrav solver library the way a host code would: many evaluations on one
+ *   solver, and measure the cost of each call beyond the summation itself
+ */
+
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#include "ngrav.h"
+
+
+static void usage() {
+  fprintf(stderr, "Usage: ngLibrary.bin [-g] [-b=<interactions per size>] [-k=<strength vectors>]\n");
+  fprintf(stderr, "  -g  evaluate on the GPU\n");
+  fprintf(stderr, "  -k  strength vectors for the multiple right-hand side test, default 16\n");
+  exit(1);
+}
+
+static void check(const int32_t _err, const char* _what) {
+  if (_err != NGRAV_OK) {
+    fprintf(stderr, "%s failed: %s\n", _what, ngrav_error_string(_err));
+    exit(EXIT_FAILURE);
+  }
+}
+
+int main(int argc, char **argv) {
+
+  int32_t where = NGRAV_CPU;
+  // interactions to spend on each size and mode
+  double budget = 1.e+8;
+  // right-hand sides sharing one geometry
+  int32_t nrhs = 16;
+
+  for (int i=1; i<argc; i++) {
+    if (strncmp(argv[i], "-g", 2) == 0) {
+      where = NGRAV_GPU;
+    } else if (strncmp(argv[i], "-b=", 3) == 0) {
+      double num = atof(argv[i]+3);
+      if (num < 1.0) usage();
+      budget = num;
+    } else if (strncmp(argv[i], "-k=", 3) == 0) {
+      int num = atoi(argv[i]+3);
+      if (num < 1) usage();
+      nrhs = num;
+    } else {
+      usage();
+    }
+  }
+
+  const int32_t nmax = 16384;
+  std::vector<float> hsx(nmax), hsy(nmax), hsz(nmax), hss(nmax), hsr(nmax), htu(nmax), htv(nmax), htw(nmax);
+  std::mt19937 rng(1234);
+  std::uniform_real_distribution<float> xrand(0.0,1.0);
+  for (int32_t i = 0; i < nmax; ++i) hsx[i] = xrand(rng);
+  for (int32_t i = 0; i < nmax; ++i) hsy[i] = xrand(rng);
+  for (int32_t i = 0; i < nmax; ++i) hsz[i] = xrand(rng);
+  for (int32_t i = 0; i < nmax; ++i) hss[i] = xrand(rng) / std::sqrt(nmax);
+  for (int32_t i = 0; i < nmax; ++i) hsr[i] = (2./3.) / std::sqrt(nmax);
+
+  printf( "calling the ngrav library on the %s\n", where == NGRAV_GPU ? "GPU" : "CPU");
+
+  // -------------------------
+  // check one evaluation against a plain double-precision sum
+
+  {
+  const int32_t n = 1000;
+  ngrav_solver* s = ngrav_create(n, where);
+  if (not s) {
+    fprintf(stderr, "Could not create solver!\n");
+    exit(EXIT_FAILURE);
+  }
+  check(ngrav_set_sources(s, n, hsx.data(), hsy.data(), hsz.data(), hss.data(), hsr.data()), "set_sources");
+  check(ngrav_evaluate(s, htu.data(), htv.data(), htw.data()), "evaluate");
+  double errmax = 0.0;
+  for (int32_t i=0; i<n; ++i) {
+    double u = 0.0, v = 0.0, w = 0.0;
+    for (int32_t j=0; j<n; ++j) {
+      const double dx = hsx[j]-hsx[i], dy = hsy[j]-hsy[i], dz = hsz[j]-hsz[i];
+      const double distsq = dx*dx + dy*dy + dz*dz + hsr[j]*hsr[j] + hsr[i]*hsr[i];
+      const double factor = hss[j] / (distsq*std::sqrt(distsq) * 4.0*3.1415926536);
+      u += dx*factor; v += dy*factor; w += dz*factor;
+    }
+    errmax = std::max(errmax, std::sqrt(std::pow(htu[i]-u,2) + std::pow(htv[i]-v,2) + std::pow(htw[i]-w,2)));
+  }
+  printf( "  max error vs. double precision at n=%d ( %g )\n", n, errmax);
+  ngrav_destroy(s);
+  }
+
+  // -------------------------
+  // for each size: a fresh solver per call (what a one-shot program pays), then one solver
+  //   reused for every call with new positions each time; calls per size scale down with n^2
+
+  printf( "  %8s %8s %14s %14s %14s\n", "n", "calls", "cold (us)", "warm (us)", "ns/interact");
+  std::vector<double> sizes, colds, warms;
+  for (int32_t n=64; n<=nmax; n*=2) {
+    const int32_t ncalls = std::max(3, (int32_t)(budget / ((double)n*n)));
+
+    auto start = std::chrono::system_clock::now();
+    for (int32_t c=0; c<ncalls; ++c) {
+      ngrav_solver* s = ngrav_create(n, where);
+      check(ngrav_set_sources(s, n, hsx.data(), hsy.data(), hsz.data(), hss.data(), hsr.data()), "set_sources");
+      check(ngrav_evaluate(s, htu.data(), htv.data(), htw.data()), "evaluate");
+      ngrav_destroy(s);
+    }
+    std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - start;
+    const double cold = elapsed_seconds.count() / ncalls;
+
+    ngrav_solver* s = ngrav_create(nmax, where);
+    check(ngrav_set_sources(s, n, hsx.data(), hsy.data(), hsz.data(), hss.data(), hsr.data()), "set_sources");
+    check(ngrav_evaluate(s, htu.data(), htv.data(), htw.data()), "evaluate");
+    start = std::chrono::system_clock::now();
+    for (int32_t c=0; c<ncalls; ++c) {
+      check(ngrav_set_sources(s, n, hsx.data(), hsy.data(), hsz.data(), hss.data(), hsr.data()), "set_sources");
+      check(ngrav_evaluate(s, htu.data(), htv.data(), htw.data()), "evaluate");
+    }
+    elapsed_seconds = std::chrono::system_clock::now() - start;
+    const double warm = elapsed_seconds.count() / ncalls;
+    ngrav_destroy(s);
+
+    printf( "  %8d %8d %14.2f %14.2f %14.4f\n", n, ncalls, 1.e+6*cold, 1.e+6*warm, 1.e+9*warm/((double)n*n));
+    sizes.push_back(n);
+    colds.push_back(cold);
+    warms.push_back(warm);
+  }
+
+  // the fixed cost of a call is the intercept of time = a + b*n^2 through the two smallest sizes
+  const double n0 = sizes[0]*sizes[0], n1 = sizes[1]*sizes[1];
+  const double coldfix = colds[0] - n0*(colds[1]-colds[0])/(n1-n0);
+  const double warmfix = warms[0] - n0*(warms[1]-warms[0])/(n1-n0);
+  printf( "  fixed cost per call: cold( %g us ) warm( %g us )\n", 1.e+6*coldfix, 1.e+6*warmfix);
+
+  // -------------------------
+  // many strength vectors on one geometry: one pass per vector, then all of them at once
+
+  {
+  const int32_t n = 4096;
+  std::vector<float> str((size_t)nrhs*n), mu((size_t)nrhs*n), mv((size_t)nrhs*n), mw((size_t)nrhs*n);
+  for (auto& v : str) v = (xrand(rng) - 0.5) / std::sqrt(n);
+
+  ngrav_solver* s = ngrav_create(n, where);
+  check(ngrav_set_sources(s, n, hsx.data(), hsy.data(), hsz.data(), hss.data(), hsr.data()), "set_sources");
+  check(ngrav_evaluate_multi(s, nrhs, str.data(), mu.data(), mv.data(), mw.data()), "evaluate_multi");
+
+  auto start = std::chrono::system_clock::now();
+  double errmax = 0.0, velmax = 0.0;
+  for (int32_t k=0; k<nrhs; ++k) {
+    check(ngrav_set_strengths(s, str.data()+(size_t)k*n), "set_strengths");
+    check(ngrav_evaluate(s, htu.data(), htv.data(), htw.data()), "evaluate");
+    for (int32_t i=0; i<n; ++i) {
+      const size_t ik = (size_t)k*n+i;
+      errmax = std::max(errmax, (double)std::sqrt(std::pow(htu[i]-mu[ik],2) + std::pow(htv[i]-mv[ik],2) + std::pow(htw[i]-mw[ik],2)));
+      velmax = std::max(velmax, (double)std::sqrt(htu[i]*htu[i] + htv[i]*htv[i] + htw[i]*htw[i]));
+    }
+  }
+  std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - start;
+  const double single = elapsed_seconds.count();
+
+  start = std::chrono::system_clock::now();
+  check(ngrav_evaluate_multi(s, nrhs, str.data(), mu.data(), mv.data(), mw.data()), "evaluate_multi");
+  elapsed_seconds = std::chrono::system_clock::now() - start;
+  const double multi = elapsed_seconds.count();
+  ngrav_destroy(s);
+
+  printf( "  %d strength vectors at n=%d: separate( %g s ) together( %g s ) speedup( %g )\n", nrhs, n, single, multi, single/multi);
+  printf( "  max difference between them ( %g ) relative to max velocity ( %g )\n", errmax, velmax);
+  }
+
+  // -------------------------
+  // change a few percent of the particles between evaluations and update incrementally
+
+  {
+  const int32_t n = 8192;
+  const int32_t nsteps = 10;
+  std::vector<float> x(hsx.begin(), hsx.begin()+n), y(hsy.begin(), hsy.begin()+n), z(hsz.begin(), hsz.begin()+n);
+  std::vector<float> str(hss.begin(), hss.begin()+n), rad(hsr.begin(), hsr.begin()+n);
+  std::vector<float> fu(n), fv(n), fw(n);
+
+  printf( "  %8s %8s %14s %14s %14s %14s\n", "changed", "per step", "full (ms)", "update (ms)", "speedup", "max error");
+  for (const double frac : {0.001, 0.01, 0.05}) {
+    const int32_t k = std::max(1, (int32_t)(frac*n));
+    ngrav_solver* s = ngrav_create(n, where);
+    check(ngrav_set_incremental(s, nsteps+1), "set_incremental");
+    check(ngrav_set_sources(s, n, x.data(), y.data(), z.data(), str.data(), rad.data()), "set_sources");
+
+    auto start = std::chrono::system_clock::now();
+    check(ngrav_evaluate(s, htu.data(), htv.data(), htw.data()), "evaluate");
+    std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - start;
+    const double full = elapsed_seconds.count();
+
+    // each step nudges k random particles and changes their strengths
+    std::vector<int32_t> idx(k);
+    std::vector<float> cx(k), cy(k), cz(k), cs(k), cr(k);
+    double update = 0.0;
+    for (int32_t step=0; step<nsteps; ++step) {
+      for (int32_t c=0; c<k; ++c) {
+        const int32_t j = std::min(n-1, (int32_t)(xrand(rng)*n));
+        idx[c] = j;
+        x[j] += 0.01*(xrand(rng)-0.5);
+        y[j] += 0.01*(xrand(rng)-0.5);
+        z[j] += 0.01*(xrand(rng)-0.5);
+        str[j] = xrand(rng) / std::sqrt(n);
+        cx[c] = x[j]; cy[c] = y[j]; cz[c] = z[j]; cs[c] = str[j]; cr[c] = rad[j];
+      }
+      start = std::chrono::system_clock::now();
+      check(ngrav_change_sources(s, k, idx.data(), cx.data(), cy.data(), cz.data(), cs.data(), cr.data()), "change_sources");
+      check(ngrav_evaluate(s, htu.data(), htv.data(), htw.data()), "evaluate");
+      elapsed_seconds = std::chrono::system_clock::now() - start;
+      update += elapsed_seconds.count();
+    }
+    ngrav_destroy(s);
+
+    // compare the last update with a fresh full evaluation
+    s = ngrav_create(n, where);
+    check(ngrav_set_sources(s, n, x.data(), y.data(), z.data(), str.data(), rad.data()), "set_sources");
+    check(ngrav_evaluate(s, fu.data(), fv.data(), fw.data()), "evaluate");
+    ngrav_destroy(s);
+    double errmax = 0.0;
+    for (int32_t i=0; i<n; ++i) {
+      errmax = std::max(errmax, (double)std::sqrt(std::pow(htu[i]-fu[i],2) + std::pow(htv[i]-fv[i],2) + std::pow(htw[i]-fw[i],2)));
+    }
+    printf( "  %7.1f%% %8d %14.2f %14.2f %14.2f %14.3g\n", 100.0*frac, k, 1.e+3*full, 1.e+3*update/nsteps, full*nsteps/update, errmax);
+  }
+  }
+
+  return 0;
+}
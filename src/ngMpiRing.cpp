@@ -0,0 +1,315 @@
+/*
+ * ngMpiRing.cpp
+ *
+ * (c)2022 Mark J. Stock <markjstock@gmail.com>
+ *
+ * distributed-memory cpu summation: each rank owns a slice of the particles as targets, and
+ *   the source slices are passed around a ring of ranks, with the send and receive of the next
+ *   slice overlapped with the blocked kernel on the current one; memory per rank is O(N/P)
+ */
+
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+
+#include <mpi.h>
+#include <omp.h>
+
+
+// compute using float or double
+#define FLOAT float
+#define MPI_FLOATTYPE MPI_FLOAT
+
+#define CPU_SRC_BLK 256
+#define CPU_TRG_BLK 32
+
+// target blocks are computed in this many pieces, polling the ring messages in between
+#define RING_POLLS 16
+
+// sources per generated tile in the reference check
+#define CHECK_TILE 65536
+
+
+// -------------------------
+// compute kernel - CPU, accumulating into the target velocities
+void ngrav_3d_nograds_acc_cpu(
+    const int32_t nSrc,
+    const FLOAT* const __restrict__ sx,
+    const FLOAT* const __restrict__ sy,
+    const FLOAT* const __restrict__ sz,
+    const FLOAT* const __restrict__ ss,
+    const FLOAT* const __restrict__ sr,
+    const int32_t nTrg,
+    const FLOAT* const __restrict__ tx,
+    const FLOAT* const __restrict__ ty,
+    const FLOAT* const __restrict__ tz,
+    const FLOAT* const __restrict__ tr,
+    FLOAT* const __restrict__ tu,
+    FLOAT* const __restrict__ tv,
+    FLOAT* const __restrict__ tw) {
+
+  // velocity accumulators for target point
+  FLOAT totu[CPU_TRG_BLK];
+  FLOAT totv[CPU_TRG_BLK];
+  FLOAT totw[CPU_TRG_BLK];
+  for (int32_t i=0; i<nTrg; ++i) {
+    totu[i] = 0.0f;
+    totv[i] = 0.0f;
+    totw[i] = 0.0f;
+  }
+
+  assert(nTrg <= CPU_TRG_BLK && "Cpu target block too large");
+
+  // loop over all source points, two tiers of blocks
+  // this is only for improved precision
+  for (int32_t jbk=0; jbk<((nSrc+CPU_SRC_BLK-1)/CPU_SRC_BLK); ++jbk) {
+    const int32_t jstart = CPU_SRC_BLK*jbk;
+    const int32_t jend = std::min(nSrc, CPU_SRC_BLK*(jbk+1));
+
+    // loop over the 16-ish target points
+    for (int32_t i=0; i<nTrg; ++i) {
+      FLOAT locu = 0.0f;
+      FLOAT locv = 0.0f;
+      FLOAT locw = 0.0f;
+      const FLOAT tr2 = tr[i]*tr[i];
+
+      #pragma omp simd reduction(+:locu,locv,locw)
+      for (int32_t j=jstart; j<jend; ++j) {
+        const FLOAT dx = sx[j] - tx[i];
+        const FLOAT dy = sy[j] - ty[i];
+        const FLOAT dz = sz[j] - tz[i];
+        const FLOAT distsq = dx*dx + dy*dy + dz*dz + sr[j]*sr[j] + tr2;
+        const FLOAT factor = ss[j] / (distsq * std::sqrt(distsq));
+        locu += dx * factor;
+        locv += dy * factor;
+        locw += dz * factor;
+      }
+
+      totu[i] += locu;
+      totv[i] += locv;
+      totw[i] += locw;
+    }
+  }
+
+  // add into main array
+  for (int32_t i=0; i<nTrg; ++i) {
+    tu[i] += totu[i] / (4.0f*3.1415926536f);
+    tv[i] += totv[i] / (4.0f*3.1415926536f);
+    tw[i] += totw[i] / (4.0f*3.1415926536f);
+  }
+
+  return;
+}
+
+// -------------------------
+// particle generation that does not depend on the number of ranks: every field of global
+//   particle i is a hash of (i, field), so any rank can make any slice without communicating
+static inline FLOAT hashed_uniform(const uint64_t _i, const uint64_t _field) {
+  // splitmix64
+  uint64_t z = 0x9e3779b97f4a7c15ull * (5*_i + _field + 1);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  z = z ^ (z >> 31);
+  return (FLOAT)((z >> 40) * (1.0 / 16777216.0));
+}
+
+// fill a slab of 5 fields (x,y,z,s,r), each of stride _ld, with global particles [_first, _first+_n)
+static void make_particles(const int64_t _first, const int32_t _n, const int64_t _ntotal,
+                           FLOAT* _slab, const int64_t _ld) {
+  const FLOAT thisstrmag = 1.0 / std::sqrt(_ntotal);
+  const FLOAT thisrad    = (2./3.) / std::sqrt(_ntotal);
+  #pragma omp parallel for
+  for (int32_t i=0; i<_n; ++i) {
+    const uint64_t gi = _first + i;
+    _slab[i]       = hashed_uniform(gi, 0);
+    _slab[_ld+i]   = hashed_uniform(gi, 1);
+    _slab[2*_ld+i] = hashed_uniform(gi, 2);
+    _slab[3*_ld+i] = thisstrmag * hashed_uniform(gi, 3);
+    _slab[4*_ld+i] = thisrad;
+  }
+}
+
+// main program
+
+static void usage(const int _rank) {
+  if (_rank == 0) {
+    fprintf(stderr, "Usage: mpirun -np <ranks> ngMpiRing.bin [-n=<num parts>] [-w] [-c]\n");
+    fprintf(stderr, "  -n  total particles (strong scaling, at least one per rank), or particles per rank with -w (weak scaling)\n");
+    fprintf(stderr, "  -c  check a sample of targets on every rank against a direct sum\n");
+  }
+  MPI_Finalize();
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+
+  // only the main thread calls MPI
+  int provided;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+  int rank, nranks;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &nranks);
+  if (provided < MPI_THREAD_FUNNELED) {
+    if (rank == 0) fprintf(stderr, "This MPI does not support MPI_THREAD_FUNNELED, which the OpenMP overlap needs!\n");
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+
+  int64_t npart = 400000;
+  bool weak = false;
+  bool check = false;
+
+  for (int i=1; i<argc; i++) {
+    if (strncmp(argv[i], "-n=", 3) == 0) {
+      int64_t num = atoll(argv[i]+3);
+      if (num < 1) usage(rank);
+      npart = num;
+    } else if (strncmp(argv[i], "-w", 2) == 0) {
+      weak = true;
+    } else if (strncmp(argv[i], "-c", 2) == 0) {
+      check = true;
+    } else {
+      usage(rank);
+    }
+  }
+  if (weak) npart *= nranks;
+
+  // rank r owns particles [first[r], first[r+1])
+  std::vector<int64_t> first(nranks+1);
+  for (int32_t r=0; r<=nranks; ++r) first[r] = (npart*r)/nranks;
+  auto nown = [&](const int32_t _r) { return (int32_t)(first[_r+1]-first[_r]); };
+  const int32_t maxlocal = (npart+nranks-1)/nranks;
+  const int32_t nlocal = nown(rank);
+  // every rank needs at least one particle of its own
+  if (npart < nranks or maxlocal > INT32_MAX/5) usage(rank);
+
+  if (rank == 0) {
+    printf( "performing distributed 3D gravitational summation on %lld points\n", (long long)npart);
+    printf( "  nranks ( %d )  threads per rank ( %d )  and up to ( %d ) particles per rank\n", nranks, omp_get_max_threads(), maxlocal);
+  }
+
+  // two source slabs (the one being computed, the one arriving) and the local targets
+  std::vector<FLOAT> slab[2];
+  slab[0].resize(5*(size_t)maxlocal);
+  slab[1].resize(5*(size_t)maxlocal);
+  make_particles(first[rank], nlocal, npart, slab[0].data(), maxlocal);
+  std::vector<FLOAT> htx(slab[0].begin(), slab[0].begin()+nlocal);
+  std::vector<FLOAT> hty(slab[0].begin()+maxlocal, slab[0].begin()+maxlocal+nlocal);
+  std::vector<FLOAT> htz(slab[0].begin()+2*maxlocal, slab[0].begin()+2*maxlocal+nlocal);
+  std::vector<FLOAT> htr(slab[0].begin()+4*maxlocal, slab[0].begin()+4*maxlocal+nlocal);
+  std::vector<FLOAT> htu(nlocal, 0.0), htv(nlocal, 0.0), htw(nlocal, 0.0);
+  const double rankbytes = sizeof(FLOAT) * (10.0*maxlocal + 7.0*nlocal);
+
+  const int32_t right = (rank+1) % nranks;
+  const int32_t left = (rank+nranks-1) % nranks;
+  const int32_t ntblocks = (nlocal+CPU_TRG_BLK-1)/CPU_TRG_BLK;
+
+  // -------------------------
+  // pass the source slabs around the ring
+
+  MPI_Barrier(MPI_COMM_WORLD);
+  double comptime = 0.0;
+  double waittime = 0.0;
+  auto start = std::chrono::system_clock::now();
+
+  int32_t cur = 0;
+  for (int32_t step=0; step<nranks; ++step) {
+
+    // the slab we hold now started on this rank, and we forward it to the right
+    const int32_t owner = (rank+nranks-step) % nranks;
+    const int32_t nsrc = nown(owner);
+    const FLOAT* s = slab[cur].data();
+
+    MPI_Request reqs[2];
+    int32_t nreqs = 0;
+    if (step < nranks-1) {
+      MPI_Irecv(slab[1-cur].data(), 5*maxlocal, MPI_FLOATTYPE, left, step, MPI_COMM_WORLD, &reqs[nreqs++]);
+      MPI_Isend(slab[cur].data(), 5*maxlocal, MPI_FLOATTYPE, right, step, MPI_COMM_WORLD, &reqs[nreqs++]);
+    }
+
+    // compute in a few pieces, letting MPI make progress on the transfer in between
+    auto cstart = std::chrono::system_clock::now();
+    for (int32_t piece=0; piece<RING_POLLS; ++piece) {
+      const int32_t bstart = (ntblocks*piece)/RING_POLLS;
+      const int32_t bend = (ntblocks*(piece+1))/RING_POLLS;
+
+      #pragma omp parallel for schedule(guided)
+      for (int32_t ibk=bstart; ibk<bend; ++ibk) {
+        const int32_t istart = CPU_TRG_BLK*ibk;
+        const int32_t iend = std::min(nlocal, CPU_TRG_BLK*(ibk+1));
+        ngrav_3d_nograds_acc_cpu(nsrc, s, s+maxlocal, s+2*maxlocal, s+3*maxlocal, s+4*maxlocal,
+                                 iend-istart, &htx[istart],&hty[istart],&htz[istart],&htr[istart],
+                                 &htu[istart],&htv[istart],&htw[istart]);
+      }
+
+      if (nreqs > 0) {
+        int done;
+        MPI_Testall(nreqs, reqs, &done, MPI_STATUSES_IGNORE);
+      }
+    }
+    std::chrono::duration<double> celapsed = std::chrono::system_clock::now() - cstart;
+    comptime += celapsed.count();
+
+    // whatever is left of the transfer is exposed
+    auto wstart = std::chrono::system_clock::now();
+    if (nreqs > 0) MPI_Waitall(nreqs, reqs, MPI_STATUSES_IGNORE);
+    std::chrono::duration<double> welapsed = std::chrono::system_clock::now() - wstart;
+    waittime += welapsed.count();
+
+    cur = 1 - cur;
+  }
+
+  auto end = std::chrono::system_clock::now();
+  std::chrono::duration<double> elapsed_seconds = end-start;
+  const double time = elapsed_seconds.count();
+
+  // the slowest rank sets the run time; the spread shows the load balance
+  double ltimes[3] = {time, comptime, waittime};
+  double maxtimes[3], mintimes[3];
+  MPI_Reduce(ltimes, maxtimes, 3, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+  MPI_Reduce(ltimes, mintimes, 3, MPI_DOUBLE, MPI_MIN, 0, MPI_COMM_WORLD);
+
+  if (rank == 0) {
+    const double flops = (double)npart*(7+20*(double)npart);
+    printf( "  ring total time( %g s ) and flops( %g GFlop/s ) or ( %g GFlop/s per rank )\n",
+            maxtimes[0], 1.e-9*flops/maxtimes[0], 1.e-9*flops/maxtimes[0]/nranks);
+    printf( "    compute time( %g to %g s ), exposed communication( %g to %g s )\n",
+            mintimes[1], maxtimes[1], mintimes[2], maxtimes[2]);
+    printf( "    memory per rank( %g MB )\n", 1.e-6*rankbytes);
+    printf( "    results ( %10.8f %10.8f %10.8f %10.8f %10.8f %10.8f )\n", htu[0], htv[0], htw[0], htu[nlocal-1], htv[nlocal-1], htw[nlocal-1]);
+  }
+
+  // -------------------------
+  // compare a few targets per rank to a sum over every source, generated tile by tile
+
+  if (check) {
+    const int32_t nsample = std::min(nlocal, CPU_TRG_BLK);
+    std::vector<FLOAT> tile(5*CHECK_TILE);
+    std::vector<FLOAT> cu(nsample, 0.0), cv(nsample, 0.0), cw(nsample, 0.0);
+    for (int64_t tfirst=0; tfirst<npart; tfirst+=CHECK_TILE) {
+      const int32_t ntile = std::min((int64_t)CHECK_TILE, npart-tfirst);
+      make_particles(tfirst, ntile, npart, tile.data(), CHECK_TILE);
+      const FLOAT* t = tile.data();
+      ngrav_3d_nograds_acc_cpu(ntile, t, t+CHECK_TILE, t+2*CHECK_TILE, t+3*CHECK_TILE, t+4*CHECK_TILE,
+                               nsample, htx.data(), hty.data(), htz.data(), htr.data(),
+                               cu.data(), cv.data(), cw.data());
+    }
+
+    double errmax = 0.0;
+    for (int32_t i=0; i<nsample; ++i) {
+      const double thiserr = std::pow(htu[i]-cu[i], 2) + std::pow(htv[i]-cv[i], 2) + std::pow(htw[i]-cw[i], 2);
+      errmax = std::max(errmax, std::sqrt(thiserr));
+    }
+    double allmax;
+    MPI_Reduce(&errmax, &allmax, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    if (rank == 0) printf( "  ring-direct max error ( %g ) over ( %d ) targets per rank\n", allmax, nsample);
+  }
+
+  MPI_Finalize();
+  return 0;
+}
@@ -0,0 +1,180 @@
+/*
+ * ngSnapshot.cpp
+ *
+ * (c)2022 Mark J. Stock <markjstock@gmail.com>
+ *
+ * Convert particle states between .npy and compressed .nvz snapshots, and measure the
+ *   compression ratio, throughput, and actual position error of the compressed format
+ */
+
+#include <vector>
+#include <random>
+#include <chrono>
+#include <string>
+
+#include <omp.h>
+
+#include "particleio.h"
+#include "snapshot.h"
+
+// compute using float or double
+#define FLOAT float
+
+
+static void usage() {
+  fprintf(stderr, "Usage: ngSnapshot.bin [-i=<in.npy|in.nvz>] [-o=<out.nvz|out.npy>] [-z=<max position error>] [-n=<num parts>]\n");
+  fprintf(stderr, "       with no input, -n random particles are generated; with no output, a round trip is timed\n");
+  exit(1);
+}
+
+static bool ends_with(const char* _s, const char* _end) {
+  const size_t ls = strlen(_s), le = strlen(_end);
+  return ls >= le and strcmp(_s+ls-le, _end) == 0;
+}
+
+static size_t file_size(const char* _fname) {
+  struct stat sb;
+  return stat(_fname, &sb) == 0 ? sb.st_size : 0;
+}
+
+int main(int argc, char **argv) {
+
+  // number of particles to generate, position error bound, files
+  int64_t npart = 10000000;
+  double maxerr = 1.e-5;
+  const char* infile = nullptr;
+  const char* outfile = nullptr;
+
+  for (int i=1; i<argc; i++) {
+    if (strncmp(argv[i], "-n=", 3) == 0) {
+      int64_t num = atoll(argv[i]+3);
+      if (num < 1) usage();
+      npart = num;
+    } else if (strncmp(argv[i], "-z=", 3) == 0) {
+      double num = atof(argv[i]+3);
+      if (num <= 0.0) usage();
+      maxerr = num;
+    } else if (strncmp(argv[i], "-i=", 3) == 0) {
+      infile = argv[i]+3;
+    } else if (strncmp(argv[i], "-o=", 3) == 0) {
+      outfile = argv[i]+3;
+    } else {
+      usage();
+    }
+  }
+
+  // the state in SoA form
+  std::vector<FLOAT> sx, sy, sz, ss, sr;
+
+  auto start = std::chrono::system_clock::now();
+  if (infile and ends_with(infile, ".nvz")) {
+    snapshot_read<FLOAT>(infile, sx, sy, sz, ss, sr);
+    npart = sx.size();
+
+  } else if (infile) {
+    NpyMap map;
+    npy_map_read<FLOAT>(infile, map);
+    if (map.rows != 5) {
+      fprintf(stderr, "Input array must have shape (5, n)!\n");
+      exit(EXIT_FAILURE);
+    }
+    npart = map.cols;
+    sx.assign(npy_row<FLOAT>(map, 0), npy_row<FLOAT>(map, 0)+npart);
+    sy.assign(npy_row<FLOAT>(map, 1), npy_row<FLOAT>(map, 1)+npart);
+    sz.assign(npy_row<FLOAT>(map, 2), npy_row<FLOAT>(map, 2)+npart);
+    ss.assign(npy_row<FLOAT>(map, 3), npy_row<FLOAT>(map, 3)+npart);
+    sr.assign(npy_row<FLOAT>(map, 4), npy_row<FLOAT>(map, 4)+npart);
+    npy_unmap(map);
+
+  } else {
+    // same distribution as the other programs
+    sx.resize(npart);
+    sy.resize(npart);
+    sz.resize(npart);
+    ss.resize(npart);
+    sr.resize(npart);
+    const FLOAT thisstrmag = 1.0 / std::sqrt(npart);
+    const FLOAT thisrad    = (2./3.) / std::sqrt(npart);
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<FLOAT> xrand(0.0,1.0);
+    for (int64_t i = 0; i < npart; ++i) sx[i] = xrand(rng);
+    for (int64_t i = 0; i < npart; ++i) sy[i] = xrand(rng);
+    for (int64_t i = 0; i < npart; ++i) sz[i] = xrand(rng);
+    for (int64_t i = 0; i < npart; ++i) ss[i] = thisstrmag * xrand(rng);
+    for (int64_t i = 0; i < npart; ++i) sr[i] = thisrad;
+  }
+  auto end = std::chrono::system_clock::now();
+  std::chrono::duration<double> elapsed_seconds = end-start;
+  const double rawmb = 5.0*sizeof(FLOAT)*npart / 1.e+6;
+  printf( "loaded %ld particles ( %g MB raw ) in %g s on %d threads\n", (long)npart, rawmb,
+          elapsed_seconds.count(), omp_get_max_threads());
+
+  // conversion
+  if (outfile and ends_with(outfile, ".nvz")) {
+    start = std::chrono::system_clock::now();
+    if (not snapshot_write<FLOAT>(outfile, npart, sx.data(), sy.data(), sz.data(), ss.data(), sr.data(), maxerr)) {
+      fprintf(stderr, "Could not write %s!\n", outfile);
+      exit(EXIT_FAILURE);
+    }
+    end = std::chrono::system_clock::now();
+    elapsed_seconds = end-start;
+    printf( "  wrote %s in %g s ( %g MB/s ), ratio( %g )\n", outfile, elapsed_seconds.count(),
+            rawmb/elapsed_seconds.count(), 1.e+6*rawmb/file_size(outfile));
+    return 0;
+
+  } else if (outfile) {
+    std::vector<FLOAT> state(5*npart);
+    std::copy(sx.begin(), sx.end(), state.begin());
+    std::copy(sy.begin(), sy.end(), state.begin()+npart);
+    std::copy(sz.begin(), sz.end(), state.begin()+2*npart);
+    std::copy(ss.begin(), ss.end(), state.begin()+3*npart);
+    std::copy(sr.begin(), sr.end(), state.begin()+4*npart);
+    if (not npy_write<FLOAT>(outfile, 5, npart, state.data())) {
+      fprintf(stderr, "Could not write %s!\n", outfile);
+      exit(EXIT_FAILURE);
+    }
+    printf( "  wrote %s\n", outfile);
+    return 0;
+  }
+
+  // -------------------------
+  // no output: time a round trip through a scratch file and check the error
+
+  const std::string scratch = "ngSnapshot_scratch.nvz";
+  start = std::chrono::system_clock::now();
+  if (not snapshot_write<FLOAT>(scratch.c_str(), npart, sx.data(), sy.data(), sz.data(), ss.data(), sr.data(), maxerr)) {
+    fprintf(stderr, "Could not write %s!\n", scratch.c_str());
+    exit(EXIT_FAILURE);
+  }
+  end = std::chrono::system_clock::now();
+  elapsed_seconds = end-start;
+  const double wtime = elapsed_seconds.count();
+  const size_t csize = file_size(scratch.c_str());
+
+  std::vector<FLOAT> qx, qy, qz, qs, qr;
+  start = std::chrono::system_clock::now();
+  snapshot_read<FLOAT>(scratch.c_str(), qx, qy, qz, qs, qr);
+  end = std::chrono::system_clock::now();
+  elapsed_seconds = end-start;
+  const double rtime = elapsed_seconds.count();
+  remove(scratch.c_str());
+
+  printf( "  compressed to ( %g MB ), ratio( %g )\n", csize/1.e+6, 1.e+6*rawmb/csize);
+  printf( "  write time( %g s ) or ( %g MB/s )\n", wtime, rawmb/wtime);
+  printf( "  read time( %g s ) or ( %g MB/s )\n", rtime, rawmb/rtime);
+
+  // the snapshot comes back in Morton order, which we can reproduce from the originals
+  const std::vector<uint32_t> order = snap_morton_order<FLOAT>(npart, sx.data(), sy.data(), sz.data());
+  double poserr = 0.0;
+  int64_t nbad = 0;
+  for (int64_t i=0; i<npart; ++i) {
+    const int64_t a = order[i];
+    if (ss[a] != qs[i] or sr[a] != qr[i]) ++nbad;
+    poserr = std::max(poserr, (double)std::abs(sx[a]-qx[i]));
+    poserr = std::max(poserr, (double)std::abs(sy[a]-qy[i]));
+    poserr = std::max(poserr, (double)std::abs(sz[a]-qz[i]));
+  }
+  printf( "  max position error( %g ) with bound( %g ), mismatched strengths( %ld )\n", poserr, maxerr, (long)nbad);
+
+  return 0;
+}
@@ -0,0 +1,447 @@
+/*
+ * ngStreaming.cpp
+ *
+ * (c)2022 Mark J. Stock <markjstock@gmail.com>
+ *
+ * out-of-core cpu summation: targets stay in memory, while source tiles are streamed from
+ *   a (5, n) .npy file by a dedicated i/o thread that reads ahead of the compute threads
+ */
+
+#include <vector>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "particleio.h"
+
+
+// compute using float or double
+#define FLOAT float
+
+#define CPU_SRC_BLK 256
+#define CPU_TRG_BLK 32
+
+// sources per streamed tile, and how many tiles may be resident at once
+#define STREAM_TILE (1<<20)
+#define STREAM_NBUF 3
+
+// alignment required for O_DIRECT reads
+#define DIRECT_ALIGN 4096
+
+
+// -------------------------
+// compute kernel - CPU, accumulating into the target velocities
+void ngrav_3d_nograds_acc_cpu(
+    const int32_t nSrc,
+    const FLOAT* const __restrict__ sx,
+    const FLOAT* const __restrict__ sy,
+    const FLOAT* const __restrict__ sz,
+    const FLOAT* const __restrict__ ss,
+    const FLOAT* const __restrict__ sr,
+    const int32_t nTrg,
+    const FLOAT* const __restrict__ tx,
+    const FLOAT* const __restrict__ ty,
+    const FLOAT* const __restrict__ tz,
+    const FLOAT* const __restrict__ tr,
+    FLOAT* const __restrict__ tu,
+    FLOAT* const __restrict__ tv,
+    FLOAT* const __restrict__ tw) {
+
+  // velocity accumulators for target point
+  FLOAT totu[CPU_TRG_BLK];
+  FLOAT totv[CPU_TRG_BLK];
+  FLOAT totw[CPU_TRG_BLK];
+  for (int32_t i=0; i<nTrg; ++i) {
+    totu[i] = 0.0f;
+    totv[i] = 0.0f;
+    totw[i] = 0.0f;
+  }
+
+  assert(nTrg <= CPU_TRG_BLK && "Cpu target block too large");
+
+  // loop over all source points, two tiers of blocks
+  // this is only for improved precision
+  for (int32_t jbk=0; jbk<((nSrc+CPU_SRC_BLK-1)/CPU_SRC_BLK); ++jbk) {
+    const int32_t jstart = CPU_SRC_BLK*jbk;
+    const int32_t jend = std::min(nSrc, CPU_SRC_BLK*(jbk+1));
+
+    // loop over the 16-ish target points
+    for (int32_t i=0; i<nTrg; ++i) {
+      FLOAT locu = 0.0f;
+      FLOAT locv = 0.0f;
+      FLOAT locw = 0.0f;
+      const FLOAT tr2 = tr[i]*tr[i];
+
+      #pragma omp simd reduction(+:locu,locv,locw)
+      for (int32_t j=jstart; j<jend; ++j) {
+        const FLOAT dx = sx[j] - tx[i];
+        const FLOAT dy = sy[j] - ty[i];
+        const FLOAT dz = sz[j] - tz[i];
+        const FLOAT distsq = dx*dx + dy*dy + dz*dz + sr[j]*sr[j] + tr2;
+        const FLOAT factor = ss[j] / (distsq * std::sqrt(distsq));
+        locu += dx * factor;
+        locv += dy * factor;
+        locw += dz * factor;
+      }
+
+      totu[i] += locu;
+      totv[i] += locv;
+      totw[i] += locw;
+    }
+  }
+
+  // add into main array
+  for (int32_t i=0; i<nTrg; ++i) {
+    tu[i] += totu[i] / (4.0f*3.1415926536f);
+    tv[i] += totv[i] / (4.0f*3.1415926536f);
+    tw[i] += totw[i] / (4.0f*3.1415926536f);
+  }
+
+  return;
+}
+
+// -------------------------
+// read-ahead tile streamer
+// the i/o thread fills a ring of STREAM_NBUF tiles in order; the compute side waits for
+//   tile k, uses it, and releases it so that the i/o thread can load tile k+STREAM_NBUF
+class TileStreamer {
+public:
+  TileStreamer(const char* _fname, const bool _direct)
+    : m_fname(_fname), m_direct(_direct) {
+
+    // read and parse the header with a normal descriptor
+    const int fd = open(_fname, O_RDONLY);
+    if (fd < 0) {
+      fprintf(stderr, "Could not open %s for reading!\n", _fname);
+      exit(EXIT_FAILURE);
+    }
+    unsigned char hdr[4096];
+    const ssize_t nread = pread(fd, hdr, sizeof(hdr), 0);
+    close(fd);
+    npy_parse_header<FLOAT>(_fname, hdr, nread > 0 ? nread : 0, m_offset, m_rows, m_n);
+    if (m_rows != 5) {
+      fprintf(stderr, "Source array must have shape (5, n)!\n");
+      exit(EXIT_FAILURE);
+    }
+    m_ntiles = (m_n + STREAM_TILE - 1) / STREAM_TILE;
+
+    // the descriptor used for streaming
+    m_fd = open(_fname, O_RDONLY | (_direct ? O_DIRECT : 0));
+    if (m_fd < 0) {
+      fprintf(stderr, "Could not open %s%s!\n", _fname, _direct ? " with O_DIRECT" : "");
+      exit(EXIT_FAILURE);
+    }
+    if (not _direct) posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // each field of each tile gets room for one extra aligned block on either end
+    m_fieldbytes = STREAM_TILE*sizeof(FLOAT) + 2*DIRECT_ALIGN;
+    for (int32_t b=0; b<STREAM_NBUF; ++b) {
+      m_buf[b] = static_cast<char*>(aligned_alloc(DIRECT_ALIGN, 5*m_fieldbytes));
+      m_tile[b] = -1;
+    }
+
+    m_thread = std::thread(&TileStreamer::run, this);
+  }
+
+  ~TileStreamer() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+    close(m_fd);
+    for (int32_t b=0; b<STREAM_NBUF; ++b) free(m_buf[b]);
+  }
+
+  int64_t size() const { return m_n; }
+  int64_t ntiles() const { return m_ntiles; }
+
+  // wait for tile _k, set the five field pointers and return its length
+  int32_t acquire(const int64_t _k, const FLOAT* _fld[5]) {
+    const int32_t b = _k % STREAM_NBUF;
+    const auto start = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [&]{ return m_tile[b] == _k; });
+    m_stall += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    for (int32_t f=0; f<5; ++f) _fld[f] = m_fld[b][f];
+    return (int32_t)std::min((int64_t)STREAM_TILE, m_n - _k*STREAM_TILE);
+  }
+
+  // done with tile _k, its buffer may be refilled
+  void release(const int64_t _k) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_tile[_k % STREAM_NBUF] = -1;
+    }
+    m_cv.notify_all();
+  }
+
+  double stall_time() const { return m_stall; }
+  double io_time() const { return m_iotime; }
+  double bytes_read() const { return m_bytes; }
+
+private:
+  // read one field range of one tile into buffer _b, return a pointer to the first value
+  const FLOAT* read_field(const int32_t _b, const int32_t _f, const int64_t _first, const int64_t _count) {
+    char* dst = m_buf[_b] + _f*m_fieldbytes;
+    const int64_t off = m_offset + ((int64_t)_f*m_n + _first)*sizeof(FLOAT);
+    const int64_t len = _count*sizeof(FLOAT);
+
+    // O_DIRECT needs aligned offsets, lengths and buffers, so read a slightly larger range
+    const int64_t aoff = m_direct ? (off/DIRECT_ALIGN)*DIRECT_ALIGN : off;
+    const int64_t aend = m_direct ? ((off+len+DIRECT_ALIGN-1)/DIRECT_ALIGN)*DIRECT_ALIGN : off+len;
+    int64_t done = 0;
+    while (aoff+done < off+len) {
+      const ssize_t got = pread(m_fd, dst+done, aend-aoff-done, aoff+done);
+      if (got <= 0) {
+        fprintf(stderr, "Read of %s failed at byte %lld!\n", m_fname, (long long)(aoff+done));
+        exit(EXIT_FAILURE);
+      }
+      done += got;
+    }
+    m_bytes += done;
+
+    // we will not need these pages again
+    if (not m_direct) posix_fadvise(m_fd, aoff, aend-aoff, POSIX_FADV_DONTNEED);
+
+    return reinterpret_cast<const FLOAT*>(dst + (off-aoff));
+  }
+
+  void run() {
+    for (int64_t k=0; k<m_ntiles; ++k) {
+      const int32_t b = k % STREAM_NBUF;
+      {
+        // wait for the consumer to release this buffer
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [&]{ return m_stop or m_tile[b] == -1; });
+        if (m_stop) return;
+      }
+
+      const auto start = std::chrono::steady_clock::now();
+      const int64_t first = k*STREAM_TILE;
+      const int64_t count = std::min((int64_t)STREAM_TILE, m_n - first);
+      const FLOAT* fld[5];
+      for (int32_t f=0; f<5; ++f) fld[f] = read_field(b, f, first, count);
+      m_iotime += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (int32_t f=0; f<5; ++f) m_fld[b][f] = fld[f];
+        m_tile[b] = k;
+      }
+      m_cv.notify_all();
+    }
+  }
+
+  const char* m_fname;
+  const bool m_direct;
+  int m_fd = -1;
+  size_t m_offset = 0;
+  int64_t m_rows = 0, m_n = 0, m_ntiles = 0;
+  size_t m_fieldbytes = 0;
+  char* m_buf[STREAM_NBUF];
+  const FLOAT* m_fld[STREAM_NBUF][5];
+  int64_t m_tile[STREAM_NBUF];
+  bool m_stop = false;
+  double m_stall = 0.0, m_iotime = 0.0, m_bytes = 0.0;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::thread m_thread;
+};
+
+// write n random particles as a (5, n) .npy file, one tile at a time so n can exceed memory
+static void write_random_sources(const char* _fname, const int64_t _n) {
+  FILE* fp = fopen(_fname, "wb");
+  if (not fp) {
+    fprintf(stderr, "Could not create %s!\n", _fname);
+    exit(EXIT_FAILURE);
+  }
+  const std::string hdr = npy_header<FLOAT>(5, _n);
+  fwrite(hdr.data(), 1, hdr.size(), fp);
+
+  const FLOAT thisstrmag = 1.0 / std::sqrt(_n);
+  const FLOAT thisrad    = (2./3.) / std::sqrt(_n);
+  std::mt19937 rng(1234);
+  std::uniform_real_distribution<FLOAT> xrand(0.0,1.0);
+  std::vector<FLOAT> tile(STREAM_TILE);
+  for (int32_t f=0; f<5; ++f) {
+    for (int64_t first=0; first<_n; first+=STREAM_TILE) {
+      const int64_t count = std::min((int64_t)STREAM_TILE, _n - first);
+      for (int64_t i=0; i<count; ++i) {
+        if (f < 3)       tile[i] = xrand(rng);
+        else if (f == 3) tile[i] = thisstrmag * xrand(rng);
+        else             tile[i] = thisrad;
+      }
+      if (fwrite(tile.data(), sizeof(FLOAT), count, fp) != (size_t)count) {
+        fprintf(stderr, "Could not write %s!\n", _fname);
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+  fclose(fp);
+}
+
+// main program
+
+static void usage() {
+  fprintf(stderr, "Usage: ngStreaming.bin -i=<sources.npy> [-m=<num targets>] [-d] [-c]\n");
+  fprintf(stderr, "       ngStreaming.bin -w=<sources.npy> [-n=<num parts>]\n");
+  fprintf(stderr, "  -i  stream sources from a (5, n) .npy array of x,y,z,s,r; targets are the first m of them\n");
+  fprintf(stderr, "  -d  read with O_DIRECT, bypassing the page cache\n");
+  fprintf(stderr, "  -c  also run in-core and compare\n");
+  fprintf(stderr, "  -w  write n random particles to a file, tile by tile, and quit\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+
+  int64_t npart = 400000;
+  int32_t ntarg = -1;
+  bool direct = false;
+  bool compare = false;
+  const char* infile = nullptr;
+  const char* genfile = nullptr;
+
+  for (int i=1; i<argc; i++) {
+    if (strncmp(argv[i], "-n=", 3) == 0) {
+      int64_t num = atoll(argv[i]+3);
+      if (num < 1) usage();
+      npart = num;
+    } else if (strncmp(argv[i], "-m=", 3) == 0) {
+      int32_t num = atoi(argv[i]+3);
+      if (num < 1) usage();
+      ntarg = num;
+    } else if (strncmp(argv[i], "-i=", 3) == 0) {
+      infile = argv[i]+3;
+    } else if (strncmp(argv[i], "-w=", 3) == 0) {
+      genfile = argv[i]+3;
+    } else if (strncmp(argv[i], "-d", 2) == 0) {
+      direct = true;
+    } else if (strncmp(argv[i], "-c", 2) == 0) {
+      compare = true;
+    }
+  }
+
+  if (genfile) {
+    auto start = std::chrono::system_clock::now();
+    write_random_sources(genfile, npart);
+    std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - start;
+    printf( "wrote %lld particles to %s in ( %g s )\n", (long long)npart, genfile, elapsed_seconds.count());
+    return 0;
+  }
+  if (not infile) usage();
+
+  TileStreamer streamer(infile, direct);
+  const int64_t nsrc = streamer.size();
+  if (ntarg < 0 or ntarg > nsrc) ntarg = (int32_t)std::min(nsrc, (int64_t)INT32_MAX);
+
+  printf( "performing out-of-core 3D gravitational summation of %lld sources on %d targets\n", (long long)nsrc, ntarg);
+  printf( "  %lld tiles of up to %d sources, %d buffers, %s reads\n", (long long)streamer.ntiles(), STREAM_TILE, STREAM_NBUF, direct ? "O_DIRECT" : "buffered");
+
+  // the resident targets are the first ntarg particles
+  std::vector<FLOAT> htx(ntarg), hty(ntarg), htz(ntarg), htr(ntarg), htu(ntarg), htv(ntarg), htw(ntarg);
+  {
+    NpyMap map;
+    npy_map_read<FLOAT>(infile, map);
+    memcpy(htx.data(), npy_row<FLOAT>(map, 0), ntarg*sizeof(FLOAT));
+    memcpy(hty.data(), npy_row<FLOAT>(map, 1), ntarg*sizeof(FLOAT));
+    memcpy(htz.data(), npy_row<FLOAT>(map, 2), ntarg*sizeof(FLOAT));
+    memcpy(htr.data(), npy_row<FLOAT>(map, 4), ntarg*sizeof(FLOAT));
+    npy_unmap(map);
+  }
+  for (int32_t i = 0; i < ntarg; ++i) htu[i] = 0.0;
+  for (int32_t i = 0; i < ntarg; ++i) htv[i] = 0.0;
+  for (int32_t i = 0; i < ntarg; ++i) htw[i] = 0.0;
+
+  // -------------------------
+  // stream the sources through all targets, one tile at a time
+
+  double comptime = 0.0;
+  auto start = std::chrono::system_clock::now();
+
+  for (int64_t k=0; k<streamer.ntiles(); ++k) {
+    const FLOAT* fld[5];
+    const int32_t ntile = streamer.acquire(k, fld);
+
+    auto cstart = std::chrono::system_clock::now();
+    #pragma omp parallel for schedule(guided)
+    for (int32_t ibk=0; ibk<((ntarg+CPU_TRG_BLK-1)/CPU_TRG_BLK); ++ibk) {
+      const int32_t istart = CPU_TRG_BLK*ibk;
+      const int32_t iend = std::min(ntarg, CPU_TRG_BLK*(ibk+1));
+      ngrav_3d_nograds_acc_cpu(ntile, fld[0],fld[1],fld[2],fld[3],fld[4],
+                               iend-istart, &htx[istart],&hty[istart],&htz[istart],&htr[istart],
+                               &htu[istart],&htv[istart],&htw[istart]);
+    }
+    std::chrono::duration<double> celapsed = std::chrono::system_clock::now() - cstart;
+    comptime += celapsed.count();
+
+    streamer.release(k);
+  }
+
+  auto end = std::chrono::system_clock::now();
+  std::chrono::duration<double> elapsed_seconds = end-start;
+  double time = elapsed_seconds.count();
+
+  // overlap is the fraction of the shorter of i/o and compute that was hidden behind the other
+  const double iotime = streamer.io_time();
+  const double overlap = std::max(0.0, iotime + comptime - time) / std::max(1.e-9, std::min(iotime, comptime));
+  printf( "  streamed total time( %g s ) and flops( %g GFlop/s )\n", time, 1.e-9 * (double)ntarg*(7+20*(double)nsrc)/time);
+  printf( "    i/o time( %g s ) at ( %g MB/s ), compute time( %g s ), stalled on i/o( %g s ), overlap ( %4.1f %% )\n",
+          iotime, 1.e-6*streamer.bytes_read()/std::max(1.e-9, iotime), comptime, streamer.stall_time(), 100.0*std::min(1.0, overlap));
+  printf( "    results ( %10.8f %10.8f %10.8f %10.8f %10.8f %10.8f )\n", htu[0], htv[0], htw[0], htu[ntarg-1], htv[ntarg-1], htw[ntarg-1]);
+
+  // -------------------------
+  // in-core version for comparison, only if it fits
+
+  if (compare) {
+  NpyMap map;
+  npy_map_read<FLOAT>(infile, map);
+  std::vector<FLOAT> hsx(npy_row<FLOAT>(map, 0), npy_row<FLOAT>(map, 0)+nsrc);
+  std::vector<FLOAT> hsy(npy_row<FLOAT>(map, 1), npy_row<FLOAT>(map, 1)+nsrc);
+  std::vector<FLOAT> hsz(npy_row<FLOAT>(map, 2), npy_row<FLOAT>(map, 2)+nsrc);
+  std::vector<FLOAT> hss(npy_row<FLOAT>(map, 3), npy_row<FLOAT>(map, 3)+nsrc);
+  std::vector<FLOAT> hsr(npy_row<FLOAT>(map, 4), npy_row<FLOAT>(map, 4)+nsrc);
+  npy_unmap(map);
+  std::vector<FLOAT> cu(ntarg, 0.0), cv(ntarg, 0.0), cw(ntarg, 0.0);
+
+  start = std::chrono::system_clock::now();
+
+  #pragma omp parallel for schedule(guided)
+  for (int32_t ibk=0; ibk<((ntarg+CPU_TRG_BLK-1)/CPU_TRG_BLK); ++ibk) {
+    const int32_t istart = CPU_TRG_BLK*ibk;
+    const int32_t iend = std::min(ntarg, CPU_TRG_BLK*(ibk+1));
+    ngrav_3d_nograds_acc_cpu((int32_t)nsrc, hsx.data(),hsy.data(),hsz.data(),hss.data(),hsr.data(),
+                             iend-istart, &htx[istart],&hty[istart],&htz[istart],&htr[istart],
+                             &cu[istart],&cv[istart],&cw[istart]);
+  }
+
+  end = std::chrono::system_clock::now();
+  elapsed_seconds = end-start;
+  time = elapsed_seconds.count();
+  printf( "  in-core total time( %g s ) and flops( %g GFlop/s )\n", time, 1.e-9 * (double)ntarg*(7+20*(double)nsrc)/time);
+  printf( "    results ( %10.8f %10.8f %10.8f %10.8f %10.8f %10.8f )\n", cu[0], cv[0], cw[0], cu[ntarg-1], cv[ntarg-1], cw[ntarg-1]);
+
+  FLOAT errsum = 0.0;
+  FLOAT errmax = 0.0;
+  for (int32_t i=0; i<ntarg; ++i) {
+    const FLOAT thiserr = std::pow(htu[i]-cu[i], 2) + std::pow(htv[i]-cv[i], 2) + std::pow(htw[i]-cw[i], 2);
+    errsum += thiserr;
+    errmax = std::max(errmax, (FLOAT)std::sqrt(thiserr));
+  }
+  printf( "  total streamed-in-core error ( %g ) max error ( %g )\n", std::sqrt(errsum/ntarg), errmax);
+  }
+}
+
@@ -0,0 +1,134 @@
+/*
+ * ngdaemon.h
+ *
+ * (c)2022 Mark J. Stock <markjstock@gmail.com>
+ *
+ * Protocol and client helpers for the ngDaemon evaluation server
+ *
+ * A client creates an anonymous shared memory file (memfd), lays out one or more problems in
+ *   it, seals it against shrinking (F_SEAL_SHRINK, so the server's mapping can never lose
+ *   pages under it), and passes the file descriptor to the server once over a Unix domain socket
+ *   (ATTACH). The server refuses a file that is unsealed or smaller than the size claimed.
+ *   Each EVAL request then names how many problems are in the buffer; the server computes
+ *   them with its warm solver and writes the velocities back into the same buffer, so particle
+ *   data never travels through the socket. A problem is described by a table at the start of
+ *   the buffer, one NgdItem per problem, whose arrays are floats starting at item.offset:
+ *     x, y, z, s, r            nsrc values each
+ *     tx, ty, tz, tr           ntarg values each (absent when ntarg is 0: targets are sources)
+ *     u, v, w                  one per target
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+// request types
+#define NGD_ATTACH 1	// the shared buffer's fd rides along as SCM_RIGHTS
+#define NGD_EVAL 2		// compute the first nitems problems in the buffer
+#define NGD_QUIT 3		// shut the server down
+
+struct NgdRequest {
+  uint32_t op;
+  uint32_t nitems;
+  uint64_t bytes;		// size of the shared buffer, for ATTACH
+};
+
+struct NgdReply {
+  int32_t status;		// NGRAV_OK or an ngrav error code, or -1 for a bad request
+  uint32_t ndone;		// problems computed
+  double seconds;		// time the server spent computing
+};
+
+struct NgdItem {
+  uint64_t offset;		// byte offset of this problem's first array, 64-byte aligned
+  int32_t nsrc;
+  int32_t ntarg;
+};
+
+// floats needed by one problem
+inline size_t ngd_item_floats(const int32_t _nsrc, const int32_t _ntarg) {
+  const size_t nt = _ntarg > 0 ? _ntarg : _nsrc;
+  return 5*(size_t)_nsrc + 4*(size_t)_ntarg + 3*nt;
+}
+
+// bytes for one problem, rounded up so that the next one stays aligned
+inline size_t ngd_item_bytes(const int32_t _nsrc, const int32_t _ntarg) {
+  return 64*((ngd_item_floats(_nsrc, _ntarg)*sizeof(float) + 63)/64);
+}
+
+// bytes for the item table at the start of the buffer
+inline size_t ngd_table_bytes(const uint32_t _nitems) {
+  return 64*((_nitems*sizeof(NgdItem) + 63)/64);
+}
+
+// connect to a server; returns the socket or -1
+inline int ngd_connect(const char* _path) {
+  const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0) return -1;
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, _path, sizeof(addr.sun_path)-1);
+  if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+// send a request, with an fd when _fd >= 0; returns false on failure
+inline bool ngd_send(const int _sock, const NgdRequest& _req, const int _fd) {
+  struct iovec iov;
+  iov.iov_base = const_cast<NgdRequest*>(&_req);
+  iov.iov_len = sizeof(NgdRequest);
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  if (_fd >= 0) {
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &_fd, sizeof(int));
+  }
+  return sendmsg(_sock, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(NgdRequest);
+}
+
+// receive a request and any fd that came with it (-1 if none); returns false on eof or error
+inline bool ngd_recv(const int _sock, NgdRequest& _req, int& _fd) {
+  struct iovec iov;
+  iov.iov_base = &_req;
+  iov.iov_len = sizeof(NgdRequest);
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+  _fd = -1;
+  if (recvmsg(_sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != (ssize_t)sizeof(NgdRequest)) return false;
+  for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+    if (cm->cmsg_level == SOL_SOCKET and cm->cmsg_type == SCM_RIGHTS) memcpy(&_fd, CMSG_DATA(cm), sizeof(int));
+  }
+  return true;
+}
+
+// one request and its reply; returns false if the connection failed
+inline bool ngd_call(const int _sock, const NgdRequest& _req, const int _fd, NgdReply& _rep) {
+  if (not ngd_send(_sock, _req, _fd)) return false;
+  return recv(_sock, &_rep, sizeof(NgdReply), MSG_WAITALL) == (ssize_t)sizeof(NgdReply);
+}
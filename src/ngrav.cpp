@@ -0,0 +1,1632 @@
+/*
+ * ngrav.cpp
+ *
+ * (c)2022 Mark J. Stock <markjstock@gmail.com>
+ *
+ * persistent solver behind the C interface in ngrav.h
+ */
+
+#include "ngrav.h"
+
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <mutex>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+#include <new>
+#include <omp.h>
+#include <unistd.h>
+
+#include <hip/hip_runtime.h>
+
+
+// compute using float
+#define FLOAT float
+#define RSQRT rsqrtf
+
+#define CPU_SRC_BLK 256
+#define CPU_TRG_BLK 32
+
+// threads per block (hard coded)
+#define THREADS_PER_BLOCK 512
+
+// most source blocks per launch, and thread blocks to aim for on the device
+#define GPU_MAX_SRC_BLOCKS 64
+#define GPU_MIN_BLOCKS 1024
+
+// below this many interactions the CPU runs on the calling thread, since waking the team
+//   costs more than it saves
+#define SERIAL_WORK (1<<18)
+
+
+// -------------------------
+// compute kernel - GPU
+__global__ void ngrav_3d_nograds_gpu(
+    const int32_t nSrc,
+    const FLOAT* const __restrict__ sx,
+    const FLOAT* const __restrict__ sy,
+    const FLOAT* const __restrict__ sz,
+    const FLOAT* const __restrict__ ss,
+    const FLOAT* const __restrict__ sr,
+    const int32_t tOffset,
+    const FLOAT* const __restrict__ tx,
+    const FLOAT* const __restrict__ ty,
+    const FLOAT* const __restrict__ tz,
+    const FLOAT* const __restrict__ tr,
+    FLOAT* const __restrict__ tu,
+    FLOAT* const __restrict__ tv,
+    FLOAT* const __restrict__ tw) {
+
+  // local "thread" id - this is the target particle
+  const int32_t i = tOffset + blockIdx.x*THREADS_PER_BLOCK + threadIdx.x;
+
+  // load sources into shared memory (or not)
+  __shared__ FLOAT s_sx[THREADS_PER_BLOCK];
+  __shared__ FLOAT s_sy[THREADS_PER_BLOCK];
+  __shared__ FLOAT s_sz[THREADS_PER_BLOCK];
+  __shared__ FLOAT s_ss[THREADS_PER_BLOCK];
+  __shared__ FLOAT s_sr[THREADS_PER_BLOCK];
+
+  // velocity accumulators for target point
+  FLOAT locu = 0.0f;
+  FLOAT locv = 0.0f;
+  FLOAT locw = 0.0f;
+
+  const FLOAT tr2 = tr[i]*tr[i];
+
+  // which sources do we iterate over?
+  const int32_t jcount = nSrc / gridDim.y;
+  const int32_t jstart = blockIdx.y * jcount;
+
+  for (int32_t b=0; b<jcount/THREADS_PER_BLOCK; ++b) {
+
+    const int32_t gidx = jstart + b*THREADS_PER_BLOCK + threadIdx.x;
+    s_sx[threadIdx.x] = sx[gidx];
+    s_sy[threadIdx.x] = sy[gidx];
+    s_sz[threadIdx.x] = sz[gidx];
+    s_ss[threadIdx.x] = ss[gidx];
+    s_sr[threadIdx.x] = sr[gidx];
+    __syncthreads();
+
+    for (int32_t j=0; j<THREADS_PER_BLOCK; ++j) {
+      const FLOAT dx = s_sx[j] - tx[i];
+      const FLOAT dy = s_sy[j] - ty[i];
+      const FLOAT dz = s_sz[j] - tz[i];
+      const FLOAT distsq = dx*dx + dy*dy + dz*dz + s_sr[j]*s_sr[j] + tr2;
+      const FLOAT invR = RSQRT(distsq);
+      const FLOAT invR2 = invR*invR;
+      const FLOAT factor = s_ss[j] * invR * invR2;
+      locu += dx * factor;
+      locv += dy * factor;
+      locw += dz * factor;
+    }
+
+    __syncthreads();
+  }
+
+  // save into device view with atomics
+  atomicAdd(&tu[i], locu / (4.0f*3.1415926536f));
+  atomicAdd(&tv[i], locv / (4.0f*3.1415926536f));
+  atomicAdd(&tw[i], locw / (4.0f*3.1415926536f));
+
+  return;
+}
+
+// -------------------------
+// compute kernel - CPU
+static void ngrav_3d_nograds_cpu(
+    const int32_t nSrc,
+    const FLOAT* const __restrict__ sx,
+    const FLOAT* const __restrict__ sy,
+    const FLOAT* const __restrict__ sz,
+    const FLOAT* const __restrict__ ss,
+    const FLOAT* const __restrict__ sr,
+    const int32_t nTrg,
+    const FLOAT* const __restrict__ tx,
+    const FLOAT* const __restrict__ ty,
+    const FLOAT* const __restrict__ tz,
+    const FLOAT* const __restrict__ tr,
+    FLOAT* const __restrict__ tu,
+    FLOAT* const __restrict__ tv,
+    FLOAT* const __restrict__ tw) {
+
+  // velocity accumulators for target point
+  FLOAT totu[CPU_TRG_BLK];
+  FLOAT totv[CPU_TRG_BLK];
+  FLOAT totw[CPU_TRG_BLK];
+  for (int32_t i=0; i<nTrg; ++i) {
+    totu[i] = 0.0f;
+    totv[i] = 0.0f;
+    totw[i] = 0.0f;
+  }
+
+  assert(nTrg <= CPU_TRG_BLK && "Cpu target block too large");
+
+  // loop over all source points, two tiers of blocks
+  // this is only for improved precision
+  for (int32_t jbk=0; jbk<((nSrc+CPU_SRC_BLK-1)/CPU_SRC_BLK); ++jbk) {
+    const int32_t jstart = CPU_SRC_BLK*jbk;
+    const int32_t jend = std::min(nSrc, CPU_SRC_BLK*(jbk+1));
+
+    // loop over the 16-ish target points
+    for (int32_t i=0; i<nTrg; ++i) {
+      FLOAT locu = 0.0f;
+      FLOAT locv = 0.0f;
+      FLOAT locw = 0.0f;
+      const FLOAT tr2 = tr[i]*tr[i];
+
+      #pragma omp simd reduction(+:locu,locv,locw)
+      for (int32_t j=jstart; j<jend; ++j) {
+        const FLOAT dx = sx[j] - tx[i];
+        const FLOAT dy = sy[j] - ty[i];
+        const FLOAT dz = sz[j] - tz[i];
+        const FLOAT distsq = dx*dx + dy*dy + dz*dz + sr[j]*sr[j] + tr2;
+        const FLOAT factor = ss[j] / (distsq * std::sqrt(distsq));
+        locu += dx * factor;
+        locv += dy * factor;
+        locw += dz * factor;
+      }
+
+      totu[i] += locu;
+      totv[i] += locv;
+      totw[i] += locw;
+    }
+  }
+
+  // save into main array
+  for (int32_t i=0; i<nTrg; ++i) {
+    tu[i] = totu[i] / (4.0f*3.1415926536f);
+    tv[i] = totv[i] / (4.0f*3.1415926536f);
+    tw[i] = totw[i] / (4.0f*3.1415926536f);
+  }
+
+  return;
+}
+
+// -------------------------
+// compute kernel - CPU, one geometry and _nRhs strength vectors
+//   each source-target pair's kernel times dx, dy, dz goes into a tile once, and then every
+//   strength vector is dotted with that tile; strength k of source j is ss[k*sStride+j] and
+//   velocity k of target i goes to tu[k*tStride+i]
+
+// strength vectors that share one pass over the tile, all accumulators in registers
+#define CPU_RHS_BLK 4
+
+static inline void ngrav_3d_apply_tile4(const int32_t _n,
+    const FLOAT* const __restrict__ gx,
+    const FLOAT* const __restrict__ gy,
+    const FLOAT* const __restrict__ gz,
+    const FLOAT* const __restrict__ ss, const size_t sStride,
+    FLOAT* const __restrict__ totu,
+    FLOAT* const __restrict__ totv,
+    FLOAT* const __restrict__ totw) {
+
+  const FLOAT* const __restrict__ s0 = ss;
+  const FLOAT* const __restrict__ s1 = ss + sStride;
+  const FLOAT* const __restrict__ s2 = ss + 2*sStride;
+  const FLOAT* const __restrict__ s3 = ss + 3*sStride;
+  FLOAT u0 = 0.0f, v0 = 0.0f, w0 = 0.0f;
+  FLOAT u1 = 0.0f, v1 = 0.0f, w1 = 0.0f;
+  FLOAT u2 = 0.0f, v2 = 0.0f, w2 = 0.0f;
+  FLOAT u3 = 0.0f, v3 = 0.0f, w3 = 0.0f;
+
+  #pragma omp simd reduction(+:u0,v0,w0,u1,v1,w1,u2,v2,w2,u3,v3,w3)
+  for (int32_t j=0; j<_n; ++j) {
+    u0 += gx[j] * s0[j]; v0 += gy[j] * s0[j]; w0 += gz[j] * s0[j];
+    u1 += gx[j] * s1[j]; v1 += gy[j] * s1[j]; w1 += gz[j] * s1[j];
+    u2 += gx[j] * s2[j]; v2 += gy[j] * s2[j]; w2 += gz[j] * s2[j];
+    u3 += gx[j] * s3[j]; v3 += gy[j] * s3[j]; w3 += gz[j] * s3[j];
+  }
+
+  totu[0] += u0; totv[0] += v0; totw[0] += w0;
+  totu[CPU_TRG_BLK] += u1; totv[CPU_TRG_BLK] += v1; totw[CPU_TRG_BLK] += w1;
+  totu[2*CPU_TRG_BLK] += u2; totv[2*CPU_TRG_BLK] += v2; totw[2*CPU_TRG_BLK] += w2;
+  totu[3*CPU_TRG_BLK] += u3; totv[3*CPU_TRG_BLK] += v3; totw[3*CPU_TRG_BLK] += w3;
+}
+
+static inline void ngrav_3d_apply_tile1(const int32_t _n,
+    const FLOAT* const __restrict__ gx,
+    const FLOAT* const __restrict__ gy,
+    const FLOAT* const __restrict__ gz,
+    const FLOAT* const __restrict__ ss,
+    FLOAT* const __restrict__ totu,
+    FLOAT* const __restrict__ totv,
+    FLOAT* const __restrict__ totw) {
+
+  FLOAT u0 = 0.0f, v0 = 0.0f, w0 = 0.0f;
+
+  #pragma omp simd reduction(+:u0,v0,w0)
+  for (int32_t j=0; j<_n; ++j) {
+    u0 += gx[j] * ss[j]; v0 += gy[j] * ss[j]; w0 += gz[j] * ss[j];
+  }
+
+  totu[0] += u0; totv[0] += v0; totw[0] += w0;
+}
+
+static void ngrav_3d_multi_cpu(
+    const int32_t nSrc,
+    const FLOAT* const __restrict__ sx,
+    const FLOAT* const __restrict__ sy,
+    const FLOAT* const __restrict__ sz,
+    const FLOAT* const __restrict__ sr,
+    const int32_t nRhs,
+    const FLOAT* const __restrict__ ss,
+    const size_t sStride,
+    const int32_t nTrg,
+    const FLOAT* const __restrict__ tx,
+    const FLOAT* const __restrict__ ty,
+    const FLOAT* const __restrict__ tz,
+    const FLOAT* const __restrict__ tr,
+    FLOAT* const __restrict__ tu,
+    FLOAT* const __restrict__ tv,
+    FLOAT* const __restrict__ tw,
+    const size_t tStride,
+    FLOAT* const __restrict__ totu,
+    FLOAT* const __restrict__ totv,
+    FLOAT* const __restrict__ totw) {
+
+  assert(nTrg <= CPU_TRG_BLK && "Cpu target block too large");
+
+  // velocity accumulators for every target point and strength vector, in the caller's scratch
+  //   of nRhs*CPU_TRG_BLK each, so that a thread can reuse them across its target blocks
+  std::fill(totu, totu+(size_t)nRhs*CPU_TRG_BLK, 0.0f);
+  std::fill(totv, totv+(size_t)nRhs*CPU_TRG_BLK, 0.0f);
+  std::fill(totw, totw+(size_t)nRhs*CPU_TRG_BLK, 0.0f);
+
+  // the geometric tile for one target and one block of sources
+  alignas(64) FLOAT gx[CPU_SRC_BLK];
+  alignas(64) FLOAT gy[CPU_SRC_BLK];
+  alignas(64) FLOAT gz[CPU_SRC_BLK];
+
+  for (int32_t jbk=0; jbk<((nSrc+CPU_SRC_BLK-1)/CPU_SRC_BLK); ++jbk) {
+    const int32_t jstart = CPU_SRC_BLK*jbk;
+    const int32_t jn = std::min(nSrc, CPU_SRC_BLK*(jbk+1)) - jstart;
+
+    for (int32_t i=0; i<nTrg; ++i) {
+      const FLOAT tr2 = tr[i]*tr[i];
+
+      #pragma omp simd
+      for (int32_t j=0; j<jn; ++j) {
+        const FLOAT dx = sx[jstart+j] - tx[i];
+        const FLOAT dy = sy[jstart+j] - ty[i];
+        const FLOAT dz = sz[jstart+j] - tz[i];
+        const FLOAT distsq = dx*dx + dy*dy + dz*dz + sr[jstart+j]*sr[jstart+j] + tr2;
+        const FLOAT factor = 1.0f / (distsq * std::sqrt(distsq));
+        gx[j] = dx * factor;
+        gy[j] = dy * factor;
+        gz[j] = dz * factor;
+      }
+
+      int32_t k = 0;
+      for (; k+CPU_RHS_BLK<=nRhs; k+=CPU_RHS_BLK) {
+        ngrav_3d_apply_tile4(jn, gx, gy, gz, ss+k*sStride+jstart, sStride,
+                             &totu[k*CPU_TRG_BLK+i], &totv[k*CPU_TRG_BLK+i], &totw[k*CPU_TRG_BLK+i]);
+      }
+      for (; k<nRhs; ++k) {
+        ngrav_3d_apply_tile1(jn, gx, gy, gz, ss+k*sStride+jstart,
+                             &totu[k*CPU_TRG_BLK+i], &totv[k*CPU_TRG_BLK+i], &totw[k*CPU_TRG_BLK+i]);
+      }
+    }
+  }
+
+  // save into main arrays
+  for (int32_t k=0; k<nRhs; ++k) {
+    for (int32_t i=0; i<nTrg; ++i) {
+      tu[k*tStride+i] = totu[k*CPU_TRG_BLK+i] / (4.0f*3.1415926536f);
+      tv[k*tStride+i] = totv[k*CPU_TRG_BLK+i] / (4.0f*3.1415926536f);
+      tw[k*tStride+i] = totw[k*CPU_TRG_BLK+i] / (4.0f*3.1415926536f);
+    }
+  }
+
+  return;
+}
+
+// not really alignment, just minimum block sizes
+static int32_t buffer(const int32_t _n, const int32_t _align) {
+  return _align*((_n+_align-1)/_align);
+}
+
+// -------------------------
+// monopole treecode - CPU, for NGRAV_AUTO solvers allowed to trade accuracy for time
+//   (the tree of ngHipTimestepping's -a option, built afresh for each evaluation)
+
+// tree leaves hold at most this many particles
+#define TREE_LEAF CPU_TRG_BLK
+
+// a binary tree over sources in Morton order: each node is a contiguous range, halved until it
+//   holds at most TREE_LEAF, with its box, mean radius and two monopoles, one for the positive
+//   strengths and one for the negative, each at its own strength-weighted center; a single
+//   monopole of mixed signs would have no center that cancels its dipole, and its error would
+//   fall only with the first power of the opening angle
+struct TreeNode {
+  int32_t start, end, child;
+  FLOAT box[6];
+  FLOAT mx[2], my[2], mz[2], ms[2];
+  FLOAT mr;
+};
+
+static void block_box(const int32_t _n, const FLOAT* _x, const FLOAT* _y, const FLOAT* _z, FLOAT _box[6]) {
+  _box[0] = _box[3] = _x[0];
+  _box[1] = _box[4] = _y[0];
+  _box[2] = _box[5] = _z[0];
+  for (int32_t i=1; i<_n; ++i) {
+    _box[0] = std::min(_box[0], _x[i]);  _box[3] = std::max(_box[3], _x[i]);
+    _box[1] = std::min(_box[1], _y[i]);  _box[4] = std::max(_box[4], _y[i]);
+    _box[2] = std::min(_box[2], _z[i]);  _box[5] = std::max(_box[5], _z[i]);
+  }
+}
+
+static FLOAT box_gap(const FLOAT _a[6], const FLOAT _b[6]) {
+  FLOAT dsq = 0.0;
+  for (int32_t d=0; d<3; ++d) {
+    const FLOAT gap = std::max((FLOAT)0.0, std::max(_a[d]-_b[d+3], _b[d]-_a[d+3]));
+    dsq += gap*gap;
+  }
+  return std::sqrt(dsq);
+}
+
+static FLOAT box_diam(const FLOAT _a[6]) {
+  return std::sqrt(std::pow(_a[3]-_a[0],2) + std::pow(_a[4]-_a[1],2) + std::pow(_a[5]-_a[2],2));
+}
+
+// spread the low 10 bits of _v to every third bit
+static inline uint32_t spread3(uint32_t _v) {
+  _v &= 0x3ff;
+  _v = (_v | _v << 16) & 0x30000ff;
+  _v = (_v | _v << 8)  & 0x300f00f;
+  _v = (_v | _v << 4)  & 0x30c30c3;
+  _v = (_v | _v << 2)  & 0x9249249;
+  return _v;
+}
+
+// the order of the points along a Morton curve through their bounding box
+static std::vector<int32_t> morton_order(const int32_t _n, const FLOAT* _x, const FLOAT* _y, const FLOAT* _z) {
+  FLOAT box[6];
+  block_box(_n, _x, _y, _z, box);
+  const double scale = 1023.0 / std::max({(double)box[3]-box[0], (double)box[4]-box[1], (double)box[5]-box[2], 1.e-30});
+  std::vector<uint64_t> keys(_n);
+  for (int32_t i=0; i<_n; ++i) {
+    const uint32_t ix = (uint32_t)((_x[i]-box[0])*scale);
+    const uint32_t iy = (uint32_t)((_y[i]-box[1])*scale);
+    const uint32_t iz = (uint32_t)((_z[i]-box[2])*scale);
+    keys[i] = (uint64_t)(spread3(ix) | spread3(iy) << 1 | spread3(iz) << 2) << 32 | (uint64_t)i;
+  }
+  std::sort(keys.begin(), keys.end());
+  std::vector<int32_t> order(_n);
+  for (int32_t i=0; i<_n; ++i) order[i] = (int32_t)(keys[i] & 0xffffffff);
+  return order;
+}
+
+static void tree_split(std::vector<TreeNode>& _nodes, std::vector<std::vector<int32_t>>& _levels,
+                       const int32_t _inode, const int32_t _depth) {
+  if ((int32_t)_levels.size() <= _depth) _levels.resize(_depth+1);
+  _levels[_depth].push_back(_inode);
+  const int32_t start = _nodes[_inode].start;
+  const int32_t end = _nodes[_inode].end;
+  if (end-start <= TREE_LEAF) return;
+  const int32_t child = _nodes.size();
+  const int32_t mid = start + (end-start)/2;
+  _nodes[_inode].child = child;
+  _nodes.push_back(TreeNode{start, mid, -1});
+  _nodes.push_back(TreeNode{mid, end, -1});
+  tree_split(_nodes, _levels, child, _depth+1);
+  tree_split(_nodes, _levels, child+1, _depth+1);
+}
+
+// boxes and monopoles, bottom up, one level at a time
+static void tree_fit(std::vector<TreeNode>& _nodes, const std::vector<std::vector<int32_t>>& _levels,
+                     const FLOAT* _x, const FLOAT* _y, const FLOAT* _z, const FLOAT* _s, const FLOAT* _r,
+                     const bool _parallel) {
+  for (int32_t l=_levels.size()-1; l>=0; --l) {
+    #pragma omp parallel for schedule(guided) if(_parallel)
+    for (size_t k=0; k<_levels[l].size(); ++k) {
+      TreeNode& nd = _nodes[_levels[l][k]];
+      double sx[2] = {0.0, 0.0}, sy[2] = {0.0, 0.0}, sz[2] = {0.0, 0.0}, ss[2] = {0.0, 0.0};
+      double sr = 0.0;
+      if (nd.child < 0) {
+        block_box(nd.end-nd.start, &_x[nd.start], &_y[nd.start], &_z[nd.start], nd.box);
+        for (int32_t i=nd.start; i<nd.end; ++i) {
+          const int32_t g = (_s[i] < 0.0) ? 1 : 0;
+          sx[g] += _s[i]*_x[i];  sy[g] += _s[i]*_y[i];  sz[g] += _s[i]*_z[i];
+          ss[g] += _s[i];  sr += _r[i];
+        }
+      } else {
+        const TreeNode& a = _nodes[nd.child];
+        const TreeNode& b = _nodes[nd.child+1];
+        for (int32_t d=0; d<3; ++d) {
+          nd.box[d] = std::min(a.box[d], b.box[d]);
+          nd.box[d+3] = std::max(a.box[d+3], b.box[d+3]);
+        }
+        for (const TreeNode* c : {&a, &b}) {
+          for (int32_t g=0; g<2; ++g) {
+            sx[g] += c->ms[g]*c->mx[g];  sy[g] += c->ms[g]*c->my[g];  sz[g] += c->ms[g]*c->mz[g];
+            ss[g] += c->ms[g];
+          }
+          sr += c->mr*(c->end-c->start);
+        }
+      }
+      for (int32_t g=0; g<2; ++g) {
+        const bool some = (ss[g] != 0.0);
+        nd.mx[g] = some ? sx[g]/ss[g] : 0.5*(nd.box[0]+nd.box[3]);
+        nd.my[g] = some ? sy[g]/ss[g] : 0.5*(nd.box[1]+nd.box[4]);
+        nd.mz[g] = some ? sz[g]/ss[g] : 0.5*(nd.box[2]+nd.box[5]);
+        nd.ms[g] = ss[g];
+      }
+      nd.mr = sr / (nd.end-nd.start);
+    }
+  }
+}
+
+// velocities at _nt targets from _ns sources with opening angle _theta: targets are taken in
+//   Morton order a block at a time, each block walks the tree, and near leaves (merged into
+//   ranges) are summed directly and far nodes through their one or two monopoles; returns the
+//   number of interactions, and with _count only counts them and writes nothing
+static double tree_sum(const int32_t _ns, const FLOAT* _sx, const FLOAT* _sy, const FLOAT* _sz,
+                       const FLOAT* _ss, const FLOAT* _sr,
+                       const int32_t _nt, const FLOAT* _tx, const FLOAT* _ty, const FLOAT* _tz, const FLOAT* _tr,
+                       const FLOAT _theta, const bool _count, FLOAT* _u, FLOAT* _v, FLOAT* _w) {
+
+  const bool parallel = ((double)_ns*TREE_LEAF + (double)_nt*TREE_LEAF >= SERIAL_WORK);
+
+  // sources in Morton order, and the tree over them
+  const std::vector<int32_t> sorder = morton_order(_ns, _sx, _sy, _sz);
+  std::vector<FLOAT> px(_ns), py(_ns), pz(_ns), ps(_ns), pr(_ns);
+  for (int32_t i=0; i<_ns; ++i) {
+    const int32_t j = sorder[i];
+    px[i] = _sx[j];  py[i] = _sy[j];  pz[i] = _sz[j];  ps[i] = _ss[j];  pr[i] = _sr[j];
+  }
+  std::vector<TreeNode> nodes(1, TreeNode{0, _ns, -1});
+  std::vector<std::vector<int32_t>> levels;
+  tree_split(nodes, levels, 0, 0);
+  tree_fit(nodes, levels, px.data(), py.data(), pz.data(), ps.data(), pr.data(), parallel);
+
+  // targets in Morton order too, unless they are the sources
+  const bool same = (_tx == _sx and _nt == _ns);
+  const std::vector<int32_t> torder = same ? sorder : morton_order(_nt, _tx, _ty, _tz);
+  std::vector<FLOAT> qx, qy, qz, qr;
+  if (not same) {
+    qx.resize(_nt);  qy.resize(_nt);  qz.resize(_nt);  qr.resize(_nt);
+    for (int32_t i=0; i<_nt; ++i) {
+      const int32_t j = torder[i];
+      qx[i] = _tx[j];  qy[i] = _ty[j];  qz[i] = _tz[j];  qr[i] = _tr[j];
+    }
+  }
+  const FLOAT* tx = same ? px.data() : qx.data();
+  const FLOAT* ty = same ? py.data() : qy.data();
+  const FLOAT* tz = same ? pz.data() : qz.data();
+  const FLOAT* tr = same ? pr.data() : qr.data();
+
+  double interact = 0.0;
+  const int32_t ntblocks = (_nt+CPU_TRG_BLK-1)/CPU_TRG_BLK;
+  #pragma omp parallel for schedule(guided) reduction(+:interact) if(parallel)
+  for (int32_t ibk=0; ibk<ntblocks; ++ibk) {
+    const int32_t istart = CPU_TRG_BLK*ibk;
+    const int32_t nb = std::min(_nt, CPU_TRG_BLK*(ibk+1)) - istart;
+    FLOAT box[6];
+    block_box(nb, tx+istart, ty+istart, tz+istart, box);
+
+    // walk the tree, left child first so that near ranges come out in order
+    std::vector<FLOAT> fx, fy, fz, fs, fr;
+    std::vector<int32_t> near, stack(1, 0);
+    while (not stack.empty()) {
+      const TreeNode& nd = nodes[stack.back()];
+      stack.pop_back();
+      if (box_diam(nd.box) < _theta*box_gap(box, nd.box)) {
+        for (int32_t g=0; g<2; ++g) {
+          if (nd.ms[g] == 0.0) continue;
+          fx.push_back(nd.mx[g]);  fy.push_back(nd.my[g]);  fz.push_back(nd.mz[g]);
+          fs.push_back(nd.ms[g]);  fr.push_back(nd.mr);
+        }
+      } else if (nd.child < 0) {
+        if (not near.empty() and near.back() == nd.start) near.back() = nd.end;
+        else { near.push_back(nd.start); near.push_back(nd.end); }
+      } else {
+        stack.push_back(nd.child+1);
+        stack.push_back(nd.child);
+      }
+    }
+    interact += (double)nb*fx.size();
+    for (size_t k=0; k<near.size(); k+=2) interact += (double)nb*(near[k+1]-near[k]);
+    if (_count) continue;
+
+    FLOAT bu[CPU_TRG_BLK], bv[CPU_TRG_BLK], bw[CPU_TRG_BLK];
+    FLOAT su[CPU_TRG_BLK], sv[CPU_TRG_BLK], sw[CPU_TRG_BLK];
+    ngrav_3d_nograds_cpu(fx.size(), fx.data(), fy.data(), fz.data(), fs.data(), fr.data(),
+                         nb, tx+istart, ty+istart, tz+istart, tr+istart, su, sv, sw);
+    for (size_t k=0; k<near.size(); k+=2) {
+      const int32_t jstart = near[k];
+      const int32_t jend = near[k+1];
+      ngrav_3d_nograds_cpu(jend-jstart, &px[jstart], &py[jstart], &pz[jstart], &ps[jstart], &pr[jstart],
+                           nb, tx+istart, ty+istart, tz+istart, tr+istart, bu, bv, bw);
+      for (int32_t i=0; i<nb; ++i) {
+        su[i] += bu[i];
+        sv[i] += bv[i];
+        sw[i] += bw[i];
+      }
+    }
+    for (int32_t i=0; i<nb; ++i) {
+      const int32_t j = torder[istart+i];
+      _u[j] = su[i];
+      _v[j] = sv[i];
+      _w[j] = sw[i];
+    }
+  }
+  return interact;
+}
+
+// -------------------------
+// the solver state
+struct ngrav_solver {
+  int32_t capacity = 0;
+  int32_t where = NGRAV_CPU;
+
+  // current counts; no separate targets means the sources are the targets
+  int32_t nsrc = 0;
+  int32_t ntarg = 0;
+  bool separate = false;
+
+  // host copies, sized for the largest padding we will ever use
+  std::vector<FLOAT> sx, sy, sz, ss, sr;
+  std::vector<FLOAT> tx, ty, tz, tr;
+
+  // cpu decomposition for the current counts, and the partial sums it needs
+  int32_t nthreads = 1;
+  int32_t nsplit = 1;
+  std::vector<FLOAT> pu, pv, pw;
+
+  // device copies and what needs to be sent before the next evaluation
+  FLOAT *dsx = nullptr, *dsy = nullptr, *dsz = nullptr, *dss = nullptr, *dsr = nullptr;
+  FLOAT *dtx = nullptr, *dty = nullptr, *dtz = nullptr, *dtr = nullptr;
+  FLOAT *dtu = nullptr, *dtv = nullptr, *dtw = nullptr;
+  hipStream_t stream;
+  int32_t nsrcblocks = 1;
+  int32_t nsrcpad = 0;
+  int32_t ntargpad = 0;
+  bool src_dirty = true;
+  bool trg_dirty = true;
+
+  // incremental mode: the last velocities, the sources changed since (with their old values,
+  //   strengths negated so that adding their influence removes it), and when to refresh
+  int32_t refresh = 0;
+  int32_t since_full = 0;
+  bool cache_valid = false;
+  std::vector<FLOAT> cu, cv, cw;
+  std::vector<int32_t> changed;
+  std::vector<char> was_changed;
+  std::vector<FLOAT> ox, oy, oz, os, orad;
+
+  // NGRAV_AUTO: whether the device copies exist, the error allowed, any forced method, what the
+  //   last evaluation used and was predicted to take, the treecode's last measured over
+  //   predicted interactions, and the largest of its sampled over calibrated errors, decaying
+  //   with each new set of sources
+  bool has_gpu = false;
+  FLOAT tol = 0.0;
+  int32_t method = NGRAV_METHOD_AUTO;
+  int32_t last_method = NGRAV_METHOD_SERIAL;
+  double last_predicted = 0.0;
+  double tree_ratio = 1.0;
+  double tree_error = 1.0;
+};
+
+// the number of targets, whichever set they are
+static inline int32_t target_count(const ngrav_solver* _s) {
+  return _s->separate ? _s->ntarg : _s->nsrc;
+}
+
+// forget the saved velocities, after anything other than a change of a few sources
+static void invalidate(ngrav_solver* _s) {
+  _s->cache_valid = false;
+  for (const int32_t j : _s->changed) _s->was_changed[j] = 0;
+  _s->changed.clear();
+  _s->ox.clear(); _s->oy.clear(); _s->oz.clear(); _s->os.clear(); _s->orad.clear();
+}
+
+// bring the saved velocities up to date after ngrav_change_sources, on the CPU
+static void update_incremental(ngrav_solver* _s) {
+  const int32_t nt = target_count(_s);
+  const int32_t k = _s->changed.size();
+  const FLOAT* tx = _s->separate ? _s->tx.data() : _s->sx.data();
+  const FLOAT* ty = _s->separate ? _s->ty.data() : _s->sy.data();
+  const FLOAT* tz = _s->separate ? _s->tz.data() : _s->sz.data();
+  const FLOAT* tr = _s->separate ? _s->tr.data() : _s->sr.data();
+
+  // the old sources with negated strengths, then the new ones
+  std::vector<FLOAT> dx(_s->ox), dy(_s->oy), dz(_s->oz), ds(_s->os), dr(_s->orad);
+  for (const int32_t j : _s->changed) {
+    dx.push_back(_s->sx[j]);
+    dy.push_back(_s->sy[j]);
+    dz.push_back(_s->sz[j]);
+    ds.push_back(_s->ss[j]);
+    dr.push_back(_s->sr[j]);
+  }
+  const int32_t nd = dx.size();
+
+  // add their difference to every target
+  const int32_t ntblocks = (nt+CPU_TRG_BLK-1)/CPU_TRG_BLK;
+  #pragma omp parallel for schedule(guided) if((double)nd*nt >= SERIAL_WORK)
+  for (int32_t ibk=0; ibk<ntblocks; ++ibk) {
+    const int32_t istart = CPU_TRG_BLK*ibk;
+    const int32_t iend = std::min(nt, CPU_TRG_BLK*(ibk+1));
+    FLOAT du[CPU_TRG_BLK], dv[CPU_TRG_BLK], dw[CPU_TRG_BLK];
+    ngrav_3d_nograds_cpu(nd, dx.data(), dy.data(), dz.data(), ds.data(), dr.data(),
+                         iend-istart, tx+istart, ty+istart, tz+istart, tr+istart, du, dv, dw);
+    for (int32_t i=istart; i<iend; ++i) {
+      _s->cu[i] += du[i-istart];
+      _s->cv[i] += dv[i-istart];
+      _s->cw[i] += dw[i-istart];
+    }
+  }
+
+  // when the sources are the targets, the moved ones see everything anew
+  if (not _s->separate) {
+    std::vector<FLOAT> gx(k), gy(k), gz(k), gr(k);
+    for (int32_t c=0; c<k; ++c) {
+      const int32_t j = _s->changed[c];
+      gx[c] = _s->sx[j]; gy[c] = _s->sy[j]; gz[c] = _s->sz[j]; gr[c] = _s->sr[j];
+    }
+    const int32_t ngblocks = (k+CPU_TRG_BLK-1)/CPU_TRG_BLK;
+    #pragma omp parallel for schedule(guided) if((double)k*_s->nsrc >= SERIAL_WORK)
+    for (int32_t ibk=0; ibk<ngblocks; ++ibk) {
+      const int32_t istart = CPU_TRG_BLK*ibk;
+      const int32_t iend = std::min(k, CPU_TRG_BLK*(ibk+1));
+      FLOAT nu[CPU_TRG_BLK], nv[CPU_TRG_BLK], nw[CPU_TRG_BLK];
+      ngrav_3d_nograds_cpu(_s->nsrc, _s->sx.data(), _s->sy.data(), _s->sz.data(), _s->ss.data(), _s->sr.data(),
+                           iend-istart, &gx[istart], &gy[istart], &gz[istart], &gr[istart], nu, nv, nw);
+      for (int32_t c=istart; c<iend; ++c) {
+        const int32_t i = _s->changed[c];
+        _s->cu[i] = nu[c-istart];
+        _s->cv[i] = nv[c-istart];
+        _s->cw[i] = nw[c-istart];
+      }
+    }
+  }
+
+  // the saved velocities now match the current sources
+  invalidate(_s);
+  _s->cache_valid = true;
+}
+
+// choose the work decomposition for the current counts (see ngHip15)
+static void retune(ngrav_solver* _s) {
+  const int32_t nt = target_count(_s);
+  const int32_t ntblocks = std::max(1, (nt+CPU_TRG_BLK-1)/CPU_TRG_BLK);
+
+  _s->nsplit = 1;
+  if (ntblocks < 4*_s->nthreads) {
+    _s->nsplit = std::min((4*_s->nthreads+ntblocks-1)/ntblocks, std::max(1, _s->nsrc/(4*CPU_SRC_BLK)));
+  }
+  const size_t npartial = (size_t)_s->nsplit*nt;
+  if (_s->nsplit > 1 and _s->pu.size() < npartial) {
+    _s->pu.resize(npartial);
+    _s->pv.resize(npartial);
+    _s->pw.resize(npartial);
+  }
+
+  const int32_t ntrgblocks = std::max(1, buffer(nt, THREADS_PER_BLOCK)/THREADS_PER_BLOCK);
+  const int32_t maxsrcblocks = std::max(1, buffer(_s->nsrc, THREADS_PER_BLOCK)/THREADS_PER_BLOCK);
+  _s->nsrcblocks = std::max(1, std::min({GPU_MAX_SRC_BLOCKS, maxsrcblocks, (GPU_MIN_BLOCKS+ntrgblocks-1)/ntrgblocks}));
+  _s->nsrcpad = buffer(_s->nsrc, THREADS_PER_BLOCK*_s->nsrcblocks);
+  _s->ntargpad = ntrgblocks*THREADS_PER_BLOCK;
+
+  // the device reads the source padding, so it must hold harmless values
+  std::fill(_s->sx.begin()+_s->nsrc, _s->sx.begin()+_s->nsrcpad, 0.0);
+  std::fill(_s->sy.begin()+_s->nsrc, _s->sy.begin()+_s->nsrcpad, 0.0);
+  std::fill(_s->sz.begin()+_s->nsrc, _s->sz.begin()+_s->nsrcpad, 0.0);
+  std::fill(_s->ss.begin()+_s->nsrc, _s->ss.begin()+_s->nsrcpad, 0.0);
+  std::fill(_s->sr.begin()+_s->nsrc, _s->sr.begin()+_s->nsrcpad, 1.0);
+  _s->src_dirty = true;
+}
+
+// the direct sum on the CPU, on the calling thread or the team
+static void evaluate_cpu(ngrav_solver* _s, const bool _parallel, float* _u, float* _v, float* _w) {
+  const int32_t nsrc = _s->nsrc;
+  const int32_t nt = target_count(_s);
+  const FLOAT* tx = _s->separate ? _s->tx.data() : _s->sx.data();
+  const FLOAT* ty = _s->separate ? _s->ty.data() : _s->sy.data();
+  const FLOAT* tz = _s->separate ? _s->tz.data() : _s->sz.data();
+  const FLOAT* tr = _s->separate ? _s->tr.data() : _s->sr.data();
+  const int32_t ntblocks = (nt+CPU_TRG_BLK-1)/CPU_TRG_BLK;
+  const int32_t nsplit = _parallel ? _s->nsplit : 1;
+  FLOAT* const ou = (nsplit > 1) ? _s->pu.data() : _u;
+  FLOAT* const ov = (nsplit > 1) ? _s->pv.data() : _v;
+  FLOAT* const ow = (nsplit > 1) ? _s->pw.data() : _w;
+  const FLOAT* sx = _s->sx.data();
+  const FLOAT* sy = _s->sy.data();
+  const FLOAT* sz = _s->sz.data();
+  const FLOAT* ss = _s->ss.data();
+  const FLOAT* sr = _s->sr.data();
+
+  #pragma omp parallel for collapse(2) schedule(guided) if(_parallel)
+  for (int32_t isp=0; isp<nsplit; ++isp) {
+    for (int32_t ibk=0; ibk<ntblocks; ++ibk) {
+      const int32_t jstart = ((int64_t)nsrc*isp)/nsplit;
+      const int32_t jend = ((int64_t)nsrc*(isp+1))/nsplit;
+      const int32_t istart = CPU_TRG_BLK*ibk;
+      const int32_t iend = std::min(nt, CPU_TRG_BLK*(ibk+1));
+      const size_t o = (size_t)isp*nt + istart;
+      ngrav_3d_nograds_cpu(jend-jstart, sx+jstart, sy+jstart, sz+jstart, ss+jstart, sr+jstart,
+                           iend-istart, tx+istart, ty+istart, tz+istart, tr+istart,
+                           ou+o, ov+o, ow+o);
+    }
+  }
+
+  // add up the partial sums
+  if (nsplit > 1) {
+    #pragma omp parallel for
+    for (int32_t i=0; i<nt; ++i) {
+      FLOAT su = 0.0, sv = 0.0, sw = 0.0;
+      for (int32_t isp=0; isp<nsplit; ++isp) {
+        su += _s->pu[(size_t)isp*nt+i];
+        sv += _s->pv[(size_t)isp*nt+i];
+        sw += _s->pw[(size_t)isp*nt+i];
+      }
+      _u[i] = su;
+      _v[i] = sv;
+      _w[i] = sw;
+    }
+  }
+}
+
+// the direct sum on the GPU, sending only what changed, including the zeroed source padding
+static int32_t evaluate_gpu(ngrav_solver* _s, float* _u, float* _v, float* _w) {
+  const int32_t nt = target_count(_s);
+  const FLOAT* tx = _s->separate ? _s->tx.data() : _s->sx.data();
+  const FLOAT* ty = _s->separate ? _s->ty.data() : _s->sy.data();
+  const FLOAT* tz = _s->separate ? _s->tz.data() : _s->sz.data();
+  const FLOAT* tr = _s->separate ? _s->tr.data() : _s->sr.data();
+  const size_t srcsize = _s->nsrcpad*sizeof(FLOAT);
+  const size_t trgsize = _s->ntargpad*sizeof(FLOAT);
+  hipStream_t st = _s->stream;
+  if (_s->src_dirty) {
+    hipMemcpyAsync (_s->dsx, _s->sx.data(), srcsize, hipMemcpyHostToDevice, st);
+    hipMemcpyAsync (_s->dsy, _s->sy.data(), srcsize, hipMemcpyHostToDevice, st);
+    hipMemcpyAsync (_s->dsz, _s->sz.data(), srcsize, hipMemcpyHostToDevice, st);
+    hipMemcpyAsync (_s->dss, _s->ss.data(), srcsize, hipMemcpyHostToDevice, st);
+    hipMemcpyAsync (_s->dsr, _s->sr.data(), srcsize, hipMemcpyHostToDevice, st);
+    _s->src_dirty = false;
+  }
+  if (_s->trg_dirty) {
+    hipMemcpyAsync (_s->dtx, tx, trgsize, hipMemcpyHostToDevice, st);
+    hipMemcpyAsync (_s->dty, ty, trgsize, hipMemcpyHostToDevice, st);
+    hipMemcpyAsync (_s->dtz, tz, trgsize, hipMemcpyHostToDevice, st);
+    hipMemcpyAsync (_s->dtr, tr, trgsize, hipMemcpyHostToDevice, st);
+    _s->trg_dirty = false;
+  }
+  hipMemsetAsync (_s->dtu, 0, trgsize, st);
+  hipMemsetAsync (_s->dtv, 0, trgsize, st);
+  hipMemsetAsync (_s->dtw, 0, trgsize, st);
+
+  const dim3 blocksz(THREADS_PER_BLOCK, 1, 1);
+  const dim3 gridsz(_s->ntargpad/THREADS_PER_BLOCK, _s->nsrcblocks, 1);
+  hipLaunchKernelGGL(ngrav_3d_nograds_gpu, dim3(gridsz), dim3(blocksz), 0, st,
+                     _s->nsrcpad, _s->dsx,_s->dsy,_s->dsz,_s->dss,_s->dsr,
+                     0,_s->dtx,_s->dty,_s->dtz,_s->dtr,_s->dtu,_s->dtv,_s->dtw);
+
+  hipMemcpyAsync (_u, _s->dtu, nt*sizeof(FLOAT), hipMemcpyDeviceToHost, st);
+  hipMemcpyAsync (_v, _s->dtv, nt*sizeof(FLOAT), hipMemcpyDeviceToHost, st);
+  hipMemcpyAsync (_w, _s->dtw, nt*sizeof(FLOAT), hipMemcpyDeviceToHost, st);
+  if (hipStreamSynchronize(st) != hipSuccess) return NGRAV_ERR_DEVICE;
+  return NGRAV_OK;
+}
+
+// device copies for up to _srcmax sources and _trgmax targets
+static bool allocate_device(ngrav_solver* _s, const size_t _srcmax, const size_t _trgmax) {
+  _s->has_gpu = true;
+  bool ok = (hipStreamCreate(&_s->stream) == hipSuccess);
+  ok = ok and hipMalloc(&_s->dsx, _srcmax*sizeof(FLOAT)) == hipSuccess;
+  ok = ok and hipMalloc(&_s->dsy, _srcmax*sizeof(FLOAT)) == hipSuccess;
+  ok = ok and hipMalloc(&_s->dsz, _srcmax*sizeof(FLOAT)) == hipSuccess;
+  ok = ok and hipMalloc(&_s->dss, _srcmax*sizeof(FLOAT)) == hipSuccess;
+  ok = ok and hipMalloc(&_s->dsr, _srcmax*sizeof(FLOAT)) == hipSuccess;
+  ok = ok and hipMalloc(&_s->dtx, _trgmax*sizeof(FLOAT)) == hipSuccess;
+  ok = ok and hipMalloc(&_s->dty, _trgmax*sizeof(FLOAT)) == hipSuccess;
+  ok = ok and hipMalloc(&_s->dtz, _trgmax*sizeof(FLOAT)) == hipSuccess;
+  ok = ok and hipMalloc(&_s->dtr, _trgmax*sizeof(FLOAT)) == hipSuccess;
+  ok = ok and hipMalloc(&_s->dtu, _trgmax*sizeof(FLOAT)) == hipSuccess;
+  ok = ok and hipMalloc(&_s->dtv, _trgmax*sizeof(FLOAT)) == hipSuccess;
+  ok = ok and hipMalloc(&_s->dtw, _trgmax*sizeof(FLOAT)) == hipSuccess;
+  return ok;
+}
+
+static void free_device(ngrav_solver* _s) {
+  if (not _s->has_gpu) return;
+  for (FLOAT** p : {&_s->dsx, &_s->dsy, &_s->dsz, &_s->dss, &_s->dsr,
+                    &_s->dtx, &_s->dty, &_s->dtz, &_s->dtr, &_s->dtu, &_s->dtv, &_s->dtw}) {
+    if (*p) hipFree(*p);
+    *p = nullptr;
+  }
+  hipStreamDestroy(_s->stream);
+  _s->has_gpu = false;
+}
+
+// -------------------------
+// the cost model behind NGRAV_AUTO, with coefficients measured once per host: a direct sum costs
+//   a fixed time per call plus a time per interaction (and per byte sent, on the GPU), and the
+//   treecode a time per particle to sort and build plus a time per interaction; the treecode's
+//   interaction counts for each opening angle are measured on a uniform random cube, and fit per
+//   target to a power of the number of leaves, which at these sizes grows faster than the
+//   eventual logarithm; its error is the worst of a uniform cube with positive strengths, one
+//   with strengths of both signs, and a Plummer cluster with both signs
+
+#define TREE_NTHETA 7
+// an automatically chosen treecode checks its error on this many targets
+#define TREE_CHECK 128
+static const FLOAT tree_theta[TREE_NTHETA] = {0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8};
+
+struct ngrav_costs {
+  int32_t nthreads = 1;			// the team size the times were measured with
+  double serial = 0.0;			// seconds per interaction on one thread
+  double team0 = 0.0, team = 0.0;	// seconds to wake the team, and per interaction on it
+  double gpu0 = -1.0, gpubyte = 0.0, gpu = 0.0;	// per call (negative for no GPU), per byte sent, per interaction
+  double build = 0.0, treeint = 0.0;	// treecode seconds per particle, and per interaction
+  double error[TREE_NTHETA];		// relative rms error
+  double scale[TREE_NTHETA], power[TREE_NTHETA];	// interactions per target = scale * leaves^power
+};
+static ngrav_costs costs;
+static bool costs_ready = false;
+static std::mutex costs_mutex;
+
+// the file the coefficients live in
+static std::string costs_file(const char* _file) {
+  if (_file) return _file;
+  const char* env = getenv("NGRAV_COSTS");
+  if (env and env[0]) return env;
+  char host[256] = "localhost";
+  gethostname(host, sizeof(host)-1);
+  const char* home = getenv("HOME");
+  return std::string(home ? home : ".") + "/.ngrav_costs_" + host;
+}
+
+static bool save_costs(const std::string& _file, const ngrav_costs& _c) {
+  FILE* fp = fopen(_file.c_str(), "w");
+  if (not fp) return false;
+  fprintf(fp, "# ngrav cost model, from ngrav_calibrate\n");
+  fprintf(fp, "nthreads %d\n", _c.nthreads);
+  fprintf(fp, "serial %.9g\n", _c.serial);
+  fprintf(fp, "team0 %.9g\nteam %.9g\n", _c.team0, _c.team);
+  fprintf(fp, "gpu0 %.9g\ngpubyte %.9g\ngpu %.9g\n", _c.gpu0, _c.gpubyte, _c.gpu);
+  fprintf(fp, "build %.9g\ntreeint %.9g\n", _c.build, _c.treeint);
+  fprintf(fp, "# theta, relative rms error, and interactions per target as scale * leaves^power\n");
+  for (int32_t t=0; t<TREE_NTHETA; ++t) {
+    fprintf(fp, "tree %g %.9g %.9g %.9g\n", tree_theta[t], _c.error[t], _c.scale[t], _c.power[t]);
+  }
+  return (fclose(fp) == 0);
+}
+
+// true only if every coefficient was there
+static bool load_costs(const std::string& _file, ngrav_costs& _c) {
+  FILE* fp = fopen(_file.c_str(), "r");
+  if (not fp) return false;
+  int32_t found = 0;
+  char line[256], key[64];
+  double a, b, c, d;
+  while (fgets(line, sizeof(line), fp)) {
+    if (line[0] == '#') continue;
+    if (sscanf(line, "tree %lf %lf %lf %lf", &a, &b, &c, &d) == 4) {
+      for (int32_t t=0; t<TREE_NTHETA; ++t) {
+        if (std::abs(a-tree_theta[t]) < 1.e-3) {
+          _c.error[t] = b;  _c.scale[t] = c;  _c.power[t] = d;
+          found++;
+        }
+      }
+    } else if (sscanf(line, "%63s %lf", key, &a) == 2) {
+      found++;
+      if (strcmp(key, "nthreads") == 0) _c.nthreads = std::max(1, (int32_t)a);
+      else if (strcmp(key, "serial") == 0) _c.serial = a;
+      else if (strcmp(key, "team0") == 0) _c.team0 = a;
+      else if (strcmp(key, "team") == 0) _c.team = a;
+      else if (strcmp(key, "gpu0") == 0) _c.gpu0 = a;
+      else if (strcmp(key, "gpubyte") == 0) _c.gpubyte = a;
+      else if (strcmp(key, "gpu") == 0) _c.gpu = a;
+      else if (strcmp(key, "build") == 0) _c.build = a;
+      else if (strcmp(key, "treeint") == 0) _c.treeint = a;
+      else found--;
+    }
+  }
+  fclose(fp);
+  return (found == 9 + TREE_NTHETA);
+}
+
+// the direct sum over target blocks, for calibration
+static void direct_sum(const int32_t _ns, const FLOAT* _sx, const FLOAT* _sy, const FLOAT* _sz,
+                       const FLOAT* _ss, const FLOAT* _sr,
+                       const int32_t _nt, const FLOAT* _tx, const FLOAT* _ty, const FLOAT* _tz, const FLOAT* _tr,
+                       FLOAT* _u, FLOAT* _v, FLOAT* _w, const bool _parallel) {
+  const int32_t ntblocks = (_nt+CPU_TRG_BLK-1)/CPU_TRG_BLK;
+  #pragma omp parallel for schedule(guided) if(_parallel)
+  for (int32_t ibk=0; ibk<ntblocks; ++ibk) {
+    const int32_t istart = CPU_TRG_BLK*ibk;
+    const int32_t iend = std::min(_nt, CPU_TRG_BLK*(ibk+1));
+    ngrav_3d_nograds_cpu(_ns, _sx, _sy, _sz, _ss, _sr,
+                         iend-istart, _tx+istart, _ty+istart, _tz+istart, _tr+istart,
+                         _u+istart, _v+istart, _w+istart);
+  }
+}
+
+// the best of three runs, in seconds
+template <class F>
+static double best_time(F _f) {
+  double best = 1.e30;
+  for (int32_t k=0; k<3; ++k) {
+    const auto start = std::chrono::steady_clock::now();
+    _f();
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    best = std::min(best, elapsed.count());
+  }
+  return best;
+}
+
+// measure every coefficient on this host, in a few seconds
+static void calibrate(ngrav_costs& _c) {
+  const int32_t nsmall = 4096;
+  const int32_t nlarge = 16384;
+  const int32_t nhuge = 131072;
+  std::mt19937 rng(1234);
+  std::uniform_real_distribution<float> xrand(0.0,1.0);
+  std::vector<FLOAT> x(nhuge), y(nhuge), z(nhuge), s(nhuge), r(nhuge);
+  std::vector<FLOAT> u(nhuge), v(nhuge), w(nhuge);
+  // a unit cube, or a Plummer sphere of scale 0.1 cut off at 10 scale lengths, with positive
+  //   strengths or strengths of both signs summing to about zero
+  auto fill = [&](const int32_t _n, const bool _cluster, const bool _signed) {
+    for (int32_t i=0; i<_n; ++i) {
+      if (_cluster) {
+        FLOAT rad = 1.e30;
+        while (rad > 1.0) rad = 0.1 / std::sqrt(std::pow(xrand(rng), -2.0/3.0) - 1.0);
+        const FLOAT ct = 2.0*xrand(rng) - 1.0;
+        const FLOAT st = std::sqrt(1.0 - ct*ct);
+        const FLOAT phi = 2.0*3.1415926536*xrand(rng);
+        x[i] = rad*st*std::cos(phi);  y[i] = rad*st*std::sin(phi);  z[i] = rad*ct;
+      } else {
+        x[i] = xrand(rng);  y[i] = xrand(rng);  z[i] = xrand(rng);
+      }
+      s[i] = (_signed ? 2.0*xrand(rng)-1.0 : xrand(rng)) / std::sqrt(_n);
+      r[i] = (2./3.) / std::sqrt(_n);
+    }
+  };
+  auto cube = [&](const int32_t _n) { fill(_n, false, false); };
+
+  #pragma omp parallel
+  {
+    #pragma omp single
+    _c.nthreads = omp_get_num_threads();
+  }
+
+  // direct sums on one thread, and on the team at two sizes for its fixed cost
+  cube(nsmall);
+  const int32_t ntsmall = 256;
+  _c.serial = best_time([&]() { direct_sum(nsmall, x.data(), y.data(), z.data(), s.data(), r.data(),
+                                           ntsmall, x.data(), y.data(), z.data(), r.data(),
+                                           u.data(), v.data(), w.data(), false); }) / ((double)nsmall*ntsmall);
+  const int32_t ntiny = 64;
+  const double tiny = best_time([&]() { direct_sum(ntiny, x.data(), y.data(), z.data(), s.data(), r.data(),
+                                                   ntiny, x.data(), y.data(), z.data(), r.data(),
+                                                   u.data(), v.data(), w.data(), true); });
+  const double full = best_time([&]() { direct_sum(nsmall, x.data(), y.data(), z.data(), s.data(), r.data(),
+                                                   nsmall, x.data(), y.data(), z.data(), r.data(),
+                                                   u.data(), v.data(), w.data(), true); });
+  _c.team0 = std::max(0.0, tiny - _c.serial*ntiny*ntiny/_c.nthreads);
+  _c.team = std::max(0.0, full - _c.team0) / ((double)nsmall*nsmall);
+
+  // interaction counts, without the sums, on a large and a huge cube give the growth with the
+  //   number of leaves
+  std::vector<double> ilarge(TREE_NTHETA);
+  cube(nlarge);
+  for (int32_t t=0; t<TREE_NTHETA; ++t) {
+    ilarge[t] = tree_sum(nlarge, x.data(), y.data(), z.data(), s.data(), r.data(),
+                         nlarge, x.data(), y.data(), z.data(), r.data(), tree_theta[t], true,
+                         u.data(), v.data(), w.data()) / nlarge;
+  }
+  cube(nhuge);
+  const double llarge = std::log((double)nlarge/TREE_LEAF);
+  const double lhuge = std::log((double)nhuge/TREE_LEAF);
+  for (int32_t t=0; t<TREE_NTHETA; ++t) {
+    const double ihuge = tree_sum(nhuge, x.data(), y.data(), z.data(), s.data(), r.data(),
+                                  nhuge, x.data(), y.data(), z.data(), r.data(), tree_theta[t], true,
+                                  u.data(), v.data(), w.data()) / nhuge;
+    _c.power[t] = std::max(0.0, std::log(ihuge/ilarge[t]) / (lhuge - llarge));
+    _c.scale[t] = ilarge[t] * std::exp(-_c.power[t]*llarge);
+  }
+
+  // the treecode's error against the direct sum for each angle on huge sets, since the error
+  //   grows with the number of sources, on a sample of targets that is a run from the middle of
+  //   the Morton order, so that its blocks are as compact as they are in a whole evaluation
+  const int32_t nsample = 1024;
+  std::vector<FLOAT> tx(nsample), ty(nsample), tz(nsample), tr(nsample);
+  std::vector<FLOAT> du(nsample), dv(nsample), dw(nsample);
+  for (int32_t t=0; t<TREE_NTHETA; ++t) _c.error[t] = 0.0;
+  for (const int32_t set : {0, 1, 2}) {
+    fill(nhuge, set == 2, set > 0);
+    const std::vector<int32_t> order = morton_order(nhuge, x.data(), y.data(), z.data());
+    for (int32_t i=0; i<nsample; ++i) {
+      const int32_t j = order[nhuge/2+i];
+      tx[i] = x[j];  ty[i] = y[j];  tz[i] = z[j];  tr[i] = r[j];
+    }
+    direct_sum(nhuge, x.data(), y.data(), z.data(), s.data(), r.data(),
+               nsample, tx.data(), ty.data(), tz.data(), tr.data(), du.data(), dv.data(), dw.data(), true);
+    double vsum = 0.0;
+    for (int32_t i=0; i<nsample; ++i) vsum += (double)du[i]*du[i] + (double)dv[i]*dv[i] + (double)dw[i]*dw[i];
+    for (int32_t t=0; t<TREE_NTHETA; ++t) {
+      tree_sum(nhuge, x.data(), y.data(), z.data(), s.data(), r.data(),
+               nsample, tx.data(), ty.data(), tz.data(), tr.data(), tree_theta[t], false,
+               u.data(), v.data(), w.data());
+      double esum = 0.0;
+      for (int32_t i=0; i<nsample; ++i) {
+        esum += std::pow(u[i]-du[i],2) + std::pow(v[i]-dv[i],2) + std::pow(w[i]-dw[i],2);
+      }
+      _c.error[t] = std::max(_c.error[t], std::sqrt(esum / std::max(vsum, 1.e-30)));
+    }
+  }
+
+  // treecode times on the large cube at the widest angle: the walk alone stands in for building,
+  //   and the rest of the whole sum goes to the interactions
+  cube(nlarge);
+  const int32_t twide = TREE_NTHETA-1;
+  double iwide = 0.0;
+  const double walk = best_time([&]() {
+      iwide = tree_sum(nlarge, x.data(), y.data(), z.data(), s.data(), r.data(),
+                       nlarge, x.data(), y.data(), z.data(), r.data(), tree_theta[twide], true,
+                       u.data(), v.data(), w.data()); });
+  const double tsum = best_time([&]() {
+      tree_sum(nlarge, x.data(), y.data(), z.data(), s.data(), r.data(),
+               nlarge, x.data(), y.data(), z.data(), r.data(), tree_theta[twide], false,
+               u.data(), v.data(), w.data()); });
+  _c.build = walk / (2.0*nlarge);
+  _c.treeint = std::max(0.0, tsum - walk) / std::max(iwide, 1.0);
+
+  // the GPU, if there is one: a small problem for the fixed cost, a large one for the rate, and
+  //   the large one again with new strengths for the transfer
+  _c.gpu0 = -1.0;
+  int32_t ndev = 0;
+  if (hipGetDeviceCount(&ndev) == hipSuccess and ndev > 0) {
+    ngrav_solver* g = ngrav_create(nlarge, NGRAV_GPU);
+    if (g) {
+      bool ok = (ngrav_set_sources(g, ntiny, x.data(), y.data(), z.data(), s.data(), r.data()) == NGRAV_OK);
+      ok = ok and ngrav_evaluate(g, u.data(), v.data(), w.data()) == NGRAV_OK;
+      const double g0 = best_time([&]() { ngrav_evaluate(g, u.data(), v.data(), w.data()); });
+      ok = ok and ngrav_set_sources(g, nlarge, x.data(), y.data(), z.data(), s.data(), r.data()) == NGRAV_OK;
+      ok = ok and ngrav_evaluate(g, u.data(), v.data(), w.data()) == NGRAV_OK;
+      const double g1 = best_time([&]() { ngrav_evaluate(g, u.data(), v.data(), w.data()); });
+      const double g2 = best_time([&]() { ngrav_set_strengths(g, s.data());
+                                          ngrav_evaluate(g, u.data(), v.data(), w.data()); });
+      if (ok) {
+        _c.gpu0 = g0;
+        _c.gpu = std::max(0.0, g1 - g0) / ((double)nlarge*nlarge);
+        _c.gpubyte = std::max(0.0, g2 - g1) / (5.0*g->nsrcpad*sizeof(FLOAT));
+      }
+      ngrav_destroy(g);
+    }
+  }
+}
+
+// load the coefficients for this host, or measure and save them, once per process
+static void ensure_costs() {
+  std::lock_guard<std::mutex> lock(costs_mutex);
+  if (costs_ready) return;
+  const std::string file = costs_file(nullptr);
+  if (not load_costs(file, costs)) {
+    calibrate(costs);
+    save_costs(file, costs);
+  }
+  costs_ready = true;
+}
+
+// the widest opening angle within the solver's tolerance, after any correction from its sampled
+//   errors, or -1 if none is; a forced treecode uses the narrowest angle when none is
+static int32_t tree_angle(const ngrav_solver* _s) {
+  int32_t it = -1;
+  for (int32_t t=0; t<TREE_NTHETA; ++t) if (costs.error[t]*_s->tree_error <= _s->tol) it = t;
+  if (it < 0 and _s->method == NGRAV_METHOD_TREE) it = 0;
+  return it;
+}
+
+// the interactions the treecode should need on the solver's current problem, before correction
+static double tree_interactions(const ngrav_solver* _s, const int32_t _it) {
+  const double leaves = std::max(1.0, (double)_s->nsrc/TREE_LEAF);
+  return target_count(_s) * costs.scale[_it] * std::pow(leaves, costs.power[_it]);
+}
+
+// the time the cost model expects a method to take on the solver's current problem
+static double predict(const ngrav_solver* _s, const int32_t _method) {
+  const double ns = _s->nsrc;
+  const double nt = target_count(_s);
+  const double work = ns*nt;
+  const double share = (double)costs.nthreads / _s->nthreads;
+  switch (_method) {
+    case NGRAV_METHOD_SERIAL:
+      return costs.serial*work;
+    case NGRAV_METHOD_THREADS:
+      return costs.team0 + costs.team*work*share;
+    case NGRAV_METHOD_GPU: {
+      if (not _s->has_gpu or costs.gpu0 < 0.0) return HUGE_VAL;
+      double bytes = 3.0*nt;
+      if (_s->src_dirty) bytes += 5.0*_s->nsrcpad;
+      if (_s->trg_dirty) bytes += 4.0*_s->ntargpad;
+      return costs.gpu0 + costs.gpubyte*bytes*sizeof(FLOAT) + costs.gpu*work;
+    }
+    case NGRAV_METHOD_TREE: {
+      const int32_t it = tree_angle(_s);
+      if (it < 0) return HUGE_VAL;
+      const double inter = std::min(work, _s->tree_ratio*tree_interactions(_s, it));
+      const double check = (_s->method == NGRAV_METHOD_AUTO) ? std::min((double)TREE_CHECK, nt)*ns : 0.0;
+      return costs.build*(ns+nt) + costs.treeint*inter*share + costs.team*check*share;
+    }
+    default:
+      return HUGE_VAL;
+  }
+}
+
+// the method the cost model predicts is fastest, with or without the treecode
+static int32_t fastest(const ngrav_solver* _s, const bool _tree) {
+  int32_t method = NGRAV_METHOD_SERIAL;
+  double best = HUGE_VAL;
+  for (const int32_t m : {NGRAV_METHOD_SERIAL, NGRAV_METHOD_THREADS, NGRAV_METHOD_GPU, NGRAV_METHOD_TREE}) {
+    if (m == NGRAV_METHOD_TREE and not _tree) continue;
+    const double t = predict(_s, m);
+    if (t < best) {
+      best = t;
+      method = m;
+    }
+  }
+  return method;
+}
+
+// the treecode's relative rms error on a spread of the targets, against the direct sum there
+static double tree_check(const ngrav_solver* _s, const float* _u, const float* _v, const float* _w) {
+  const int32_t nt = target_count(_s);
+  const int32_t nc = std::min(nt, TREE_CHECK);
+  const FLOAT* tx = _s->separate ? _s->tx.data() : _s->sx.data();
+  const FLOAT* ty = _s->separate ? _s->ty.data() : _s->sy.data();
+  const FLOAT* tz = _s->separate ? _s->tz.data() : _s->sz.data();
+  const FLOAT* tr = _s->separate ? _s->tr.data() : _s->sr.data();
+  std::vector<int32_t> idx(nc);
+  std::vector<FLOAT> cx(nc), cy(nc), cz(nc), cr(nc), du(nc), dv(nc), dw(nc);
+  for (int32_t i=0; i<nc; ++i) {
+    idx[i] = (int32_t)(((int64_t)i*nt + nt/2) / nc);
+    cx[i] = tx[idx[i]];  cy[i] = ty[idx[i]];  cz[i] = tz[idx[i]];  cr[i] = tr[idx[i]];
+  }
+  direct_sum(_s->nsrc, _s->sx.data(), _s->sy.data(), _s->sz.data(), _s->ss.data(), _s->sr.data(),
+             nc, cx.data(), cy.data(), cz.data(), cr.data(), du.data(), dv.data(), dw.data(),
+             (double)nc*_s->nsrc >= SERIAL_WORK);
+  double esum = 0.0, vsum = 0.0;
+  for (int32_t i=0; i<nc; ++i) {
+    const int32_t j = idx[i];
+    esum += std::pow(_u[j]-du[i],2) + std::pow(_v[j]-dv[i],2) + std::pow(_w[j]-dw[i],2);
+    vsum += (double)du[i]*du[i] + (double)dv[i]*dv[i] + (double)dw[i]*dw[i];
+  }
+  if (esum == 0.0) return 0.0;
+  return (vsum > 0.0) ? std::sqrt(esum/vsum) : HUGE_VAL;
+}
+
+// pick a method, or take the forced one, and run it
+static int32_t evaluate_auto(ngrav_solver* _s, float* _u, float* _v, float* _w) {
+  int32_t method = _s->method;
+  if (method == NGRAV_METHOD_AUTO) method = fastest(_s, true);
+  _s->last_method = method;
+  _s->last_predicted = predict(_s, method);
+
+  switch (method) {
+    case NGRAV_METHOD_SERIAL:
+      evaluate_cpu(_s, false, _u, _v, _w);
+      return NGRAV_OK;
+    case NGRAV_METHOD_THREADS:
+      evaluate_cpu(_s, true, _u, _v, _w);
+      return NGRAV_OK;
+    case NGRAV_METHOD_GPU:
+      return evaluate_gpu(_s, _u, _v, _w);
+    default: {
+      // the measured interactions correct the next prediction for this distribution
+      const int32_t it = tree_angle(_s);
+      const int32_t nt = target_count(_s);
+      const FLOAT* tx = _s->separate ? _s->tx.data() : _s->sx.data();
+      const FLOAT* ty = _s->separate ? _s->ty.data() : _s->sy.data();
+      const FLOAT* tz = _s->separate ? _s->tz.data() : _s->sz.data();
+      const FLOAT* tr = _s->separate ? _s->tr.data() : _s->sr.data();
+      const double inter = tree_sum(_s->nsrc, _s->sx.data(), _s->sy.data(), _s->sz.data(), _s->ss.data(), _s->sr.data(),
+                                    nt, tx, ty, tz, tr, tree_theta[it], false, _u, _v, _w);
+      _s->tree_ratio = inter / std::max(1.0, tree_interactions(_s, it));
+      if (_s->method != NGRAV_METHOD_AUTO) return NGRAV_OK;
+
+      // a chosen treecode must meet the tolerance on this distribution too: the sampled error
+      //   narrows the angle for later evaluations, and a miss is redone with a direct sum
+      const double err = tree_check(_s, _u, _v, _w);
+      _s->tree_error = std::max(_s->tree_error, err / std::max(costs.error[it], 1.e-30));
+      if (err <= _s->tol) return NGRAV_OK;
+      method = fastest(_s, false);
+      _s->last_method = method;
+      _s->last_predicted += predict(_s, method);
+      if (method == NGRAV_METHOD_GPU) return evaluate_gpu(_s, _u, _v, _w);
+      evaluate_cpu(_s, method == NGRAV_METHOD_THREADS, _u, _v, _w);
+      return NGRAV_OK;
+    }
+  }
+}
+
+// -------------------------
+// the C interface
+
+extern "C" {
+
+ngrav_solver* ngrav_create(const int32_t _capacity, const int32_t _where) {
+  if (_capacity < 1 or (_where != NGRAV_CPU and _where != NGRAV_GPU and _where != NGRAV_AUTO)) return nullptr;
+  if (_where == NGRAV_AUTO) ensure_costs();
+
+  ngrav_solver* s = new (std::nothrow) ngrav_solver;
+  if (not s) return nullptr;
+  s->capacity = _capacity;
+  s->where = _where;
+
+  // the largest source padding is for GPU_MAX_SRC_BLOCKS blocks, for targets it is one block
+  const size_t srcmax = buffer(_capacity, THREADS_PER_BLOCK*GPU_MAX_SRC_BLOCKS);
+  const size_t trgmax = buffer(_capacity, THREADS_PER_BLOCK);
+  s->sx.assign(srcmax, 0.0); s->sy.assign(srcmax, 0.0); s->sz.assign(srcmax, 0.0);
+  s->ss.assign(srcmax, 0.0); s->sr.assign(srcmax, 0.0);
+  s->tx.assign(trgmax, 0.0); s->ty.assign(trgmax, 0.0); s->tz.assign(trgmax, 0.0); s->tr.assign(trgmax, 0.0);
+
+  // start the thread team now rather than in the first evaluation
+  #pragma omp parallel
+  {
+    #pragma omp single
+    s->nthreads = omp_get_num_threads();
+  }
+
+  if (_where == NGRAV_GPU and not allocate_device(s, srcmax, trgmax)) {
+    ngrav_destroy(s);
+    return nullptr;
+  }
+
+  // an automatic solver uses the GPU if the calibration found one, and runs without it otherwise
+  if (_where == NGRAV_AUTO and costs.gpu0 >= 0.0 and not allocate_device(s, srcmax, trgmax)) {
+    free_device(s);
+  }
+
+  return s;
+}
+
+int32_t ngrav_set_sources(ngrav_solver* _s, const int32_t _n,
+                          const float* _x, const float* _y, const float* _z,
+                          const float* _str, const float* _rad) {
+  if (not _s or not _x or not _y or not _z or not _str or not _rad) return NGRAV_ERR_NULL;
+  if (_n < 1 or _n > _s->capacity) return NGRAV_ERR_CAPACITY;
+
+  if (_n != _s->nsrc) {
+    _s->nsrc = _n;
+    retune(_s);
+  }
+
+  memcpy(_s->sx.data(), _x, _n*sizeof(FLOAT));
+  memcpy(_s->sy.data(), _y, _n*sizeof(FLOAT));
+  memcpy(_s->sz.data(), _z, _n*sizeof(FLOAT));
+  memcpy(_s->ss.data(), _str, _n*sizeof(FLOAT));
+  memcpy(_s->sr.data(), _rad, _n*sizeof(FLOAT));
+  _s->src_dirty = true;
+  if (not _s->separate) _s->trg_dirty = true;
+  invalidate(_s);
+
+  // new sources may be distributed differently, so a sampled miss on the old ones counts for
+  //   less: halving its logarithm brings the angle back within a few calls if the misses stop
+  _s->tree_error = std::sqrt(_s->tree_error);
+  return NGRAV_OK;
+}
+
+int32_t ngrav_change_sources(ngrav_solver* _s, const int32_t _k, const int32_t* _idx,
+                             const float* _x, const float* _y, const float* _z,
+                             const float* _str, const float* _rad) {
+  if (not _s) return NGRAV_ERR_NULL;
+  if (_k < 1) return NGRAV_OK;
+  if (not _idx or not _x or not _y or not _z or not _str or not _rad) return NGRAV_ERR_NULL;
+  for (int32_t c=0; c<_k; ++c) {
+    if (_idx[c] < 0 or _idx[c] >= _s->nsrc) return NGRAV_ERR_INDEX;
+  }
+
+  for (int32_t c=0; c<_k; ++c) {
+    const int32_t j = _idx[c];
+    // the saved velocities hold this source's first value since they were computed
+    if (_s->cache_valid and not _s->was_changed[j]) {
+      _s->was_changed[j] = 1;
+      _s->changed.push_back(j);
+      _s->ox.push_back(_s->sx[j]);
+      _s->oy.push_back(_s->sy[j]);
+      _s->oz.push_back(_s->sz[j]);
+      _s->os.push_back(-_s->ss[j]);
+      _s->orad.push_back(_s->sr[j]);
+    }
+    _s->sx[j] = _x[c];
+    _s->sy[j] = _y[c];
+    _s->sz[j] = _z[c];
+    _s->ss[j] = _str[c];
+    _s->sr[j] = _rad[c];
+  }
+  _s->src_dirty = true;
+  if (not _s->separate) _s->trg_dirty = true;
+  return NGRAV_OK;
+}
+
+int32_t ngrav_set_incremental(ngrav_solver* _s, const int32_t _refresh) {
+  if (not _s) return NGRAV_ERR_NULL;
+  _s->refresh = std::max(0, _refresh);
+  invalidate(_s);
+  if (_s->refresh > 0) {
+    const size_t nmax = _s->tx.size();
+    _s->cu.resize(nmax);
+    _s->cv.resize(nmax);
+    _s->cw.resize(nmax);
+    _s->was_changed.assign(_s->sx.size(), 0);
+  }
+  return NGRAV_OK;
+}
+
+int32_t ngrav_set_strengths(ngrav_solver* _s, const float* _str) {
+  if (not _s or not _str) return NGRAV_ERR_NULL;
+  if (_s->nsrc < 1) return NGRAV_ERR_EMPTY;
+  memcpy(_s->ss.data(), _str, _s->nsrc*sizeof(FLOAT));
+  _s->src_dirty = true;
+  invalidate(_s);
+  return NGRAV_OK;
+}
+
+int32_t ngrav_set_targets(ngrav_solver* _s, const int32_t _m,
+                          const float* _x, const float* _y, const float* _z, const float* _rad) {
+  if (not _s) return NGRAV_ERR_NULL;
+  if (_m < 0 or _m > _s->capacity) return NGRAV_ERR_CAPACITY;
+
+  const int32_t before = target_count(_s);
+  if (_m == 0) {
+    _s->separate = false;
+    _s->ntarg = 0;
+  } else {
+    if (not _x or not _y or not _z or not _rad) return NGRAV_ERR_NULL;
+    _s->separate = true;
+    _s->ntarg = _m;
+    memcpy(_s->tx.data(), _x, _m*sizeof(FLOAT));
+    memcpy(_s->ty.data(), _y, _m*sizeof(FLOAT));
+    memcpy(_s->tz.data(), _z, _m*sizeof(FLOAT));
+    memcpy(_s->tr.data(), _rad, _m*sizeof(FLOAT));
+  }
+  if (target_count(_s) != before) retune(_s);
+  _s->trg_dirty = true;
+  invalidate(_s);
+  return NGRAV_OK;
+}
+
+int32_t ngrav_evaluate(ngrav_solver* _s, float* _u, float* _v, float* _w) {
+  if (not _s or not _u or not _v or not _w) return NGRAV_ERR_NULL;
+  if (_s->nsrc < 1) return NGRAV_ERR_EMPTY;
+
+  const int32_t nt = target_count(_s);
+
+  // incremental update, unless too much changed for it to pay
+  const bool incremental = (_s->where == NGRAV_CPU and _s->refresh > 0);
+  if (incremental and _s->cache_valid and _s->since_full+1 < _s->refresh
+      and 4*(int64_t)_s->changed.size() < _s->nsrc) {
+    update_incremental(_s);
+    _s->since_full++;
+    memcpy(_u, _s->cu.data(), nt*sizeof(FLOAT));
+    memcpy(_v, _s->cv.data(), nt*sizeof(FLOAT));
+    memcpy(_w, _s->cw.data(), nt*sizeof(FLOAT));
+    return NGRAV_OK;
+  }
+
+  if (_s->where == NGRAV_AUTO) return evaluate_auto(_s, _u, _v, _w);
+
+  if (_s->where == NGRAV_GPU) {
+    _s->last_method = NGRAV_METHOD_GPU;
+    return evaluate_gpu(_s, _u, _v, _w);
+  }
+
+  const bool parallel = ((double)_s->nsrc*nt >= SERIAL_WORK);
+  _s->last_method = parallel ? NGRAV_METHOD_THREADS : NGRAV_METHOD_SERIAL;
+  evaluate_cpu(_s, parallel, _u, _v, _w);
+
+  // save this as the starting point for incremental updates
+  if (incremental) {
+    invalidate(_s);
+    memcpy(_s->cu.data(), _u, nt*sizeof(FLOAT));
+    memcpy(_s->cv.data(), _v, nt*sizeof(FLOAT));
+    memcpy(_s->cw.data(), _w, nt*sizeof(FLOAT));
+    _s->cache_valid = true;
+    _s->since_full = 0;
+  }
+  return NGRAV_OK;
+}
+
+int32_t ngrav_evaluate_multi(ngrav_solver* _s, const int32_t _k, const float* _str,
+                             float* _u, float* _v, float* _w) {
+  if (not _s or not _str or not _u or not _v or not _w) return NGRAV_ERR_NULL;
+  if (_s->nsrc < 1) return NGRAV_ERR_EMPTY;
+  if (_k < 1) return NGRAV_OK;
+
+  const int32_t nsrc = _s->nsrc;
+  const int32_t nt = target_count(_s);
+
+  if (_s->where == NGRAV_GPU) {
+    // one pass per strength vector, then put the solver's own strengths back
+    std::vector<FLOAT> keep(_s->ss.begin(), _s->ss.begin()+nsrc);
+    int32_t err = NGRAV_OK;
+    for (int32_t k=0; k<_k and err==NGRAV_OK; ++k) {
+      memcpy(_s->ss.data(), _str+(size_t)k*nsrc, nsrc*sizeof(FLOAT));
+      _s->src_dirty = true;
+      err = ngrav_evaluate(_s, _u+(size_t)k*nt, _v+(size_t)k*nt, _w+(size_t)k*nt);
+    }
+    memcpy(_s->ss.data(), keep.data(), nsrc*sizeof(FLOAT));
+    _s->src_dirty = true;
+    return err;
+  }
+
+  const FLOAT* tx = _s->separate ? _s->tx.data() : _s->sx.data();
+  const FLOAT* ty = _s->separate ? _s->ty.data() : _s->sy.data();
+  const FLOAT* tz = _s->separate ? _s->tz.data() : _s->sz.data();
+  const FLOAT* tr = _s->separate ? _s->tr.data() : _s->sr.data();
+  const int32_t ntblocks = (nt+CPU_TRG_BLK-1)/CPU_TRG_BLK;
+  const bool parallel = ((double)nsrc*nt*_k >= SERIAL_WORK);
+  const int32_t nsplit = parallel ? _s->nsplit : 1;
+
+  // partial sums for split source ranges hold all _k vectors of each range
+  const size_t npartial = (size_t)nsplit*_k*nt;
+  if (nsplit > 1 and _s->pu.size() < npartial) {
+    _s->pu.resize(npartial);
+    _s->pv.resize(npartial);
+    _s->pw.resize(npartial);
+  }
+  FLOAT* const ou = (nsplit > 1) ? _s->pu.data() : _u;
+  FLOAT* const ov = (nsplit > 1) ? _s->pv.data() : _v;
+  FLOAT* const ow = (nsplit > 1) ? _s->pw.data() : _w;
+  const FLOAT* sx = _s->sx.data();
+  const FLOAT* sy = _s->sy.data();
+  const FLOAT* sz = _s->sz.data();
+  const FLOAT* sr = _s->sr.data();
+
+  #pragma omp parallel if(parallel)
+  {
+    // each thread's accumulators, allocated once for all of its blocks
+    const size_t nacc = (size_t)_k*CPU_TRG_BLK;
+    std::vector<FLOAT> acc(3*nacc);
+
+    #pragma omp for collapse(2) schedule(guided)
+    for (int32_t isp=0; isp<nsplit; ++isp) {
+      for (int32_t ibk=0; ibk<ntblocks; ++ibk) {
+        const int32_t jstart = ((int64_t)nsrc*isp)/nsplit;
+        const int32_t jend = ((int64_t)nsrc*(isp+1))/nsplit;
+        const int32_t istart = CPU_TRG_BLK*ibk;
+        const int32_t iend = std::min(nt, CPU_TRG_BLK*(ibk+1));
+        const size_t o = (size_t)isp*_k*nt + istart;
+        ngrav_3d_multi_cpu(jend-jstart, sx+jstart, sy+jstart, sz+jstart, sr+jstart,
+                           _k, _str+jstart, nsrc,
+                           iend-istart, tx+istart, ty+istart, tz+istart, tr+istart,
+                           ou+o, ov+o, ow+o, nt,
+                           acc.data(), acc.data()+nacc, acc.data()+2*nacc);
+      }
+    }
+  }
+
+  // add up the partial sums
+  if (nsplit > 1) {
+    const size_t nout = (size_t)_k*nt;
+    #pragma omp parallel for
+    for (size_t i=0; i<nout; ++i) {
+      FLOAT su = 0.0, sv = 0.0, sw = 0.0;
+      for (int32_t isp=0; isp<nsplit; ++isp) {
+        su += _s->pu[isp*nout+i];
+        sv += _s->pv[isp*nout+i];
+        sw += _s->pw[isp*nout+i];
+      }
+      _u[i] = su;
+      _v[i] = sv;
+      _w[i] = sw;
+    }
+  }
+  return NGRAV_OK;
+}
+
+int32_t ngrav_evaluate_batch(const int32_t _nprob, const ngrav_problem* _probs) {
+  if (_nprob < 0) return NGRAV_ERR_CAPACITY;
+  if (_nprob == 0) return NGRAV_OK;
+  if (not _probs) return NGRAV_ERR_NULL;
+
+  double total = 0.0;
+  for (int32_t p=0; p<_nprob; ++p) {
+    const ngrav_problem& pr = _probs[p];
+    if (pr.n < 0) return NGRAV_ERR_CAPACITY;
+    if (pr.n > 0 and (not pr.x or not pr.y or not pr.z or not pr.str or not pr.rad or
+                      not pr.u or not pr.v or not pr.w)) return NGRAV_ERR_NULL;
+    total += (double)pr.n*pr.n;
+  }
+
+  // a problem stays whole on one thread unless it is a big share of the batch, in which case
+  //   its target blocks are cut into pieces of about an eighth of a thread's fair share
+  int32_t nthreads = 1;
+  #pragma omp parallel
+  {
+    #pragma omp single
+    nthreads = omp_get_num_threads();
+  }
+  const double piece = std::max((double)SERIAL_WORK, total / (8.0*nthreads));
+
+  struct Item {
+    int32_t p, istart, iend;
+    double work;
+  };
+  std::vector<Item> items;
+  for (int32_t p=0; p<_nprob; ++p) {
+    const int32_t n = _probs[p].n;
+    if (n == 0) continue;
+    const int32_t ntblocks = (n+CPU_TRG_BLK-1)/CPU_TRG_BLK;
+    const int32_t npieces = std::max(1, std::min(ntblocks, (int32_t)((double)n*n/piece)));
+    for (int32_t k=0; k<npieces; ++k) {
+      const int32_t istart = CPU_TRG_BLK*(((int64_t)ntblocks*k)/npieces);
+      const int32_t iend = std::min(n, CPU_TRG_BLK*(int32_t)(((int64_t)ntblocks*(k+1))/npieces));
+      items.push_back(Item{p, istart, iend, (double)n*(iend-istart)});
+    }
+  }
+
+  // largest first, so the last items handed out are the small ones
+  std::stable_sort(items.begin(), items.end(), [](const Item& a, const Item& b) { return a.work > b.work; });
+
+  #pragma omp parallel for schedule(dynamic,1) if(total >= SERIAL_WORK)
+  for (size_t k=0; k<items.size(); ++k) {
+    const ngrav_problem& pr = _probs[items[k].p];
+    for (int32_t istart=items[k].istart; istart<items[k].iend; istart+=CPU_TRG_BLK) {
+      const int32_t iend = std::min(items[k].iend, istart+CPU_TRG_BLK);
+      ngrav_3d_nograds_cpu(pr.n, pr.x, pr.y, pr.z, pr.str, pr.rad,
+                           iend-istart, pr.x+istart, pr.y+istart, pr.z+istart, pr.rad+istart,
+                           pr.u+istart, pr.v+istart, pr.w+istart);
+    }
+  }
+  return NGRAV_OK;
+}
+
+int32_t ngrav_set_tolerance(ngrav_solver* _s, const float _tol) {
+  if (not _s) return NGRAV_ERR_NULL;
+  if (_s->where != NGRAV_AUTO or not (_tol >= 0.0)) return NGRAV_ERR_METHOD;
+  _s->tol = _tol;
+  return NGRAV_OK;
+}
+
+int32_t ngrav_set_method(ngrav_solver* _s, const int32_t _method) {
+  if (not _s) return NGRAV_ERR_NULL;
+  if (_s->where != NGRAV_AUTO or _method < NGRAV_METHOD_AUTO or _method > NGRAV_METHOD_TREE) return NGRAV_ERR_METHOD;
+  if (_method == NGRAV_METHOD_GPU and not _s->has_gpu) return NGRAV_ERR_METHOD;
+  _s->method = _method;
+  return NGRAV_OK;
+}
+
+int32_t ngrav_last_method(const ngrav_solver* _s, int32_t* _method, double* _predicted) {
+  if (not _s or not _method or not _predicted) return NGRAV_ERR_NULL;
+  *_method = _s->last_method;
+  *_predicted = _s->last_predicted;
+  return NGRAV_OK;
+}
+
+int32_t ngrav_calibrate(const char* _file) {
+  std::lock_guard<std::mutex> lock(costs_mutex);
+  calibrate(costs);
+  costs_ready = true;
+  return save_costs(costs_file(_file), costs) ? NGRAV_OK : NGRAV_ERR_FILE;
+}
+
+void ngrav_destroy(ngrav_solver* _s) {
+  if (not _s) return;
+  free_device(_s);
+  delete _s;
+}
+
+const char* ngrav_error_string(const int32_t _err) {
+  switch (_err) {
+    case NGRAV_OK:           return "no error";
+    case NGRAV_ERR_NULL:     return "null solver or array";
+    case NGRAV_ERR_CAPACITY: return "count exceeds solver capacity";
+    case NGRAV_ERR_EMPTY:    return "no sources have been set";
+    case NGRAV_ERR_DEVICE:   return "GPU error";
+    case NGRAV_ERR_INDEX:    return "particle index out of range";
+    case NGRAV_ERR_METHOD:   return "method not available to this solver";
+    case NGRAV_ERR_FILE:     return "could not write the cost file";
+    default:                 return "unknown error";
+  }
+}
+
+}
@@ -0,0 +1,138 @@
+/*
+ * ngrav.h
+ *
+ * (c)2022 Mark J. Stock <markjstock@gmail.com>
+ *
+ * C interface to a persistent 3D gravitational (Biot-Savart-like) summation solver
+ *
+ * A solver owns padded copies of the particle arrays (and device copies when running on a GPU),
+ *   a warm OpenMP team, and the work decomposition chosen for the current counts, so that
+ *   repeated evaluations only move the data that changed. Typical use:
+ *
+ *     ngrav_solver* s = ngrav_create(100000, NGRAV_CPU);
+ *     ngrav_set_sources(s, n, x, y, z, str, rad);
+ *     for (step...) {
+ *       ngrav_evaluate(s, u, v, w);		// velocities at the sources themselves
+ *       ...move particles...
+ *       ngrav_set_sources(s, n, x, y, z, str, rad);
+ *     }
+ *     ngrav_destroy(s);
+ *
+ * All arrays are float, structure-of-arrays. Every call except create returns NGRAV_OK or an
+ *   error code, and never exits the process.
+ */
+
+#ifndef NGRAV_H
+#define NGRAV_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// where to compute
+#define NGRAV_CPU 0
+#define NGRAV_GPU 1
+#define NGRAV_AUTO 2		// choose a method for each evaluation from a calibrated cost model
+
+// the methods an NGRAV_AUTO solver chooses among
+#define NGRAV_METHOD_AUTO 0		// whichever the cost model predicts is fastest (the default)
+#define NGRAV_METHOD_SERIAL 1	// blocked direct sum on the calling thread
+#define NGRAV_METHOD_THREADS 2	// blocked direct sum on the thread team
+#define NGRAV_METHOD_GPU 3		// direct sum on the GPU
+#define NGRAV_METHOD_TREE 4		// monopole treecode on the thread team, within the tolerance
+
+// return codes
+#define NGRAV_OK 0
+#define NGRAV_ERR_NULL 1		// a null solver or array
+#define NGRAV_ERR_CAPACITY 2	// more particles than the solver was created for
+#define NGRAV_ERR_EMPTY 3		// evaluate before any sources were set
+#define NGRAV_ERR_DEVICE 4		// a GPU call failed
+#define NGRAV_ERR_INDEX 5		// a particle index outside the current sources
+#define NGRAV_ERR_METHOD 6		// a method or setting this solver cannot use
+#define NGRAV_ERR_FILE 7		// the calibration could not be saved
+
+typedef struct ngrav_solver ngrav_solver;
+
+// allocate a solver for up to _capacity sources and _capacity targets; null on failure
+ngrav_solver* ngrav_create(const int32_t _capacity, const int32_t _where);
+
+// copy in the sources: positions, strengths, core radii
+int32_t ngrav_set_sources(ngrav_solver* _s, const int32_t _n,
+                          const float* _x, const float* _y, const float* _z,
+                          const float* _str, const float* _rad);
+
+// replace only the strengths of the current sources
+int32_t ngrav_set_strengths(ngrav_solver* _s, const float* _str);
+
+// replace _k of the current sources, given by index, with new positions, strengths and radii
+int32_t ngrav_change_sources(ngrav_solver* _s, const int32_t _k, const int32_t* _idx,
+                             const float* _x, const float* _y, const float* _z,
+                             const float* _str, const float* _rad);
+
+// keep the velocities from each evaluation (CPU only): if only ngrav_change_sources was called
+//   since, the next evaluation subtracts the changed sources' old contributions, adds their new
+//   ones and recomputes the changed targets, O(kN) for k changes; every _refresh-th evaluation
+//   is a full one to clear accumulated roundoff; 0 (the default) turns this off
+int32_t ngrav_set_incremental(ngrav_solver* _s, const int32_t _refresh);
+
+// evaluate at separate target points instead of the sources; _m = 0 goes back to the sources
+int32_t ngrav_set_targets(ngrav_solver* _s, const int32_t _m,
+                          const float* _x, const float* _y, const float* _z, const float* _rad);
+
+// compute the velocity at every target (or source), written into the caller's arrays
+int32_t ngrav_evaluate(ngrav_solver* _s, float* _u, float* _v, float* _w);
+
+// compute velocities for _k strength vectors on the current geometry at once: _str holds _k
+//   arrays of nsrc strengths back to back, and each of _u, _v, _w receives _k arrays of one
+//   value per target; the CPU reuses each pair's geometry for all _k, the GPU makes _k passes,
+//   and the strengths given to set_sources are left as they were
+int32_t ngrav_evaluate_multi(ngrav_solver* _s, const int32_t _k, const float* _str,
+                             float* _u, float* _v, float* _w);
+
+// one independent problem for ngrav_evaluate_batch: n particles that are both sources and
+//   targets, and where to put their velocities
+typedef struct ngrav_problem {
+  int32_t n;
+  const float *x, *y, *z, *str, *rad;
+  float *u, *v, *w;
+} ngrav_problem;
+
+// compute many independent problems at once on the CPU, without a solver: the problems (or
+//   pieces of the large ones) are spread over the thread team largest first, and each piece
+//   runs the blocked kernel on one thread
+int32_t ngrav_evaluate_batch(const int32_t _nprob, const ngrav_problem* _probs);
+
+// for NGRAV_AUTO solvers, the relative rms velocity error an evaluation may have: 0 (the
+//   default) allows only the direct sums, and anything larger also allows the treecode with the
+//   widest opening angle whose calibrated error is within it; each automatically chosen treecode
+//   checks its error on a sample of targets, redoes the evaluation with a direct sum if that
+//   misses, and narrows the angle the solver uses, easing back over the next few calls to
+//   ngrav_set_sources; the other calls treat an
+//   NGRAV_AUTO solver as a CPU one, with the GPU used only by ngrav_evaluate
+int32_t ngrav_set_tolerance(ngrav_solver* _s, const float _tol);
+
+// for NGRAV_AUTO solvers, always use this method, or NGRAV_METHOD_AUTO to let the model choose
+int32_t ngrav_set_method(ngrav_solver* _s, const int32_t _method);
+
+// the method the last evaluation used, and the time in seconds the cost model predicted for it
+//   (0 unless the solver is NGRAV_AUTO)
+int32_t ngrav_last_method(const ngrav_solver* _s, int32_t* _method, double* _predicted);
+
+// time each method on this host now and save the coefficients to _file, or to the default file
+//   if null; the first NGRAV_AUTO solver in a process loads them from the default file, or calls
+//   this if there is none. The default is $NGRAV_COSTS, else ~/.ngrav_costs_<hostname>
+int32_t ngrav_calibrate(const char* _file);
+
+// release everything
+void ngrav_destroy(ngrav_solver* _s);
+
+// a short description of a return code
+const char* ngrav_error_string(const int32_t _err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,754 @@
+/*
+ * nvPeriodic.cpp
+ *
+ * (c)2022 Mark J. Stock <markjstock@gmail.com>
+ *
+ * 2D vortex particles in a doubly periodic unit box, time stepped on the CPU, with velocities
+ *   from Ewald splitting: a short-range sum in real space over a cell list, and the long-range
+ *   rest on a grid by FFT (particle-mesh Ewald with cubic B-splines), near-linear in N
+ */
+
+#include <vector>
+#include <random>
+#include <chrono>
+#include <complex>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <omp.h>
+
+// compute using float
+#define FLOAT float
+
+// the long-range part is a Gaussian of width EWALD_SH grid spacings, and the real-space sum stops
+//   at EWALD_RC of those widths, where the short-range kernel has fallen to about 4e-6
+#define EWALD_SH 3.0
+#define EWALD_RC 5.0
+
+// the smallest grid, so that the real-space cutoff stays under a third of the box
+#define MIN_GRID 32
+
+// viscous diffusion by particle strength exchange: a Gaussian of PSE_EPS particle spacings, cut off
+//   at PSE_RC of those widths, where it has fallen to about 1e-7
+#define PSE_EPS 1.0
+#define PSE_RC 4.0
+
+// remeshing sorts into cells at least this many lattice spacings tall, so that its 4-point
+//   stencils can be scattered by colored rows of cells
+#define REMESH_CELL 4
+
+
+// -------------------------
+// particles sorted into a uniform grid of nc x nc cells by a counting sort, in parallel: each
+//   thread counts its own contiguous range of particles, so particles within a cell keep their
+//   order and the result does not depend on the thread count
+
+struct CellList {
+  int32_t nc = 0;
+  std::vector<int32_t> start;	// cell c holds sorted particles start[c] to start[c+1]
+  std::vector<int32_t> order;	// sorted particle k was particle order[k]
+  std::vector<int32_t> cell, count;
+};
+
+static void cell_sort(const int32_t _n, const FLOAT* _x, const FLOAT* _y, const int32_t _nc, CellList& _cl) {
+  const int32_t ncells = _nc*_nc;
+  _cl.nc = _nc;
+  _cl.start.assign(ncells+1, 0);
+  _cl.order.resize(_n);
+  _cl.cell.resize(_n);
+
+  #pragma omp parallel
+  {
+    const int32_t nt = omp_get_num_threads();
+    const int32_t t = omp_get_thread_num();
+    const int32_t first = ((int64_t)_n*t)/nt;
+    const int32_t last = ((int64_t)_n*(t+1))/nt;
+    #pragma omp single
+    _cl.count.assign((size_t)nt*ncells, 0);
+
+    int32_t* cnt = &_cl.count[(size_t)t*ncells];
+    for (int32_t i=first; i<last; ++i) {
+      const int32_t cx = std::min(_nc-1, (int32_t)(_x[i]*_nc));
+      const int32_t cy = std::min(_nc-1, (int32_t)(_y[i]*_nc));
+      _cl.cell[i] = cy*_nc + cx;
+      cnt[_cl.cell[i]]++;
+    }
+    #pragma omp barrier
+
+    // each thread's first slot in each cell
+    #pragma omp for
+    for (int32_t c=0; c<ncells; ++c) {
+      int32_t sum = 0;
+      for (int32_t k=0; k<nt; ++k) {
+        const int32_t here = _cl.count[(size_t)k*ncells+c];
+        _cl.count[(size_t)k*ncells+c] = sum;
+        sum += here;
+      }
+      _cl.start[c+1] = sum;
+    }
+    #pragma omp single
+    for (int32_t c=0; c<ncells; ++c) _cl.start[c+1] += _cl.start[c];
+
+    for (int32_t i=first; i<last; ++i) {
+      const int32_t c = _cl.cell[i];
+      _cl.order[_cl.start[c] + cnt[c]++] = i;
+    }
+  }
+}
+
+// put the arrays in cell order, so that every cell's particles are contiguous
+static void reorder(const std::vector<int32_t>& _order, std::vector<FLOAT>& _a, std::vector<FLOAT>& _tmp) {
+  const int32_t n = _order.size();
+  _tmp.resize(n);
+  #pragma omp parallel for
+  for (int32_t i=0; i<n; ++i) _tmp[i] = _a[_order[i]];
+  _a.swap(_tmp);
+}
+
+// -------------------------
+// the kernels: particles carry Gaussian cores of radius delta, whose velocity splits exactly into
+//   a long-range Gaussian of width s (delta plus the screening) and a short-range remainder
+
+// the short-range velocity factor times r^2: exp(-r^2/2s^2) - exp(-r^2/2delta^2), with a series
+//   near r=0 where the difference would cancel
+static inline FLOAT short_factor(const FLOAT _r2, const FLOAT _a, const FLOAT _b) {
+  const FLOAT ea = _r2*_a;
+  const FLOAT eb = _r2*_b;
+  const FLOAT series = (eb-ea) - (FLOAT)0.5*(eb*eb-ea*ea) + (FLOAT)(1.0/6.0)*(eb*eb*eb-ea*ea*ea);
+  return (eb < (FLOAT)0.01) ? series : std::exp(-ea) - std::exp(-eb);
+}
+
+// every sorted particle i against the particles of its own and the 8 neighboring cells, shifted
+//   across the box edges as needed: _pair(i, first, last, tx, ty) gets the range of sorted
+//   particles in one neighbor cell and the target position moved into that cell's frame
+template <class F>
+static void cell_sweep(const CellList& _cl, F _pair) {
+  const int32_t nc = _cl.nc;
+
+  #pragma omp parallel for schedule(guided)
+  for (int32_t c=0; c<nc*nc; ++c) {
+    const int32_t cx = c % nc;
+    const int32_t cy = c / nc;
+    for (int32_t i=_cl.start[c]; i<_cl.start[c+1]; ++i) {
+      for (int32_t oy=-1; oy<=1; ++oy) {
+        const int32_t ny = (cy+oy+nc) % nc;
+        const FLOAT shy = (cy+oy < 0) ? -1.0 : (cy+oy >= nc ? 1.0 : 0.0);
+        for (int32_t ox=-1; ox<=1; ++ox) {
+          const int32_t nx = (cx+ox+nc) % nc;
+          const FLOAT shx = (cx+ox < 0) ? -1.0 : (cx+ox >= nc ? 1.0 : 0.0);
+          const int32_t nbr = ny*nc + nx;
+          _pair(i, _cl.start[nbr], _cl.start[nbr+1], shx, shy);
+        }
+      }
+    }
+  }
+}
+
+// the real-space part, within the cutoff
+static void ewald_real(const int32_t _n, const FLOAT* _x, const FLOAT* _y, const FLOAT* _s,
+                       const CellList& _cl, const FLOAT _delta, const FLOAT _sigma, const FLOAT _rc,
+                       FLOAT* _u, FLOAT* _v) {
+  const FLOAT a = 0.5 / (_sigma*_sigma);
+  const FLOAT b = 0.5 / (_delta*_delta);
+  const FLOAT rc2 = _rc*_rc;
+  std::fill(_u, _u+_n, 0.0f);
+  std::fill(_v, _v+_n, 0.0f);
+
+  cell_sweep(_cl, [&](const int32_t i, const int32_t first, const int32_t last, const FLOAT shx, const FLOAT shy) {
+    const FLOAT tx = _x[i] - shx;
+    const FLOAT ty = _y[i] - shy;
+    FLOAT locu = 0.0f;
+    FLOAT locv = 0.0f;
+    #pragma omp simd reduction(+:locu,locv)
+    for (int32_t j=first; j<last; ++j) {
+      const FLOAT dx = _x[j] - tx;
+      const FLOAT dy = _y[j] - ty;
+      const FLOAT r2 = dx*dx + dy*dy;
+      const FLOAT f = (r2 < rc2 and r2 > 0.0f) ? _s[j] * short_factor(r2, a, b) / r2 : 0.0f;
+      locu += dy * f;
+      locv -= dx * f;
+    }
+    _u[i] += locu / (2.0f*3.1415926536f);
+    _v[i] += locv / (2.0f*3.1415926536f);
+  });
+}
+
+// -------------------------
+// the long-range part on an m x m grid: strengths spread with cubic B-splines, the stream function
+//   solved in Fourier space with the Gaussian screening and the splines' transform divided out,
+//   and the velocity interpolated back with the same splines
+
+// the cubic B-spline weights of the 4 nodes at and around a point _t nodes past node _i0+1
+static inline void bspline4(const double _t, double _w[4]) {
+  const double t = _t;
+  const double omt = 1.0 - t;
+  _w[0] = omt*omt*omt / 6.0;
+  _w[1] = (3.0*t*t*t - 6.0*t*t + 4.0) / 6.0;
+  _w[2] = (-3.0*t*t*t + 3.0*t*t + 3.0*t + 1.0) / 6.0;
+  _w[3] = t*t*t / 6.0;
+}
+
+// in-place radix-2 complex transform, unnormalized, with exp(_sign*i*k*x)
+static void fft(std::complex<double>* _a, const int32_t _n, const int32_t _sign) {
+  for (int32_t i=1, j=0; i<_n; ++i) {
+    int32_t bit = _n >> 1;
+    for (; j & bit; bit >>= 1) j ^= bit;
+    j ^= bit;
+    if (i < j) std::swap(_a[i], _a[j]);
+  }
+  for (int32_t len=2; len<=_n; len<<=1) {
+    const double ang = _sign * 2.0*M_PI / len;
+    const std::complex<double> wl(std::cos(ang), std::sin(ang));
+    for (int32_t i=0; i<_n; i+=len) {
+      std::complex<double> w(1.0, 0.0);
+      for (int32_t j=0; j<len/2; ++j) {
+        const std::complex<double> p = _a[i+j];
+        const std::complex<double> q = _a[i+j+len/2] * w;
+        _a[i+j] = p + q;
+        _a[i+j+len/2] = p - q;
+        w *= wl;
+      }
+    }
+  }
+}
+
+// rows, then columns
+static void fft2(std::vector<std::complex<double>>& _a, const int32_t _m, const int32_t _sign) {
+  #pragma omp parallel
+  {
+    #pragma omp for
+    for (int32_t r=0; r<_m; ++r) fft(&_a[(size_t)r*_m], _m, _sign);
+    std::vector<std::complex<double>> col(_m);
+    #pragma omp for
+    for (int32_t c=0; c<_m; ++c) {
+      for (int32_t r=0; r<_m; ++r) col[r] = _a[(size_t)r*_m+c];
+      fft(col.data(), _m, _sign);
+      for (int32_t r=0; r<_m; ++r) _a[(size_t)r*_m+c] = col[r];
+    }
+  }
+}
+
+struct EwaldGrid {
+  int32_t m = 0;
+  std::vector<double> green;			// screened, deconvolved Green's function over k^2
+  std::vector<std::complex<double>> q;	// spread strengths, then the velocity as u + i v
+};
+
+static void ewald_grid_init(EwaldGrid& _g, const int32_t _m, const double _sigma) {
+  _g.m = _m;
+  _g.green.assign((size_t)_m*_m, 0.0);
+  _g.q.resize((size_t)_m*_m);
+  const double h = 1.0 / _m;
+  for (int32_t r=0; r<_m; ++r) {
+    const int32_t my = (r < _m/2) ? r : r-_m;
+    for (int32_t c=0; c<_m; ++c) {
+      const int32_t mx = (c < _m/2) ? c : c-_m;
+      if (mx == 0 and my == 0) continue;
+      const double kx = 2.0*M_PI*mx;
+      const double ky = 2.0*M_PI*my;
+      const double k2 = kx*kx + ky*ky;
+      const double sx = (mx == 0) ? 1.0 : std::sin(0.5*kx*h) / (0.5*kx*h);
+      const double sy = (my == 0) ? 1.0 : std::sin(0.5*ky*h) / (0.5*ky*h);
+      const double w = std::pow(sx*sy, 4);
+      _g.green[(size_t)r*_m+c] = std::exp(-0.5*k2*_sigma*_sigma) / (k2 * w*w);
+    }
+  }
+}
+
+// the 4 grid rows or columns (wrapped) a coordinate touches, and their weights
+static inline void grid_stencil(const FLOAT _x, const int32_t _m, int32_t _idx[4], double _w[4]) {
+  const double u = (double)_x * _m;
+  const int32_t base = (int32_t)std::floor(u);
+  bspline4(u - base, _w);
+  for (int32_t k=0; k<4; ++k) _idx[k] = ((base - 1 + k) % _m + _m) % _m;
+}
+
+// particles are in cell order, so each row of cells spreads onto its own band of grid rows; as
+//   long as a cell is taller than a 4-point stencil, rows of cells two apart never touch the same
+//   grid row, so _spread(i) runs on the even ones in parallel, then the odd ones, and a last odd
+//   row (which wraps onto row 0) alone
+template <class F>
+static void colored_rows(const CellList& _cl, F _spread) {
+  const int32_t nc = _cl.nc;
+  for (int32_t color=0; color<3; ++color) {
+    #pragma omp parallel for schedule(dynamic,1)
+    for (int32_t cy=0; cy<nc; ++cy) {
+      const int32_t mine = (nc%2 == 1 and cy == nc-1) ? 2 : cy%2;
+      if (mine != color) continue;
+      for (int32_t i=_cl.start[cy*nc]; i<_cl.start[(cy+1)*nc]; ++i) _spread(i);
+    }
+  }
+}
+
+static void ewald_grid(EwaldGrid& _g, const int32_t _n, const FLOAT* _x, const FLOAT* _y, const FLOAT* _s,
+                       const CellList& _cl, FLOAT* _u, FLOAT* _v) {
+  const int32_t m = _g.m;
+  std::fill(_g.q.begin(), _g.q.end(), std::complex<double>(0.0, 0.0));
+
+  colored_rows(_cl, [&](const int32_t i) {
+    int32_t ix[4], iy[4];
+    double wx[4], wy[4];
+    grid_stencil(_x[i], m, ix, wx);
+    grid_stencil(_y[i], m, iy, wy);
+    for (int32_t b=0; b<4; ++b) {
+      for (int32_t a=0; a<4; ++a) {
+        _g.q[(size_t)iy[b]*m + ix[a]] += _s[i] * wx[a] * wy[b];
+      }
+    }
+  });
+
+  // u = d psi/dy and v = -d psi/dx, both real, so one inverse transform gives u + i v
+  fft2(_g.q, m, -1);
+  #pragma omp parallel for
+  for (int32_t r=0; r<m; ++r) {
+    const int32_t my = (r < m/2) ? r : r-m;
+    for (int32_t c=0; c<m; ++c) {
+      const int32_t mx = (c < m/2) ? c : c-m;
+      // the Nyquist modes have no derivative
+      const double kx = (2*mx == -m) ? 0.0 : 2.0*M_PI*mx;
+      const double ky = (2*my == -m) ? 0.0 : 2.0*M_PI*my;
+      const std::complex<double> psi = _g.q[(size_t)r*m+c] * _g.green[(size_t)r*m+c];
+      const std::complex<double> uh = std::complex<double>(0.0, ky) * psi;
+      const std::complex<double> vh = std::complex<double>(0.0, -kx) * psi;
+      _g.q[(size_t)r*m+c] = uh + std::complex<double>(0.0, 1.0) * vh;
+    }
+  }
+  fft2(_g.q, m, 1);
+
+  #pragma omp parallel for
+  for (int32_t i=0; i<_n; ++i) {
+    int32_t ix[4], iy[4];
+    double wx[4], wy[4];
+    grid_stencil(_x[i], m, ix, wx);
+    grid_stencil(_y[i], m, iy, wy);
+    double su = 0.0, sv = 0.0;
+    for (int32_t b=0; b<4; ++b) {
+      for (int32_t a=0; a<4; ++a) {
+        const std::complex<double> val = _g.q[(size_t)iy[b]*m + ix[a]];
+        su += val.real() * wx[a] * wy[b];
+        sv += val.imag() * wx[a] * wy[b];
+      }
+    }
+    _u[i] += su;
+    _v[i] += sv;
+  }
+}
+
+// -------------------------
+// viscous diffusion by particle strength exchange: every particle stands for the same area A of
+//   the box, and trades circulation with its neighbors at a rate set by a Gaussian of width eps,
+//   scaled so that the exchange approximates the Laplacian of the vorticity:
+//     dG_i/dt = nu A/eps^2 sum_j (G_j - G_i) (4/pi eps^2) exp(-r^2/eps^2)
+//   each pair's trade is equal and opposite, so the total circulation stays as it was
+
+static void pse_diffuse(const int32_t _n, const FLOAT* _x, const FLOAT* _y, const FLOAT* _s,
+                        const CellList& _cl, const FLOAT _eps, const FLOAT _rc, const FLOAT _nu,
+                        const double _area, FLOAT* _ds) {
+  const FLOAT a = 1.0 / (_eps*_eps);
+  const FLOAT rc2 = _rc*_rc;
+  const FLOAT scale = _nu * _area * 4.0 / (3.1415926536 * _eps*_eps*_eps*_eps);
+  std::fill(_ds, _ds+_n, 0.0f);
+
+  cell_sweep(_cl, [&](const int32_t i, const int32_t first, const int32_t last, const FLOAT shx, const FLOAT shy) {
+    const FLOAT tx = _x[i] - shx;
+    const FLOAT ty = _y[i] - shy;
+    const FLOAT si = _s[i];
+    FLOAT locs = 0.0f;
+    #pragma omp simd reduction(+:locs)
+    for (int32_t j=first; j<last; ++j) {
+      const FLOAT dx = _x[j] - tx;
+      const FLOAT dy = _y[j] - ty;
+      const FLOAT r2 = dx*dx + dy*dy;
+      locs += (r2 < rc2) ? (_s[j] - si) * std::exp(-r2*a) : 0.0f;
+    }
+    _ds[i] += scale * locs;
+  });
+}
+
+// -------------------------
+// remeshing onto an L x L lattice with the M4' kernel, which keeps the total circulation and its
+//   first and second moments; nodes weaker than a fraction of the strongest are dropped, and the
+//   rest become the new particles in lattice order, which is also close to cell order
+
+// the M4' weights of the 4 nodes at and around a point _t nodes past node _i0+1
+static inline void m4prime(const double _t, double _w[4]) {
+  const double d0 = 1.0 + _t;
+  const double d1 = _t;
+  const double d2 = 1.0 - _t;
+  const double d3 = 2.0 - _t;
+  _w[0] = 0.5*(2.0-d0)*(2.0-d0)*(1.0-d0);
+  _w[1] = 1.0 - 2.5*d1*d1 + 1.5*d1*d1*d1;
+  _w[2] = 1.0 - 2.5*d2*d2 + 1.5*d2*d2*d2;
+  _w[3] = 0.5*(2.0-d3)*(2.0-d3)*(1.0-d3);
+}
+
+static inline void lattice_stencil(const FLOAT _x, const int32_t _l, int32_t _idx[4], double _w[4]) {
+  const double u = (double)_x * _l;
+  const int32_t base = (int32_t)std::floor(u);
+  m4prime(u - base, _w);
+  for (int32_t k=0; k<4; ++k) _idx[k] = ((base - 1 + k) % _l + _l) % _l;
+}
+
+// returns the new particle count, and the circulation of the dropped nodes
+static int32_t remesh(const int32_t _n, std::vector<FLOAT>& _x, std::vector<FLOAT>& _y, std::vector<FLOAT>& _s,
+                      const int32_t _l, const double _drop, CellList& _cl, std::vector<double>& _node,
+                      std::vector<int32_t>& _rowcount, double& _dropped) {
+
+  // the cell order alone is enough to scatter in colors, so the arrays are not reordered
+  cell_sort(_n, _x.data(), _y.data(), _l/REMESH_CELL, _cl);
+  _node.assign((size_t)_l*_l, 0.0);
+  colored_rows(_cl, [&](const int32_t k) {
+    const int32_t i = _cl.order[k];
+    int32_t ix[4], iy[4];
+    double wx[4], wy[4];
+    lattice_stencil(_x[i], _l, ix, wx);
+    lattice_stencil(_y[i], _l, iy, wy);
+    for (int32_t b=0; b<4; ++b) {
+      for (int32_t a=0; a<4; ++a) {
+        _node[(size_t)iy[b]*_l + ix[a]] += _s[i] * wx[a] * wy[b];
+      }
+    }
+  });
+
+  double smax = 0.0;
+  #pragma omp parallel for reduction(max:smax)
+  for (size_t k=0; k<_node.size(); ++k) smax = std::max(smax, std::abs(_node[k]));
+  const double thresh = _drop * smax;
+
+  // count the kept nodes of each lattice row, then write each row's particles at its offset
+  _rowcount.assign(_l+1, 0);
+  double dropped = 0.0;
+  #pragma omp parallel for reduction(+:dropped)
+  for (int32_t r=0; r<_l; ++r) {
+    for (int32_t c=0; c<_l; ++c) {
+      const double g = _node[(size_t)r*_l+c];
+      if (std::abs(g) > thresh) _rowcount[r+1]++;
+      else dropped += g;
+    }
+  }
+  for (int32_t r=0; r<_l; ++r) _rowcount[r+1] += _rowcount[r];
+  const int32_t n = _rowcount[_l];
+  _x.resize(n);
+  _y.resize(n);
+  _s.resize(n);
+  const double h = 1.0 / _l;
+  #pragma omp parallel for
+  for (int32_t r=0; r<_l; ++r) {
+    int32_t k = _rowcount[r];
+    for (int32_t c=0; c<_l; ++c) {
+      const double g = _node[(size_t)r*_l+c];
+      if (std::abs(g) <= thresh) continue;
+      _x[k] = c*h;
+      _y[k] = r*h;
+      _s[k] = g;
+      k++;
+    }
+  }
+  _dropped = dropped;
+  return n;
+}
+
+// -------------------------
+// the same Gaussian-core velocities by brute force over (2K+1)^2 copies of the box, in double
+
+static void image_sum(const int32_t _n, const FLOAT* _x, const FLOAT* _y, const FLOAT* _s,
+                      const double _delta, const int32_t _k, std::vector<double>& _u, std::vector<double>& _v) {
+  const double b = 0.5 / (_delta*_delta);
+  #pragma omp parallel for schedule(guided)
+  for (int32_t i=0; i<_n; ++i) {
+    double su = 0.0, sv = 0.0;
+    for (int32_t py=-_k; py<=_k; ++py) {
+      for (int32_t px=-_k; px<=_k; ++px) {
+        for (int32_t j=0; j<_n; ++j) {
+          const double dx = (double)_x[j] + px - _x[i];
+          const double dy = (double)_y[j] + py - _y[i];
+          const double r2 = dx*dx + dy*dy;
+          if (r2 == 0.0) continue;
+          const double f = _s[j] * -std::expm1(-b*r2) / r2;
+          su += dy * f;
+          sv -= dx * f;
+        }
+      }
+    }
+    _u[i] = su / (2.0*M_PI);
+    _v[i] = sv / (2.0*M_PI);
+  }
+}
+
+// -------------------------
+// main program
+
+static void usage() {
+  fprintf(stderr, "Usage: nvPeriodic.bin [-n=<num parts>] [-s=<num steps>] [-t=<time step>] [-g=<grid size>] [-v=<viscosity>] [-k=<steps>] [-r=<fraction>] [-c]\n");
+  fprintf(stderr, "  -g  FFT grid points per side, a power of two (default from n)\n");
+  fprintf(stderr, "  -v  diffuse by particle strength exchange (default 0, inviscid)\n");
+  fprintf(stderr, "  -k  remesh onto a lattice every this many steps (default 0, never)\n");
+  fprintf(stderr, "  -r  drop remeshed nodes weaker than this fraction of the strongest (default 1e-4)\n");
+  fprintf(stderr, "  -c  check the first velocities against a brute-force sum over periodic images (slow, for small n)\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+
+  int32_t npart = 10000;
+  int32_t nsteps = 10;
+  double dt = 0.001;
+  int32_t m = 0;
+  double nu = 0.0;
+  int32_t every = 0;
+  double drop = 1.e-4;
+  bool check = false;
+
+  for (int i=1; i<argc; i++) {
+    if (strncmp(argv[i], "-n=", 3) == 0) {
+      int32_t num = atoi(argv[i]+3);
+      if (num < 2) usage();
+      npart = num;
+    } else if (strncmp(argv[i], "-s=", 3) == 0) {
+      int32_t num = atoi(argv[i]+3);
+      if (num < 0) usage();
+      nsteps = num;
+    } else if (strncmp(argv[i], "-t=", 3) == 0) {
+      double num = atof(argv[i]+3);
+      if (num <= 0.0) usage();
+      dt = num;
+    } else if (strncmp(argv[i], "-g=", 3) == 0) {
+      int32_t num = atoi(argv[i]+3);
+      if (num < MIN_GRID or (num & (num-1)) != 0) usage();
+      m = num;
+    } else if (strncmp(argv[i], "-v=", 3) == 0) {
+      double num = atof(argv[i]+3);
+      if (num < 0.0) usage();
+      nu = num;
+    } else if (strncmp(argv[i], "-k=", 3) == 0) {
+      int32_t num = atoi(argv[i]+3);
+      if (num < 0) usage();
+      every = num;
+    } else if (strncmp(argv[i], "-r=", 3) == 0) {
+      double num = atof(argv[i]+3);
+      if (num < 0.0 or num >= 1.0) usage();
+      drop = num;
+    } else if (strncmp(argv[i], "-c", 2) == 0) {
+      check = true;
+    } else {
+      usage();
+    }
+  }
+
+  // random particles with zero total circulation, as a periodic box needs
+  std::vector<FLOAT> x(npart), y(npart), s(npart), u(npart), v(npart), tmp;
+  const FLOAT strmag = 1.0 / std::sqrt(npart);
+  const double delta = (2./3.) / std::sqrt(npart);
+  std::mt19937 rng(1234);
+  std::uniform_real_distribution<FLOAT> xrand(0.0,1.0);
+  for (int32_t i=0; i<npart; ++i) x[i] = xrand(rng);
+  for (int32_t i=0; i<npart; ++i) y[i] = xrand(rng);
+  double mean = 0.0;
+  for (int32_t i=0; i<npart; ++i) {
+    s[i] = strmag * (2.0*xrand(rng)-1.0);
+    mean += s[i];
+  }
+  for (int32_t i=0; i<npart; ++i) s[i] -= mean/npart;
+
+  // the grid has about two points per particle, and the long-range width follows from it unless
+  //   the cores are wider; cells are at least the cutoff wide, and a finer grid narrows the cutoff
+  //   when there are too few particles for three cells a side
+  if (m == 0) {
+    m = MIN_GRID;
+    while ((double)m*m < 2.0*npart) m *= 2;
+    while (EWALD_SH/m > delta and (int32_t)(1.0/(EWALD_RC*EWALD_SH/m)) < 3) m *= 2;
+  }
+  const double sigma = std::max(EWALD_SH/m, delta);
+  const double rc = EWALD_RC*sigma;
+  const int32_t nc = (int32_t)(1.0/rc);
+  if (nc < 3) {
+    fprintf(stderr, "Cutoff %g is too large for a periodic unit box, use a finer grid or more particles\n", rc);
+    exit(EXIT_FAILURE);
+  }
+
+  printf( "performing 2D vortex Ewald summation on %d points in a periodic box on %d threads\n", npart, omp_get_max_threads());
+  printf( "  core radius ( %g ), grid ( %d x %d ), long-range width ( %g ), cutoff ( %g ), cells ( %d x %d )\n",
+          delta, m, m, sigma, rc, nc, nc);
+
+  // diffusion sorts into its own, smaller cells
+  const double eps = PSE_EPS / std::sqrt(npart);
+  const double prc = PSE_RC*eps;
+  const int32_t npc = (int32_t)(1.0/prc);
+  if (nu > 0.0) {
+    if (npc < 3) {
+      fprintf(stderr, "Diffusion cutoff %g is too large for a periodic unit box, use more particles\n", prc);
+      exit(EXIT_FAILURE);
+    }
+    // the fastest exchange mode decays at about 8 nu/eps^2, which an euler step must not overshoot
+    printf( "  viscosity ( %g ), exchange width ( %g ), cutoff ( %g ), cells ( %d x %d ), diffusion number ( %g )\n",
+            nu, eps, prc, npc, npc, nu*dt/(eps*eps));
+    if (nu*dt/(eps*eps) > 0.25) fprintf(stderr, "Warning: the time step is too large for stable diffusion\n");
+  }
+
+  // the lattice has one node per initial particle (or a few more), so remeshing never adds any
+  const int32_t lside = (int32_t)std::ceil(std::sqrt((double)npart) - 1.e-9);
+  if (every > 0) {
+    if (lside/REMESH_CELL < 3) {
+      fprintf(stderr, "Too few particles to remesh\n");
+      exit(EXIT_FAILURE);
+    }
+    printf( "  remesh every ( %d ) steps onto a ( %d x %d ) lattice, dropping nodes under ( %g ) of the strongest\n",
+            every, lside, lside, drop);
+  }
+
+  CellList cl, pcl, rcl;
+  std::vector<FLOAT> ds(npart);
+  EwaldGrid grid;
+  ewald_grid_init(grid, m, sigma);
+
+  // the velocities, with the time taken by each part
+  double tsort = 0.0, treal = 0.0, tgrid = 0.0;
+  auto velocities = [&]() {
+    auto start = std::chrono::system_clock::now();
+    cell_sort(npart, x.data(), y.data(), nc, cl);
+    for (std::vector<FLOAT>* a : {&x, &y, &s}) reorder(cl.order, *a, tmp);
+    auto end = std::chrono::system_clock::now();
+    std::chrono::duration<double> elapsed_seconds = end-start;
+    tsort += elapsed_seconds.count();
+
+    start = end;
+    ewald_real(npart, x.data(), y.data(), s.data(), cl, delta, sigma, rc, u.data(), v.data());
+    end = std::chrono::system_clock::now();
+    elapsed_seconds = end-start;
+    treal += elapsed_seconds.count();
+
+    start = end;
+    ewald_grid(grid, npart, x.data(), y.data(), s.data(), cl, u.data(), v.data());
+    end = std::chrono::system_clock::now();
+    elapsed_seconds = end-start;
+    tgrid += elapsed_seconds.count();
+  };
+
+  // -------------------------
+  // compare one evaluation with the image sum; both are only defined up to a uniform velocity,
+  //   which depends on the order the conditionally convergent image sum is taken in
+
+  if (check) {
+    velocities();
+    printf( "  ewald: sort( %g s ) real space( %g s ) grid( %g s )\n", tsort, treal, tgrid);
+
+    // a box's images beyond K away change the velocities (up to a uniform one) by about 1/K, so
+    //   sums to K and 2K extrapolate to the infinite lattice
+    const int32_t kimg = 32;
+    std::vector<double> bu(npart), bv(npart), cu(npart), cv(npart);
+    auto start = std::chrono::system_clock::now();
+    image_sum(npart, x.data(), y.data(), s.data(), delta, kimg, cu, cv);
+    image_sum(npart, x.data(), y.data(), s.data(), delta, 2*kimg, bu, bv);
+    auto end = std::chrono::system_clock::now();
+    std::chrono::duration<double> elapsed_seconds = end-start;
+
+    double mu = 0.0, mv = 0.0, bmu = 0.0, bmv = 0.0, cmu = 0.0, cmv = 0.0;
+    for (int32_t i=0; i<npart; ++i) {
+      mu += u[i];  mv += v[i];  bmu += bu[i];  bmv += bv[i];  cmu += cu[i];  cmv += cv[i];
+    }
+    mu /= npart;  mv /= npart;  bmu /= npart;  bmv /= npart;  cmu /= npart;  cmv /= npart;
+    double esum = 0.0, csum = 0.0, vsum = 0.0, emax = 0.0;
+    for (int32_t i=0; i<npart; ++i) {
+      const double ru = 2.0*(bu[i]-bmu) - (cu[i]-cmu);
+      const double rv = 2.0*(bv[i]-bmv) - (cv[i]-cmv);
+      const double du = (u[i]-mu) - ru;
+      const double dv = (v[i]-mv) - rv;
+      esum += du*du + dv*dv;
+      csum += std::pow(bu[i]-bmu-ru,2) + std::pow(bv[i]-bmv-rv,2);
+      vsum += ru*ru + rv*rv;
+      emax = std::max(emax, std::sqrt(du*du + dv*dv));
+    }
+    printf( "  image sums over %d and %d boxes a side took %g s, and the largest alone differs by rms( %g )\n",
+            2*kimg+1, 4*kimg+1, elapsed_seconds.count(), std::sqrt(csum/vsum));
+    printf( "  ewald difference from their extrapolation rms( %g ) max( %g ), relative to rms velocity( %g )\n",
+            std::sqrt(esum/vsum), emax/std::sqrt(vsum/npart), std::sqrt(vsum/npart));
+    tsort = treal = tgrid = 0.0;
+  }
+
+  // the strength changes from diffusion, on the arrays sorted into the diffusion cells; particles
+  //   share the box evenly at first, and after a remesh each holds one lattice cell (dropped
+  //   nodes leave gaps rather than growing the others)
+  double tpse = 0.0;
+  double area = 1.0 / npart;
+  auto diffusion = [&]() {
+    const auto start = std::chrono::system_clock::now();
+    cell_sort(npart, x.data(), y.data(), npc, pcl);
+    for (std::vector<FLOAT>* a : {&x, &y, &s, &u, &v}) reorder(pcl.order, *a, tmp);
+    pse_diffuse(npart, x.data(), y.data(), s.data(), pcl, eps, prc, nu, area, ds.data());
+    const std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - start;
+    tpse += elapsed_seconds.count();
+  };
+
+  // -------------------------
+  // time stepping (simple euler step), wrapping positions back into the box
+
+  double circ0 = 0.0, sumsq0 = 0.0;
+  for (int32_t i=0; i<npart; ++i) {
+    circ0 += s[i];
+    sumsq0 += (double)s[i]*s[i];
+  }
+
+  // remeshing changes the particle count, so the rest of the arrays follow it
+  double tremesh = 0.0, dropsum = 0.0, partsteps = 0.0;
+  int32_t nremesh = 0, nmax = npart;
+  std::vector<double> node;
+  std::vector<int32_t> rowcount;
+
+  auto start = std::chrono::system_clock::now();
+  for (int32_t istep=0; istep<nsteps; ++istep) {
+    partsteps += npart;
+    velocities();
+    if (nu > 0.0) diffusion();
+    #pragma omp parallel for
+    for (int32_t i=0; i<npart; ++i) {
+      x[i] += dt * u[i];
+      y[i] += dt * v[i];
+      if (nu > 0.0) s[i] += dt * ds[i];
+      x[i] -= std::floor(x[i]);
+      y[i] -= std::floor(y[i]);
+      // a value just below 1 can round up to it
+      if (x[i] >= 1.0f) x[i] = 0.0f;
+      if (y[i] >= 1.0f) y[i] = 0.0f;
+    }
+
+    if (every > 0 and (istep+1) % every == 0) {
+      const auto rstart = std::chrono::system_clock::now();
+      double dropped = 0.0;
+      npart = remesh(npart, x, y, s, lside, drop, rcl, node, rowcount, dropped);
+      area = 1.0 / ((double)lside*lside);
+      u.resize(npart);
+      v.resize(npart);
+      ds.resize(npart);
+      const std::chrono::duration<double> relapsed = std::chrono::system_clock::now() - rstart;
+      tremesh += relapsed.count();
+      dropsum += dropped;
+      nmax = std::max(nmax, npart);
+      nremesh++;
+    }
+  }
+  auto end = std::chrono::system_clock::now();
+  std::chrono::duration<double> elapsed_seconds = end-start;
+  if (nsteps > 0) {
+    printf( "  %d steps in %g s, per step: sort( %g s ) real space( %g s ) grid( %g s )\n",
+            nsteps, elapsed_seconds.count(), tsort/nsteps, treal/nsteps, tgrid/nsteps);
+    double circ = 0.0, sumsq = 0.0;
+    for (int32_t i=0; i<npart; ++i) {
+      circ += s[i];
+      sumsq += (double)s[i]*s[i];
+    }
+    if (nu > 0.0) {
+      printf( "  diffusion( %g s ) per step, total circulation ( %g ) to ( %g ), sum of squared strengths ( %g ) to ( %g )\n",
+              tpse/nsteps, circ0, circ, sumsq0, sumsq);
+    }
+    if (nremesh > 0) {
+      printf( "  %d remeshes ( %g s each ), particles at most ( %d ) and now ( %d ), circulation dropped ( %g )\n",
+              nremesh, tremesh/nremesh, nmax, npart, dropsum);
+    }
+    printf( "  %g ns per particle per step\n", 1.e+9*elapsed_seconds.count()/partsteps);
+  }
+
+  return 0;
+}
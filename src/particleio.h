@@ -0,0 +1,297 @@
+/*
+ * particleio.h
+ *
+ * (c)2022 Mark J. Stock <markjstock@gmail.com>
+ *
+ * Memory-mapped reading and writing of 2D C-ordered .npy arrays
+ *
+ * A particle state is a single float32 (or float64) array of shape (nfields, n), so that each
+ *   row is one contiguous field (x, y, z, strength, radius) - exactly the SoA layout of the kernels.
+ *   In numpy, that is  np.save('state.npy', np.vstack([x,y,z,s,r]).astype(np.float32))
+ *   Results are written the same way, as an array of shape (3, n) holding u, v, w.
+ *   Nothing is parsed or copied: the rows are pointers into the mapped file.
+ *
+ * Also a double-buffered writer that saves snapshots from a background thread
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+// one mapped array
+struct NpyMap {
+  void* base = nullptr;		// start of the mapping (the magic string)
+  size_t len = 0;			// length of the mapping in bytes
+  char* data = nullptr;		// first array element
+  int64_t rows = 0;			// shape is (rows, cols) in C order
+  int64_t cols = 0;
+};
+
+// the numpy type string for each supported element type
+template <class T> inline const char* npy_descr();
+template <> inline const char* npy_descr<float>() { return "<f4"; }
+template <> inline const char* npy_descr<double>() { return "<f8"; }
+
+// pointer to the start of one row (field)
+template <class T>
+inline T* npy_row(const NpyMap& _m, const int64_t _r) {
+  return reinterpret_cast<T*>(_m.data) + _r*_m.cols;
+}
+
+// parse the header at the start of a .npy file, set the data offset and shape; exits on any problem
+template <class T>
+inline void npy_parse_header(const char* _fname, const unsigned char* _hdr, const size_t _len,
+                             size_t& _offset, int64_t& _rows, int64_t& _cols) {
+
+  // magic string, version, header length
+  if (_len < 16 or memcmp(_hdr, "\x93NUMPY", 6) != 0) {
+    fprintf(stderr, "File %s is not a .npy file!\n", _fname);
+    exit(EXIT_FAILURE);
+  }
+  size_t hlen, hstart;
+  if (_hdr[6] == 1) {
+    hlen = _hdr[8] | (_hdr[9] << 8);
+    hstart = 10;
+  } else {
+    hlen = _hdr[8] | (_hdr[9] << 8) | (_hdr[10] << 16) | ((size_t)_hdr[11] << 24);
+    hstart = 12;
+  }
+  if (hstart + hlen > _len) {
+    fprintf(stderr, "File %s has an oversized header!\n", _fname);
+    exit(EXIT_FAILURE);
+  }
+  const std::string dict(reinterpret_cast<const char*>(_hdr) + hstart, hlen);
+
+  // the header is a python dict literal; we only accept what we wrote ourselves
+  if (dict.find(npy_descr<T>()) == std::string::npos) {
+    fprintf(stderr, "File %s must have dtype %s!\n", _fname, npy_descr<T>());
+    exit(EXIT_FAILURE);
+  }
+  if (dict.find("'fortran_order': False") == std::string::npos) {
+    fprintf(stderr, "File %s must be in C order!\n", _fname);
+    exit(EXIT_FAILURE);
+  }
+  const size_t spos = dict.find("'shape': (");
+  long long r = 0, c = 0;
+  if (spos == std::string::npos or sscanf(dict.c_str()+spos, "'shape': (%lld, %lld)", &r, &c) != 2) {
+    fprintf(stderr, "File %s must hold a 2D array!\n", _fname);
+    exit(EXIT_FAILURE);
+  }
+  _rows = r;
+  _cols = c;
+  _offset = hstart + hlen;
+}
+
+// map an existing .npy file read-only; exits on any problem
+template <class T>
+inline void npy_map_read(const char* _fname, NpyMap& _m) {
+
+  const int fd = open(_fname, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open %s for reading!\n", _fname);
+    exit(EXIT_FAILURE);
+  }
+  struct stat sb;
+  fstat(fd, &sb);
+  _m.len = sb.st_size;
+  _m.base = mmap(nullptr, _m.len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (_m.base == MAP_FAILED) {
+    fprintf(stderr, "Could not map %s!\n", _fname);
+    exit(EXIT_FAILURE);
+  }
+
+  size_t offset;
+  npy_parse_header<T>(_fname, static_cast<const unsigned char*>(_m.base), _m.len, offset, _m.rows, _m.cols);
+  _m.data = static_cast<char*>(_m.base) + offset;
+
+  if (offset + _m.rows*_m.cols*sizeof(T) > _m.len) {
+    fprintf(stderr, "File %s is truncated!\n", _fname);
+    exit(EXIT_FAILURE);
+  }
+
+  // we will read it front to back, one row at a time
+  madvise(_m.base, _m.len, MADV_SEQUENTIAL);
+}
+
+// the full .npy header for a 2D C-ordered array, padded so that the data is 64-byte aligned
+template <class T>
+inline std::string npy_header(const int64_t _rows, const int64_t _cols) {
+  char dict[128];
+  snprintf(dict, sizeof(dict), "{'descr': '%s', 'fortran_order': False, 'shape': (%lld, %lld), }",
+           npy_descr<T>(), (long long)_rows, (long long)_cols);
+  std::string hdr("\x93NUMPY\x01\x00", 8);
+  std::string body(dict);
+  const size_t total = 64*((10 + body.size() + 1 + 63)/64);
+  body.resize(total - 10 - 1, ' ');
+  body += '\n';
+  hdr += (char)(body.size() & 0xff);
+  hdr += (char)(body.size() >> 8);
+  hdr += body;
+  return hdr;
+}
+
+// create a .npy file of the given shape and map it read-write; exits on any problem
+template <class T>
+inline void npy_map_create(const char* _fname, const int64_t _rows, const int64_t _cols, NpyMap& _m) {
+
+  const std::string hdr = npy_header<T>(_rows, _cols);
+  _m.rows = _rows;
+  _m.cols = _cols;
+  _m.len = hdr.size() + _rows*_cols*sizeof(T);
+
+  const int fd = open(_fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 or ftruncate(fd, _m.len) != 0) {
+    fprintf(stderr, "Could not create %s!\n", _fname);
+    exit(EXIT_FAILURE);
+  }
+  _m.base = mmap(nullptr, _m.len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (_m.base == MAP_FAILED) {
+    fprintf(stderr, "Could not map %s!\n", _fname);
+    exit(EXIT_FAILURE);
+  }
+
+  memcpy(_m.base, hdr.data(), hdr.size());
+  _m.data = static_cast<char*>(_m.base) + hdr.size();
+}
+
+// write a whole (rows, cols) array from memory with plain writes; returns false on failure
+template <class T>
+inline bool npy_write(const char* _fname, const int64_t _rows, const int64_t _cols, const T* const _data) {
+
+  FILE* fp = fopen(_fname, "wb");
+  if (not fp) return false;
+  const std::string hdr = npy_header<T>(_rows, _cols);
+  bool ok = (fwrite(hdr.data(), 1, hdr.size(), fp) == hdr.size());
+  ok = ok and (fwrite(_data, sizeof(T), _rows*_cols, fp) == (size_t)(_rows*_cols));
+  ok = (fclose(fp) == 0) and ok;
+  return ok;
+}
+
+// unmap, dirty pages of a writable map are flushed by the kernel
+inline void npy_unmap(NpyMap& _m) {
+  if (_m.base) munmap(_m.base, _m.len);
+  _m = NpyMap();
+}
+
+
+// -------------------------
+// asynchronous, double-buffered snapshot writer
+// the caller copies its state into a staging buffer and goes back to work, while a
+//   background thread writes that buffer as a (nfields, n) .npy file; the caller only
+//   waits when both buffers are still queued or being written
+//   the file format can be swapped by passing a different write function; a writer for n=0
+//   particles is idle and starts no thread
+template <class T>
+class SnapshotWriter {
+public:
+  typedef std::function<bool(const char*, const int64_t, const int64_t, const T*)> WriteFn;
+
+  SnapshotWriter(const int64_t _nfields, const int64_t _n, WriteFn _write = npy_write<T>)
+    : m_nfields(_nfields), m_n(_n), m_writefn(_write) {
+    for (int b=0; b<2; ++b) {
+      m_buf[b].resize(_nfields*_n);
+      m_busy[b] = false;
+    }
+    if (_n > 0) m_thread = std::thread(&SnapshotWriter::run, this);
+  }
+
+  ~SnapshotWriter() {
+    if (not m_thread.joinable()) return;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+  }
+
+  // wait for a free staging buffer and return its first element; field f starts at f*n
+  T* acquire() {
+    const auto start = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [this]{ return not m_busy[m_next]; });
+    m_stall += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return m_buf[m_next].data();
+  }
+
+  // queue the buffer from the last acquire() to be written to _fname
+  void submit(const std::string& _fname) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_busy[m_next] = true;
+      m_name[m_next] = _fname;
+      m_queue.push_back(m_next);
+      m_next = 1 - m_next;
+    }
+    m_cv.notify_all();
+  }
+
+  // block until everything submitted so far has been written
+  void flush() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [this]{ return not m_busy[0] and not m_busy[1]; });
+  }
+
+  // seconds the caller has spent waiting in acquire()
+  double stall_time() const { return m_stall; }
+  // seconds the background thread has spent writing
+  double write_time() const { return m_write; }
+
+private:
+  void run() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+      m_cv.wait(lock, [this]{ return m_stop or not m_queue.empty(); });
+      if (m_queue.empty()) break;
+      const int b = m_queue.front();
+      m_queue.pop_front();
+      const std::string fname = m_name[b];
+
+      // write without holding the lock
+      lock.unlock();
+      const auto start = std::chrono::steady_clock::now();
+      if (not m_writefn(fname.c_str(), m_nfields, m_n, m_buf[b].data())) {
+        fprintf(stderr, "Could not write snapshot %s!\n", fname.c_str());
+      }
+      const double wtime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      lock.lock();
+
+      m_write += wtime;
+      m_busy[b] = false;
+      m_cv.notify_all();
+    }
+  }
+
+  const int64_t m_nfields, m_n;
+  const WriteFn m_writefn;
+  std::vector<T> m_buf[2];
+  bool m_busy[2];
+  std::string m_name[2];
+  int m_next = 0;
+  std::deque<int> m_queue;
+  bool m_stop = false;
+  double m_stall = 0.0;
+  double m_write = 0.0;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::thread m_thread;
+};
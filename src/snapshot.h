@@ -0,0 +1,485 @@
+/*
+ * snapshot.h
+ *
+ * (c)2022 Mark J. Stock <markjstock@gmail.com>
+ *
+ * Compressed particle snapshots (.nvz) with a bounded position error
+ *
+ * Particles are sorted along a Morton curve and cut into chunks of SNAP_CHUNK particles, which
+ *   are then spatially compact. Positions are quantized on a grid of spacing just under 2*errbound
+ *   anchored at each chunk's lower bounds, so every coordinate comes back within errbound. Those
+ *   integers are delta-coded along the curve, and then all five fields are byte-shuffled and
+ *   the compressible byte planes deflated, one chunk per thread. A chunk too wide for 32-bit
+ *   grid indices at that spacing keeps its positions at full width instead. Strengths and radii
+ *   are lossless, at the width of the writer's values. Particles come back in Morton order, not
+ *   in their original order.
+ *
+ * File layout, all little-endian:
+ *   "NVZ2", uint32 nchunks, uint64 n, double errbound, uint32 vbytes (4 or 8), uint32 pad
+ *   nchunks x { uint64 offset, uint64 csize, uint32 count, uint32 flags, double lo[3], double q }
+ *   nchunks x { uint32 psize[nplanes], then the byte planes of x, y, z, s, r, each deflated
+ *               unless psize equals count, in which case that plane is stored raw }
+ *   positions are 4-byte delta codes, or vbytes-wide values if flags has SNAP_FULL; s and r
+ *   are vbytes wide; "NVZ1" files are the same with vbytes 4, no vbytes field, and no flags
+ *
+ * Without zlib (HAVE_ZLIB undefined) only the Morton ordering is available, and reading or
+ *   writing a snapshot fails.
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include <omp.h>
+
+
+// particles per compressed chunk
+#define SNAP_CHUNK 65536
+// most byte planes per chunk: 5 fields of 8 bytes
+#define SNAP_MAX_PLANES 40
+// planes with more bits of entropy per byte than this are not worth deflating
+#define SNAP_RAW_BITS 7.5
+#ifndef SNAP_STRATEGY
+#define SNAP_STRATEGY Z_RLE
+#endif
+// chunk flag: positions are stored at full width, not quantized
+#define SNAP_FULL 1
+
+// per-chunk entry in the file's table
+struct SnapChunk {
+  uint64_t offset;		// start of the deflated data, from the start of the file
+  uint64_t csize;		// deflated length in bytes
+  uint32_t count;		// particles in this chunk
+  uint32_t flags;		// SNAP_FULL or 0
+  double lo[3];			// lower bounds of the chunk's cell
+  double q;				// quantization step
+};
+
+// byte planes in a chunk with values of _vbytes
+inline int32_t snap_planes(const uint32_t _flags, const int32_t _vbytes) {
+  return 3*((_flags & SNAP_FULL) ? _vbytes : 4) + 2*_vbytes;
+}
+
+// spread the low 10 bits of a value out to every third bit
+inline uint32_t snap_spread3(uint32_t _v) {
+  _v &= 0x3ff;
+  _v = (_v | _v << 16) & 0x30000ff;
+  _v = (_v | _v << 8)  & 0x300f00f;
+  _v = (_v | _v << 4)  & 0x30c30c3;
+  _v = (_v | _v << 2)  & 0x9249249;
+  return _v;
+}
+
+// (byte-)shuffle an array of _w-byte words: all first bytes, then all second bytes, ...
+inline void snap_shuffle(const unsigned char* _in, const size_t _n, const int32_t _w, unsigned char* _out) {
+  for (int32_t b=0; b<_w; ++b) {
+    for (size_t i=0; i<_n; ++i) _out[b*_n+i] = _in[_w*i+b];
+  }
+}
+
+inline void snap_unshuffle(const unsigned char* _in, const size_t _n, const int32_t _w, unsigned char* _out) {
+  for (int32_t b=0; b<_w; ++b) {
+    for (size_t i=0; i<_n; ++i) _out[_w*i+b] = _in[b*_n+i];
+  }
+}
+
+// order-0 entropy of a byte stream, in bits per byte
+inline double snap_entropy(const unsigned char* _in, const size_t _n) {
+  // four histograms break the dependency on repeated bytes
+  uint32_t hist[4][256] = {{0}};
+  size_t i = 0;
+  for (; i+4<=_n; i+=4) {
+    hist[0][_in[i]]++;
+    hist[1][_in[i+1]]++;
+    hist[2][_in[i+2]]++;
+    hist[3][_in[i+3]]++;
+  }
+  for (; i<_n; ++i) hist[0][_in[i]]++;
+  double bits = 0.0;
+  for (int32_t b=0; b<256; ++b) {
+    const uint32_t h = hist[0][b] + hist[1][b] + hist[2][b] + hist[3][b];
+    if (h) bits -= h * std::log2((double)h/_n);
+  }
+  return bits / _n;
+}
+
+// return the Morton ordering of n points on a 1024^3 grid; ties keep their input order
+//   the 30-bit keys are radix sorted in three 10-bit passes, each thread counting and
+//   scattering its own contiguous range; _nthreads limits the team, 0 for all
+template <class T>
+inline std::vector<uint32_t> snap_morton_order(const int64_t _n, const T* _x, const T* _y, const T* _z,
+                                               const int32_t _nthreads = 0) {
+  const int32_t nthreads = (_nthreads > 0) ? _nthreads : omp_get_max_threads();
+
+  // bounding box
+  T lo[3] = {_x[0], _y[0], _z[0]};
+  T hi[3] = {_x[0], _y[0], _z[0]};
+  #pragma omp parallel for num_threads(nthreads) reduction(min:lo[:3]) reduction(max:hi[:3])
+  for (int64_t i=0; i<_n; ++i) {
+    lo[0] = std::min(lo[0], _x[i]);  hi[0] = std::max(hi[0], _x[i]);
+    lo[1] = std::min(lo[1], _y[i]);  hi[1] = std::max(hi[1], _y[i]);
+    lo[2] = std::min(lo[2], _z[i]);  hi[2] = std::max(hi[2], _z[i]);
+  }
+  const double scale = 1023.0 / std::max({(double)hi[0]-lo[0], (double)hi[1]-lo[1], (double)hi[2]-lo[2], 1.e-30});
+
+  // key in the upper bits, index in the lower
+  std::vector<uint64_t> keys(_n), tmp(_n);
+  #pragma omp parallel for num_threads(nthreads)
+  for (int64_t i=0; i<_n; ++i) {
+    const uint32_t ix = (uint32_t)((_x[i]-lo[0])*scale);
+    const uint32_t iy = (uint32_t)((_y[i]-lo[1])*scale);
+    const uint32_t iz = (uint32_t)((_z[i]-lo[2])*scale);
+    keys[i] = (uint64_t)(snap_spread3(ix) | snap_spread3(iy) << 1 | snap_spread3(iz) << 2) << 32 | (uint64_t)i;
+  }
+
+  std::vector<int64_t> count(nthreads*1024);
+  for (int32_t shift=32; shift<62; shift+=10) {
+    #pragma omp parallel num_threads(nthreads)
+    {
+      const int32_t t = omp_get_thread_num();
+      const int64_t first = (_n*t)/nthreads;
+      const int64_t last = (_n*(t+1))/nthreads;
+      int64_t* mine = &count[t*1024];
+      std::fill(mine, mine+1024, 0);
+      for (int64_t i=first; i<last; ++i) mine[(keys[i] >> shift) & 0x3ff]++;
+      #pragma omp barrier
+
+      // bucket-major, thread-minor offsets keep the sort stable
+      #pragma omp single
+      {
+        int64_t sum = 0;
+        for (int32_t b=0; b<1024; ++b) {
+          for (int32_t tt=0; tt<nthreads; ++tt) {
+            const int64_t c = count[tt*1024+b];
+            count[tt*1024+b] = sum;
+            sum += c;
+          }
+        }
+      }
+
+      for (int64_t i=first; i<last; ++i) tmp[mine[(keys[i] >> shift) & 0x3ff]++] = keys[i];
+    }
+    keys.swap(tmp);
+  }
+
+  std::vector<uint32_t> order(_n);
+  #pragma omp parallel for num_threads(nthreads)
+  for (int64_t i=0; i<_n; ++i) order[i] = (uint32_t)keys[i];
+  return order;
+}
+
+#ifdef HAVE_ZLIB
+
+// write a compressed snapshot; returns false on failure; _nthreads limits the team, 0 for all
+template <class T>
+inline bool snapshot_write(const char* _fname, const int64_t _n,
+                           const T* _x, const T* _y, const T* _z, const T* _s, const T* _r,
+                           const double _errbound, const int32_t _nthreads = 0) {
+
+  static_assert(sizeof(T) == 4 or sizeof(T) == 8, "snapshots hold 4- or 8-byte values");
+  const int32_t vbytes = sizeof(T);
+  const int32_t nthreads = (_nthreads > 0) ? _nthreads : omp_get_max_threads();
+  const std::vector<uint32_t> order = snap_morton_order<T>(_n, _x, _y, _z, nthreads);
+  const uint32_t nchunks = (_n + SNAP_CHUNK - 1) / SNAP_CHUNK;
+  std::vector<SnapChunk> table(nchunks);
+  std::vector<std::vector<unsigned char>> packed(nchunks);
+
+  #pragma omp parallel num_threads(nthreads)
+  {
+    // per-thread scratch: 5 fields of up to 8 bytes, raw and shuffled, gathered positions, output
+    std::vector<unsigned char> raw(SNAP_MAX_PLANES*SNAP_CHUNK);
+    std::vector<unsigned char> shuf(SNAP_MAX_PLANES*SNAP_CHUNK);
+    std::vector<double> gp(3*SNAP_CHUNK);
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    deflateInit2(&zs, 1, Z_DEFLATED, 15, 8, SNAP_STRATEGY);
+    std::vector<unsigned char> out(SNAP_MAX_PLANES*4 + SNAP_MAX_PLANES*deflateBound(&zs, SNAP_CHUNK));
+
+    #pragma omp for schedule(dynamic,1)
+    for (uint32_t c=0; c<nchunks; ++c) {
+      const int64_t first = (int64_t)c*SNAP_CHUNK;
+      const uint32_t count = std::min((int64_t)SNAP_CHUNK, _n - first);
+      const uint32_t* idx = &order[first];
+      SnapChunk& ch = table[c];
+      ch.count = count;
+      ch.flags = 0;
+
+      // gather the positions once, and find this chunk's cell
+      const T* pos[3] = {_x, _y, _z};
+      double hi[3], mag = 0.0;
+      for (int32_t d=0; d<3; ++d) {
+        double* p = &gp[d*SNAP_CHUNK];
+        for (uint32_t i=0; i<count; ++i) p[i] = pos[d][idx[i]];
+        ch.lo[d] = *std::min_element(p, p+count);
+        hi[d] = *std::max_element(p, p+count);
+        mag = std::max({mag, std::abs(ch.lo[d]), std::abs(hi[d])});
+      }
+
+      // grid spacing, leaving room for the final rounding to T; a cell that would need more
+      //   than 32 bits keeps its positions at full width rather than break the bound
+      const double margin = std::numeric_limits<T>::epsilon() * mag;
+      ch.q = 2.0*std::max(_errbound - margin, 0.5*_errbound);
+      for (int32_t d=0; d<3; ++d) {
+        if ((hi[d]-ch.lo[d]) / ch.q > 4294967295.0) ch.flags = SNAP_FULL;
+      }
+      const double invq = 1.0 / ch.q;
+      const int32_t pbytes = (ch.flags & SNAP_FULL) ? vbytes : 4;
+
+      // quantize and zigzag delta-code the positions along the curve, or copy them
+      for (int32_t d=0; d<3; ++d) {
+        unsigned char* field = &raw[(size_t)d*pbytes*count];
+        if (ch.flags & SNAP_FULL) {
+          for (uint32_t i=0; i<count; ++i) memcpy(field + (size_t)vbytes*i, &pos[d][idx[i]], vbytes);
+          continue;
+        }
+        const double* p = &gp[d*SNAP_CHUNK];
+        uint32_t last = 0;
+        for (uint32_t i=0; i<count; ++i) {
+          const uint32_t k = (uint32_t)((p[i] - ch.lo[d])*invq + 0.5);
+          const int32_t delta = (int32_t)(k - last);
+          const uint32_t zz = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+          memcpy(field + 4*(size_t)i, &zz, 4);
+          last = k;
+        }
+      }
+
+      // strengths and radii are copied bit for bit
+      unsigned char* sfield = &raw[(size_t)3*pbytes*count];
+      unsigned char* rfield = sfield + (size_t)vbytes*count;
+      for (uint32_t i=0; i<count; ++i) {
+        memcpy(sfield + (size_t)vbytes*i, &_s[idx[i]], vbytes);
+        memcpy(rfield + (size_t)vbytes*i, &_r[idx[i]], vbytes);
+      }
+
+      const int32_t fbytes[5] = {pbytes, pbytes, pbytes, vbytes, vbytes};
+      for (int32_t f=0, off=0; f<5; off+=fbytes[f]*count, ++f) {
+        snap_shuffle(&raw[off], count, fbytes[f], &shuf[off]);
+      }
+
+      // deflate each byte plane on its own, but store the noisy ones (low mantissa bytes) as-is
+      // (into reused scratch, so that only the final bytes are allocated per chunk)
+      const int32_t nplanes = snap_planes(ch.flags, vbytes);
+      uint32_t psize[SNAP_MAX_PLANES];
+      size_t at = nplanes*4;
+      for (int32_t p=0; p<nplanes; ++p) {
+        const unsigned char* plane = &shuf[(size_t)p*count];
+        psize[p] = count;
+        if (snap_entropy(plane, count) < SNAP_RAW_BITS) {
+          deflateReset(&zs);
+          zs.next_in = const_cast<unsigned char*>(plane);
+          zs.avail_in = count;
+          zs.next_out = &out[at];
+          zs.avail_out = out.size() - at;
+          deflate(&zs, Z_FINISH);
+          if (zs.total_out < count) psize[p] = zs.total_out;
+        }
+        if (psize[p] == count) memcpy(&out[at], plane, count);
+        at += psize[p];
+      }
+      memcpy(out.data(), psize, nplanes*4);
+      packed[c].assign(out.begin(), out.begin()+at);
+      ch.csize = at;
+    }
+    deflateEnd(&zs);
+  }
+
+  // header, table, then all chunks in order
+  FILE* fp = fopen(_fname, "wb");
+  if (not fp) return false;
+  const double errbound = _errbound;
+  const uint64_t n = _n;
+  const uint32_t vb[2] = {(uint32_t)vbytes, 0};
+  uint64_t offset = 4 + 4 + 8 + 8 + 8 + nchunks*sizeof(SnapChunk);
+  for (uint32_t c=0; c<nchunks; ++c) {
+    table[c].offset = offset;
+    offset += table[c].csize;
+  }
+  bool ok = (fwrite("NVZ2", 1, 4, fp) == 4);
+  ok = ok and (fwrite(&nchunks, 4, 1, fp) == 1);
+  ok = ok and (fwrite(&n, 8, 1, fp) == 1);
+  ok = ok and (fwrite(&errbound, 8, 1, fp) == 1);
+  ok = ok and (fwrite(vb, 4, 2, fp) == 2);
+  ok = ok and (fwrite(table.data(), sizeof(SnapChunk), nchunks, fp) == nchunks);
+  for (uint32_t c=0; c<nchunks and ok; ++c) {
+    ok = (fwrite(packed[c].data(), 1, packed[c].size(), fp) == packed[c].size());
+  }
+  ok = (fclose(fp) == 0) and ok;
+  return ok;
+}
+
+// one value of _vbytes at _p, as a T
+template <class T>
+inline T snap_value(const unsigned char* _p, const int32_t _vbytes) {
+  if (_vbytes == 8) {
+    double v;
+    memcpy(&v, _p, 8);
+    return (T)v;
+  }
+  float v;
+  memcpy(&v, _p, 4);
+  return (T)v;
+}
+
+// read a compressed snapshot into five arrays of n values each; exits on any problem
+template <class T>
+inline void snapshot_read(const char* _fname, std::vector<T>& _x, std::vector<T>& _y, std::vector<T>& _z,
+                          std::vector<T>& _s, std::vector<T>& _r) {
+
+  FILE* fp = fopen(_fname, "rb");
+  char magic[4];
+  uint32_t nchunks = 0;
+  uint64_t n = 0;
+  double errbound = 0.0;
+  uint32_t vb[2] = {4, 0};
+  bool ok = (fp and fread(magic, 1, 4, fp) == 4);
+  const bool v1 = ok and memcmp(magic, "NVZ1", 4) == 0;
+  ok = ok and (v1 or memcmp(magic, "NVZ2", 4) == 0)
+          and fread(&nchunks, 4, 1, fp) == 1 and fread(&n, 8, 1, fp) == 1 and fread(&errbound, 8, 1, fp) == 1;
+  if (ok and not v1) ok = (fread(vb, 4, 2, fp) == 2 and (vb[0] == 4 or vb[0] == 8));
+  if (not ok) {
+    fprintf(stderr, "Could not read snapshot header from %s!\n", _fname);
+    exit(EXIT_FAILURE);
+  }
+  const int32_t vbytes = vb[0];
+  std::vector<SnapChunk> table(nchunks);
+  if (fread(table.data(), sizeof(SnapChunk), nchunks, fp) != nchunks) {
+    fprintf(stderr, "Could not read snapshot table from %s!\n", _fname);
+    exit(EXIT_FAILURE);
+  }
+  // version 1 only ever wrote zero in the flags' place
+  if (v1) for (SnapChunk& ch : table) ch.flags = 0;
+
+  // the table must cover exactly n particles, and every chunk must lie within the data that
+  //   follows it in the file
+  const long here = ftell(fp);
+  fseek(fp, 0, SEEK_END);
+  const long fend = ftell(fp);
+  fseek(fp, here, SEEK_SET);
+  const uint64_t dstart = nchunks ? table[0].offset : here;
+  const uint64_t dend = nchunks ? table[nchunks-1].offset + table[nchunks-1].csize : here;
+  bool fits = (here >= 0 and fend >= here and n <= UINT64_MAX - SNAP_CHUNK
+               and (n + SNAP_CHUNK - 1) / SNAP_CHUNK == nchunks
+               and dstart >= (uint64_t)here and dend >= dstart and dend <= (uint64_t)fend);
+  for (uint32_t c=0; c<nchunks and fits; ++c) {
+    const SnapChunk& ch = table[c];
+    const uint64_t first = (uint64_t)c*SNAP_CHUNK;
+    fits = (ch.offset >= dstart and ch.offset <= dend and ch.csize <= dend - ch.offset
+            and ch.count == std::min((uint64_t)SNAP_CHUNK, n - first));
+  }
+  if (not fits) {
+    fprintf(stderr, "Snapshot %s is truncated or has a bad chunk table!\n", _fname);
+    exit(EXIT_FAILURE);
+  }
+
+  // slurp all of the compressed data
+  const uint64_t dlen = dend - dstart;
+  std::vector<unsigned char> data(dlen);
+  if (fseek(fp, dstart, SEEK_SET) != 0 or fread(data.data(), 1, dlen, fp) != dlen) {
+    fprintf(stderr, "Snapshot %s is truncated!\n", _fname);
+    exit(EXIT_FAILURE);
+  }
+  fclose(fp);
+
+  _x.resize(n);
+  _y.resize(n);
+  _z.resize(n);
+  _s.resize(n);
+  _r.resize(n);
+
+  #pragma omp parallel
+  {
+    std::vector<unsigned char> raw(SNAP_MAX_PLANES*SNAP_CHUNK);
+    std::vector<unsigned char> shuf(SNAP_MAX_PLANES*SNAP_CHUNK);
+
+    #pragma omp for schedule(dynamic,1) reduction(&&:ok)
+    for (uint32_t c=0; c<nchunks; ++c) {
+      const SnapChunk& ch = table[c];
+      const uint32_t count = ch.count;
+      const int64_t first = (int64_t)c*SNAP_CHUNK;
+      const int32_t nplanes = snap_planes(ch.flags, vbytes);
+      const int32_t pbytes = (ch.flags & SNAP_FULL) ? vbytes : 4;
+
+      // planes stored at full size are raw, the rest are deflated
+      const unsigned char* in = &data[ch.offset-dstart];
+      uint32_t psize[SNAP_MAX_PLANES];
+      bool good = (count <= SNAP_CHUNK and ch.csize >= (uint64_t)nplanes*4);
+      if (good) memcpy(psize, in, nplanes*4);
+      size_t at = nplanes*4;
+      for (int32_t p=0; p<nplanes and good; ++p) {
+        if (at + psize[p] > ch.csize) {
+          good = false;
+        } else if (psize[p] == count) {
+          memcpy(&shuf[(size_t)p*count], &in[at], count);
+        } else {
+          uLongf ulen = count;
+          good = (uncompress(&shuf[(size_t)p*count], &ulen, &in[at], psize[p]) == Z_OK and ulen == count);
+        }
+        at += psize[p];
+      }
+      if (not good) {
+        ok = false;
+        continue;
+      }
+      const int32_t fbytes[5] = {pbytes, pbytes, pbytes, vbytes, vbytes};
+      for (int32_t f=0, off=0; f<5; off+=fbytes[f]*count, ++f) {
+        snap_unshuffle(&shuf[off], count, fbytes[f], &raw[off]);
+      }
+
+      // undo the deltas and the quantization, or copy full-width positions
+      T* pos[3] = {_x.data(), _y.data(), _z.data()};
+      for (int32_t d=0; d<3; ++d) {
+        const unsigned char* field = &raw[(size_t)d*pbytes*count];
+        if (ch.flags & SNAP_FULL) {
+          for (uint32_t i=0; i<count; ++i) pos[d][first+i] = snap_value<T>(field + (size_t)vbytes*i, vbytes);
+          continue;
+        }
+        uint32_t k = 0;
+        for (uint32_t i=0; i<count; ++i) {
+          uint32_t zz;
+          memcpy(&zz, field + 4*(size_t)i, 4);
+          k += (zz >> 1) ^ (0u - (zz & 1u));
+          pos[d][first+i] = ch.lo[d] + ch.q*k;
+        }
+      }
+      const unsigned char* sfield = &raw[(size_t)3*pbytes*count];
+      const unsigned char* rfield = sfield + (size_t)vbytes*count;
+      for (uint32_t i=0; i<count; ++i) {
+        _s[first+i] = snap_value<T>(sfield + (size_t)vbytes*i, vbytes);
+        _r[first+i] = snap_value<T>(rfield + (size_t)vbytes*i, vbytes);
+      }
+    }
+  }
+
+  if (not ok) {
+    fprintf(stderr, "Snapshot %s is corrupt!\n", _fname);
+    exit(EXIT_FAILURE);
+  }
+}
+
+#else
+
+template <class T>
+inline bool snapshot_write(const char* _fname, const int64_t, const T*, const T*, const T*, const T*, const T*,
+                           const double, const int32_t = 0) {
+  fprintf(stderr, "Cannot write snapshot %s, built without zlib!\n", _fname);
+  return false;
+}
+
+template <class T>
+inline void snapshot_read(const char* _fname, std::vector<T>&, std::vector<T>&, std::vector<T>&,
+                          std::vector<T>&, std::vector<T>&) {
+  fprintf(stderr, "Cannot read snapshot %s, built without zlib!\n", _fname);
+  exit(EXIT_FAILURE);
+}
+
+#endif